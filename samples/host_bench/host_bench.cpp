@@ -0,0 +1,922 @@
+#include "memory_manager.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <malloc.h>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Allocator regression gate. Every pattern runs against a freshly created heap and reports the cost
+// of one operation, the resident memory on top of the peak of live requested bytes and the
+// fragmentation of free memory at the end of the allocation phase.
+
+using namespace hh;
+
+namespace
+{
+  // C runtime heap as the reference point.
+  class system_heap final : public memory_manager
+  {
+  public:
+    void* allocate(uint32_t allocation_size) noexcept override
+    {
+      auto* ptr = std::malloc(allocation_size);
+
+      if (ptr == nullptr)
+      {
+        record_failure(allocation_size);
+        return nullptr;
+      }
+
+      record_allocation(ptr, allocation_size, malloc_usable_size(ptr));
+      return ptr;
+    }
+
+    void* allocate_align(uint32_t allocation_size, std::align_val_t align) noexcept override
+    {
+      const auto alignment = static_cast<size_t>(align);
+      auto* ptr = std::aligned_alloc(alignment, (allocation_size + alignment - 1) & ~(alignment - 1));
+
+      if (ptr == nullptr)
+      {
+        record_failure(allocation_size);
+        return nullptr;
+      }
+
+      record_allocation(ptr, allocation_size, malloc_usable_size(ptr), alignment);
+      return ptr;
+    }
+
+    void deallocate(void* ptr_to_allocation) noexcept override
+    {
+      record_deallocation(ptr_to_allocation, malloc_usable_size(ptr_to_allocation));
+      std::free(ptr_to_allocation);
+    }
+  };
+
+  class xorshift
+  {
+  private:
+    uint64_t state_;
+
+  public:
+    explicit xorshift(uint64_t seed) noexcept : state_{ seed | 1 } {}
+
+    uint64_t next() noexcept
+    {
+      state_ ^= state_ << 13;
+      state_ ^= state_ >> 7;
+      state_ ^= state_ << 17;
+      return state_;
+    }
+
+    uint32_t range(uint32_t low, uint32_t high) noexcept
+    {
+      return low + static_cast<uint32_t>(next() % (high - low + 1));
+    }
+
+    // Small sizes dominate real workloads, so sizes are drawn uniformly on a log scale.
+    uint32_t log_size(uint32_t low, uint32_t high) noexcept
+    {
+      const uint32_t low_bit = 31 - __builtin_clz(low);
+      const uint32_t high_bit = 31 - __builtin_clz(high);
+      const uint32_t bit = range(low_bit, high_bit);
+      const uint32_t size = (1u << bit) + static_cast<uint32_t>(next() & ((1u << bit) - 1));
+
+      return size < low ? low : (size > high ? high : size);
+    }
+  };
+
+  struct run_result
+  {
+    uint64_t operation_count;
+    uint64_t nanoseconds;
+    uint64_t failed_count;
+    uint64_t peak_requested_bytes;
+    // Snapshot at the end of the allocation phase, before the pattern frees what is left.
+    EFI_SAMPLE_HEAP_STATISTICS statistics;
+  };
+
+  // Requested bytes currently live, the baseline for the RSS overhead.
+  class live_tracker
+  {
+  private:
+    uint64_t live_bytes_ = 0;
+    uint64_t peak_bytes_ = 0;
+
+  public:
+    void allocated(uint64_t size) noexcept
+    {
+      live_bytes_ += size;
+      peak_bytes_ = live_bytes_ > peak_bytes_ ? live_bytes_ : peak_bytes_;
+    }
+
+    void freed(uint64_t size) noexcept
+    {
+      live_bytes_ -= size;
+    }
+
+    uint64_t peak() const noexcept
+    {
+      return peak_bytes_;
+    }
+  };
+
+  // Resident pages have to be real, touch the first cache line and every page of the block.
+  void touch(void* ptr, uint32_t size) noexcept
+  {
+    auto* bytes = static_cast<uint8_t*>(ptr);
+
+    std::memset(bytes, 0xA5, size < 64 ? size : 64);
+
+    for (uint32_t offset = common::page_size; offset < size; offset += common::page_size)
+    {
+      bytes[offset] = 0xA5;
+    }
+  }
+
+  uint64_t elapsed_ns(std::chrono::steady_clock::time_point start)
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  // Bursts of allocations released in reverse order, like nested scopes.
+  run_result run_lifo(memory_manager& heap, uint64_t operation_count, uint64_t seed)
+  {
+    constexpr uint32_t max_depth = 256;
+    xorshift random{ seed };
+    live_tracker tracker{};
+    run_result result{};
+    void* blocks[max_depth];
+    uint32_t sizes[max_depth];
+
+    const auto start = std::chrono::steady_clock::now();
+
+    while (result.operation_count < operation_count)
+    {
+      const uint32_t depth = random.range(1, max_depth);
+      uint32_t allocated_count = 0;
+
+      for (uint32_t j = 0; j < depth; j++)
+      {
+        sizes[allocated_count] = random.log_size(16, 1024);
+        blocks[allocated_count] = heap.allocate(sizes[allocated_count]);
+        result.operation_count++;
+
+        if (blocks[allocated_count] == nullptr)
+        {
+          result.failed_count++;
+          continue;
+        }
+
+        touch(blocks[allocated_count], sizes[allocated_count]);
+        tracker.allocated(sizes[allocated_count]);
+        allocated_count++;
+      }
+
+      while (allocated_count != 0)
+      {
+        allocated_count--;
+        heap.deallocate(blocks[allocated_count]);
+        tracker.freed(sizes[allocated_count]);
+        result.operation_count++;
+      }
+    }
+
+    result.nanoseconds = elapsed_ns(start);
+    result.peak_requested_bytes = tracker.peak();
+    result.statistics = heap.statistics();
+
+    return result;
+  }
+
+  // Random replacement in a fixed table of slots. Lifetimes are unrelated to allocation order, which
+  // is the worst case for fragmentation.
+  run_result run_random(memory_manager& heap, uint64_t operation_count, uint64_t seed)
+  {
+    constexpr uint32_t slot_count = 16384;
+    xorshift random{ seed };
+    live_tracker tracker{};
+    run_result result{};
+    std::vector<void*> blocks(slot_count, nullptr);
+    std::vector<uint32_t> sizes(slot_count, 0);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (; result.operation_count < operation_count; result.operation_count++)
+    {
+      const auto slot = static_cast<uint32_t>(random.next() % slot_count);
+
+      if (blocks[slot] != nullptr)
+      {
+        heap.deallocate(blocks[slot]);
+        tracker.freed(sizes[slot]);
+        blocks[slot] = nullptr;
+        continue;
+      }
+
+      sizes[slot] = random.log_size(16, 16384);
+      blocks[slot] = heap.allocate(sizes[slot]);
+
+      if (blocks[slot] == nullptr)
+      {
+        result.failed_count++;
+        continue;
+      }
+
+      touch(blocks[slot], sizes[slot]);
+      tracker.allocated(sizes[slot]);
+    }
+
+    result.nanoseconds = elapsed_ns(start);
+    result.peak_requested_bytes = tracker.peak();
+    result.statistics = heap.statistics();
+
+    for (uint32_t j = 0; j < slot_count; j++)
+    {
+      if (blocks[j] != nullptr)
+      {
+        heap.deallocate(blocks[j]);
+      }
+    }
+
+    return result;
+  }
+
+  // Random replacement like run_random, but every other block is a page aligned buffer of 1 to 64 pages,
+  // the mix of DMA buffers and small objects a driver keeps around.
+  run_result run_pages(memory_manager& heap, uint64_t operation_count, uint64_t seed)
+  {
+    constexpr uint32_t slot_count = 2048;
+    xorshift random{ seed };
+    live_tracker tracker{};
+    run_result result{};
+    std::vector<void*> blocks(slot_count, nullptr);
+    std::vector<uint32_t> sizes(slot_count, 0);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (; result.operation_count < operation_count; result.operation_count++)
+    {
+      const auto slot = static_cast<uint32_t>(random.next() % slot_count);
+
+      if (blocks[slot] != nullptr)
+      {
+        heap.deallocate_sized(blocks[slot], sizes[slot]);
+        tracker.freed(sizes[slot]);
+        blocks[slot] = nullptr;
+        continue;
+      }
+
+      if (slot & 1)
+      {
+        sizes[slot] = random.range(1, 64) * common::page_size;
+        blocks[slot] = heap.allocate_align(sizes[slot], std::align_val_t{ common::page_size });
+      }
+      else
+      {
+        sizes[slot] = random.log_size(16, 2048);
+        blocks[slot] = heap.allocate(sizes[slot]);
+      }
+
+      if (blocks[slot] == nullptr)
+      {
+        result.failed_count++;
+        continue;
+      }
+
+      touch(blocks[slot], sizes[slot]);
+      tracker.allocated(sizes[slot]);
+    }
+
+    result.nanoseconds = elapsed_ns(start);
+    result.peak_requested_bytes = tracker.peak();
+    result.statistics = heap.statistics();
+
+    for (uint32_t j = 0; j < slot_count; j++)
+    {
+      if (blocks[j] != nullptr)
+      {
+        heap.deallocate_sized(blocks[j], sizes[j]);
+      }
+    }
+
+    return result;
+  }
+
+  // One thread allocates, another one frees, so every block is released away from where it was
+  // allocated. Blocks are handed over through a single producer, single consumer ring.
+  run_result run_producer_consumer(memory_manager& heap, uint64_t operation_count, uint64_t seed)
+  {
+    constexpr uint32_t ring_size = 4096;
+
+    struct ring_entry
+    {
+      void* block;
+      uint32_t size;
+    };
+
+    auto ring = std::make_unique<ring_entry[]>(ring_size);
+    alignas(64) volatile uint64_t head = 0;
+    alignas(64) volatile uint64_t tail = 0;
+    const uint64_t block_count = operation_count / 2;
+    uint64_t live_bytes = 0;
+    uint64_t peak_bytes = 0;
+    run_result result{};
+
+    const auto start = std::chrono::steady_clock::now();
+
+    std::thread consumer{ [&]
+      {
+        for (uint64_t j = 0; j < block_count; j++)
+        {
+          while (__atomic_load_n(&tail, __ATOMIC_ACQUIRE) == j)
+          {
+            _mm_pause();
+          }
+
+          const auto entry = ring[j % ring_size];
+
+          if (entry.block != nullptr)
+          {
+            heap.deallocate(entry.block);
+            __atomic_fetch_sub(&live_bytes, entry.size, __ATOMIC_RELAXED);
+          }
+
+          __atomic_store_n(&head, j + 1, __ATOMIC_RELEASE);
+        }
+      } };
+
+    xorshift random{ seed };
+
+    for (uint64_t j = 0; j < block_count; j++)
+    {
+      while (j - __atomic_load_n(&head, __ATOMIC_ACQUIRE) == ring_size)
+      {
+        _mm_pause();
+      }
+
+      const uint32_t size = random.log_size(16, 512);
+      auto* block = heap.allocate(size);
+
+      if (block == nullptr)
+      {
+        result.failed_count++;
+      }
+      else
+      {
+        touch(block, size);
+        const uint64_t live = __atomic_add_fetch(&live_bytes, size, __ATOMIC_RELAXED);
+        peak_bytes = live > peak_bytes ? live : peak_bytes;
+      }
+
+      ring[j % ring_size] = { block, size };
+      __atomic_store_n(&tail, j + 1, __ATOMIC_RELEASE);
+    }
+
+    consumer.join();
+
+    result.nanoseconds = elapsed_ns(start);
+    result.operation_count = block_count * 2;
+    result.peak_requested_bytes = peak_bytes;
+    result.statistics = heap.statistics();
+
+    return result;
+  }
+
+  // Frees a list of small nodes built in one go, like the destruction of a big container. Only the frees are
+  // counted and timed.
+  run_result run_teardown(memory_manager& heap, uint64_t operation_count, uint64_t seed)
+  {
+    xorshift random{ seed };
+    live_tracker tracker{};
+    run_result result{};
+    std::vector<void*> nodes(operation_count, nullptr);
+    std::vector<uint32_t> sizes(operation_count, 0);
+
+    for (uint64_t j = 0; j < operation_count; j++)
+    {
+      sizes[j] = random.range(24, 64);
+      nodes[j] = heap.allocate(sizes[j]);
+
+      if (nodes[j] == nullptr)
+      {
+        result.failed_count++;
+        continue;
+      }
+
+      touch(nodes[j], sizes[j]);
+      tracker.allocated(sizes[j]);
+    }
+
+    result.peak_requested_bytes = tracker.peak();
+    result.statistics = heap.statistics();
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (uint64_t j = 0; j < operation_count; j++)
+    {
+      if (nodes[j] != nullptr)
+      {
+        heap.deallocate_sized(nodes[j], sizes[j]);
+        result.operation_count++;
+      }
+    }
+
+    heap.flush();
+    result.nanoseconds = elapsed_ns(start);
+
+    return result;
+  }
+
+  // Traces are either binary files written by trace_recorder (see alloc_trace.hpp) or text, one
+  // operation per line:
+  //   a <id> <size>   allocate
+  //   f <id>          free
+  //   r <id> <size>   reallocate
+  // Ids are arbitrary numbers, recorded traces use block addresses. They are renumbered into dense
+  // slots when the trace is loaded.
+  struct trace_operation
+  {
+    char kind;
+    uint32_t slot;
+    uint32_t size;
+    uint32_t align;
+  };
+
+  struct trace
+  {
+    std::vector<trace_operation> operations;
+    uint32_t slot_count;
+  };
+
+  class slot_map
+  {
+  private:
+    std::unordered_map<uint64_t, uint32_t> slots_{};
+
+  public:
+    uint32_t slot_of(uint64_t id, trace& loaded)
+    {
+      const auto [it, inserted] = slots_.try_emplace(id, loaded.slot_count);
+      loaded.slot_count += inserted;
+      return it->second;
+    }
+  };
+
+  bool load_binary_trace(const char* path, const std::vector<uint8_t>& content, trace& loaded)
+  {
+    uint64_t record_count = 0;
+    uint64_t lost_count = 0;
+    uint64_t first_tsc = 0;
+
+    if (!trace_codec::read_header(content.data(), content.size(), record_count, lost_count, first_tsc))
+    {
+      return false;
+    }
+
+    if (lost_count != 0)
+    {
+      std::fprintf(stderr, "%s: %llu records were overwritten before the flush\n", path, static_cast<unsigned long long>(lost_count));
+    }
+
+    const uint8_t* cursor = content.data() + trace_codec::header_size;
+    const uint8_t* end = content.data() + content.size();
+    trace_codec codec{ first_tsc };
+    slot_map slots{};
+    static constexpr char kinds[] = { 'a', 'f', 'r' };
+
+    for (uint64_t j = 0; j < record_count; j++)
+    {
+      trace_record record{};
+
+      if ((cursor = codec.decode(cursor, end, record)) == nullptr)
+      {
+        std::fprintf(stderr, "%s: record %llu is truncated\n", path, static_cast<unsigned long long>(j));
+        return false;
+      }
+
+      const uint32_t align = record.align_log2 != 0 ? 1u << record.align_log2 : 0;
+      loaded.operations.push_back({ kinds[static_cast<uint8_t>(record.op)], slots.slot_of(record.ptr, loaded), record.size, align });
+    }
+
+    return true;
+  }
+
+  bool load_trace(const char* path, trace& loaded)
+  {
+    std::ifstream file{ path, std::ios::binary };
+
+    if (!file)
+    {
+      return false;
+    }
+
+    const std::vector<uint8_t> content{ std::istreambuf_iterator<char>{ file }, std::istreambuf_iterator<char>{} };
+
+    if (content.size() >= sizeof(trace_codec::magic) &&
+      std::memcmp(content.data(), trace_codec::magic, sizeof(trace_codec::magic)) == 0)
+    {
+      return load_binary_trace(path, content, loaded);
+    }
+
+    std::istringstream input{ std::string{ content.begin(), content.end() } };
+    slot_map slots{};
+    std::string line{};
+
+    while (std::getline(input, line))
+    {
+      std::istringstream fields{ line };
+      char kind = 0;
+      uint64_t id = 0;
+      uint32_t size = 0;
+
+      if (!(fields >> kind) || kind == '#')
+      {
+        continue;
+      }
+
+      if (!(fields >> id) || (kind != 'f' && !(fields >> size)) || (kind != 'a' && kind != 'f' && kind != 'r'))
+      {
+        std::fprintf(stderr, "%s: malformed line \"%s\"\n", path, line.c_str());
+        return false;
+      }
+
+      loaded.operations.push_back({ kind, slots.slot_of(id, loaded), size, 0 });
+    }
+
+    return true;
+  }
+
+  run_result run_trace(memory_manager& heap, const trace& replayed)
+  {
+    live_tracker tracker{};
+    run_result result{};
+    std::vector<void*> blocks(replayed.slot_count, nullptr);
+    std::vector<uint32_t> sizes(replayed.slot_count, 0);
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (const auto& operation : replayed.operations)
+    {
+      auto& block = blocks[operation.slot];
+      auto& size = sizes[operation.slot];
+
+      result.operation_count++;
+
+      // Traces taken from a ring buffer may have lost the free of a reused id.
+      if ((operation.kind == 'f' || operation.kind == 'a') && block != nullptr)
+      {
+        heap.deallocate(block);
+        tracker.freed(size);
+        block = nullptr;
+      }
+
+      if (operation.kind == 'f')
+      {
+        continue;
+      }
+
+      void* new_block = block != nullptr ? heap.reallocate(block, size, operation.size) :
+        operation.align != 0 ? heap.allocate_align(operation.size, static_cast<std::align_val_t>(operation.align)) : heap.allocate(operation.size);
+
+      if (new_block == nullptr)
+      {
+        result.failed_count++;
+        continue;
+      }
+
+      if (block != nullptr)
+      {
+        tracker.freed(size);
+      }
+
+      touch(new_block, operation.size);
+      tracker.allocated(operation.size);
+      block = new_block;
+      size = operation.size;
+    }
+
+    result.nanoseconds = elapsed_ns(start);
+    result.peak_requested_bytes = tracker.peak();
+    result.statistics = heap.statistics();
+
+    for (auto* block : blocks)
+    {
+      if (block != nullptr)
+      {
+        heap.deallocate(block);
+      }
+    }
+
+    return result;
+  }
+
+  // Peak RSS is process wide, writing 5 to clear_refs resets it before every run.
+  void reset_peak_rss()
+  {
+    if (auto* clear_refs = std::fopen("/proc/self/clear_refs", "w"); clear_refs != nullptr)
+    {
+      std::fputs("5", clear_refs);
+      std::fclose(clear_refs);
+    }
+  }
+
+  uint64_t read_status_kb(std::string_view field)
+  {
+    std::ifstream status{ "/proc/self/status" };
+    std::string line{};
+
+    while (std::getline(status, line))
+    {
+      if (line.compare(0, field.size(), field) == 0)
+      {
+        return std::strtoull(line.c_str() + field.size() + 1, nullptr, 10);
+      }
+    }
+
+    return 0;
+  }
+
+  std::unique_ptr<memory_manager> create_heap(std::string_view name)
+  {
+    if (name == "tlsf")
+    {
+      return std::make_unique<tlsf_allocator<>>();
+    }
+
+    if (name == "tlsf-deferred")
+    {
+      return std::make_unique<tlsf_allocator<geometric_growth<>, true, 32>>();
+    }
+
+    if (name == "tlsf-nobuddy")
+    {
+      return std::make_unique<tlsf_allocator<geometric_growth<>, true, 0, false>>();
+    }
+
+    if (name == "tlsf-noslab")
+    {
+      return std::make_unique<tlsf_allocator<geometric_growth<>, false>>();
+    }
+
+    if (name == "tlsf-ticket")
+    {
+      return std::make_unique<tlsf_allocator<geometric_growth<>, true, 0, true, common::ticket_locking>>();
+    }
+
+    if (name == "tlsf-mcs")
+    {
+      return std::make_unique<tlsf_allocator<geometric_growth<>, true, 0, true, common::mcs_locking>>();
+    }
+
+    if (name == "tlsf-large-pages")
+    {
+      return std::make_unique<tlsf_allocator<large_page_arena<>>>();
+    }
+
+    if (name == "per-cpu")
+    {
+      return std::make_unique<per_cpu_tlsf_allocator<common::page_size * 8192>>();
+    }
+
+    if (name == "malloc")
+    {
+      return std::make_unique<system_heap>();
+    }
+
+    return nullptr;
+  }
+
+  struct gate
+  {
+    double max_ns_per_op = 0;
+    double max_rss_overhead_percent = 0;
+    uint64_t max_fragmentation_percent = 0;
+  };
+
+  struct options
+  {
+    std::vector<std::string_view> allocators{};
+    std::vector<std::string_view> patterns{};
+    std::vector<const char*> traces{};
+    uint64_t operation_count = 1 << 22;
+    uint64_t seed = 0x9E3779B97F4A7C15;
+    gate limits{};
+  };
+
+  void print_usage()
+  {
+    std::puts(
+      "usage: hh_host_bench [options]\n"
+      "  --allocator NAME          tlsf, tlsf-deferred, tlsf-nobuddy, tlsf-noslab, tlsf-ticket,\n"
+      "                            tlsf-mcs, tlsf-large-pages, per-cpu or malloc, may be repeated\n"
+      "  --pattern NAME            lifo, random, producer-consumer, pages or teardown, may be repeated\n"
+      "  --trace FILE              replay a recorded trace, may be repeated\n"
+      "  --ops N                   operations per synthetic pattern\n"
+      "  --seed N                  seed of the synthetic patterns\n"
+      "  --max-ns-per-op X         fail if any run is slower\n"
+      "  --max-rss-overhead PCT    fail if resident memory exceeds peak live bytes by more\n"
+      "  --max-fragmentation PCT   fail if free memory is more fragmented");
+  }
+
+  bool parse_options(int argc, char** argv, options& parsed)
+  {
+    for (int j = 1; j < argc; j++)
+    {
+      const std::string_view option{ argv[j] };
+
+      if (option == "--help" || j + 1 == argc)
+      {
+        return false;
+      }
+
+      const char* value = argv[++j];
+
+      if (option == "--allocator")
+      {
+        parsed.allocators.emplace_back(value);
+      }
+      else if (option == "--pattern")
+      {
+        parsed.patterns.emplace_back(value);
+      }
+      else if (option == "--trace")
+      {
+        parsed.traces.push_back(value);
+      }
+      else if (option == "--ops")
+      {
+        parsed.operation_count = std::strtoull(value, nullptr, 0);
+      }
+      else if (option == "--seed")
+      {
+        parsed.seed = std::strtoull(value, nullptr, 0);
+      }
+      else if (option == "--max-ns-per-op")
+      {
+        parsed.limits.max_ns_per_op = std::strtod(value, nullptr);
+      }
+      else if (option == "--max-rss-overhead")
+      {
+        parsed.limits.max_rss_overhead_percent = std::strtod(value, nullptr);
+      }
+      else if (option == "--max-fragmentation")
+      {
+        parsed.limits.max_fragmentation_percent = std::strtoull(value, nullptr, 0);
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+    if (parsed.allocators.empty())
+    {
+      parsed.allocators = { "tlsf", "tlsf-noslab", "per-cpu", "malloc" };
+    }
+
+    if (parsed.patterns.empty() && parsed.traces.empty())
+    {
+      parsed.patterns = { "lifo", "random", "producer-consumer" };
+    }
+
+    return true;
+  }
+
+  // Prints one row and returns false if the run breaks a limit.
+  bool report(std::string_view pattern, std::string_view allocator, const run_result& result, uint64_t rss_growth_kb, const gate& limits)
+  {
+    const double ns_per_op = result.operation_count != 0 ? static_cast<double>(result.nanoseconds) / result.operation_count : 0;
+    const int64_t overhead_kb = static_cast<int64_t>(rss_growth_kb) - static_cast<int64_t>(result.peak_requested_bytes / 1024);
+    const double overhead_percent = result.peak_requested_bytes != 0 ? overhead_kb * 102400.0 / result.peak_requested_bytes : 0;
+
+    std::printf("%-24.*s %-18.*s %12llu %9.1f %14llu %12lld %8.1f%% %6llu%% %9llu\n",
+      static_cast<int>(pattern.size()), pattern.data(), static_cast<int>(allocator.size()), allocator.data(),
+      static_cast<unsigned long long>(result.operation_count), ns_per_op,
+      static_cast<unsigned long long>(result.peak_requested_bytes / 1024), static_cast<long long>(overhead_kb), overhead_percent,
+      static_cast<unsigned long long>(result.statistics.FragmentationPercent), static_cast<unsigned long long>(result.failed_count));
+
+    bool passed = true;
+
+    if (limits.max_ns_per_op != 0 && ns_per_op > limits.max_ns_per_op)
+    {
+      std::printf("  FAIL: %.1f ns/op is above %.1f\n", ns_per_op, limits.max_ns_per_op);
+      passed = false;
+    }
+
+    if (limits.max_rss_overhead_percent != 0 && overhead_percent > limits.max_rss_overhead_percent)
+    {
+      std::printf("  FAIL: RSS overhead %.1f%% is above %.1f%%\n", overhead_percent, limits.max_rss_overhead_percent);
+      passed = false;
+    }
+
+    if (limits.max_fragmentation_percent != 0 && result.statistics.FragmentationPercent > limits.max_fragmentation_percent)
+    {
+      std::printf("  FAIL: fragmentation %llu%% is above %llu%%\n",
+        static_cast<unsigned long long>(result.statistics.FragmentationPercent), static_cast<unsigned long long>(limits.max_fragmentation_percent));
+      passed = false;
+    }
+
+    return passed;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  options parsed{};
+
+  if (!parse_options(argc, argv, parsed))
+  {
+    print_usage();
+    return 2;
+  }
+
+  std::vector<std::pair<const char*, trace>> traces{};
+
+  for (const char* path : parsed.traces)
+  {
+    trace loaded{};
+
+    if (!load_trace(path, loaded))
+    {
+      std::fprintf(stderr, "failed to load trace %s\n", path);
+      return 2;
+    }
+
+    traces.emplace_back(path, std::move(loaded));
+  }
+
+  std::printf("%-24s %-18s %12s %9s %14s %12s %9s %7s %9s\n",
+    "pattern", "allocator", "ops", "ns/op", "peak live KB", "RSS over KB", "over %", "frag", "failures");
+
+  bool passed = true;
+
+  auto measure = [&](std::string_view pattern, std::string_view allocator, auto&& run)
+    {
+      // Memory the C runtime kept from the previous run would hide the growth of the malloc heap.
+      malloc_trim(0);
+      reset_peak_rss();
+      const uint64_t baseline_kb = read_status_kb("VmRSS:");
+      auto heap = create_heap(allocator);
+
+      if (heap == nullptr)
+      {
+        std::fprintf(stderr, "unknown allocator %.*s\n", static_cast<int>(allocator.size()), allocator.data());
+        passed = false;
+        return;
+      }
+
+      const auto result = run(*heap);
+      const uint64_t peak_kb = read_status_kb("VmHWM:");
+
+      passed &= report(pattern, allocator, result, peak_kb > baseline_kb ? peak_kb - baseline_kb : 0, parsed.limits);
+    };
+
+  for (auto allocator : parsed.allocators)
+  {
+    for (auto pattern : parsed.patterns)
+    {
+      if (pattern == "lifo")
+      {
+        measure(pattern, allocator, [&](memory_manager& heap) { return run_lifo(heap, parsed.operation_count, parsed.seed); });
+      }
+      else if (pattern == "random")
+      {
+        measure(pattern, allocator, [&](memory_manager& heap) { return run_random(heap, parsed.operation_count, parsed.seed); });
+      }
+      else if (pattern == "producer-consumer")
+      {
+        measure(pattern, allocator, [&](memory_manager& heap) { return run_producer_consumer(heap, parsed.operation_count, parsed.seed); });
+      }
+      else if (pattern == "pages")
+      {
+        measure(pattern, allocator, [&](memory_manager& heap) { return run_pages(heap, parsed.operation_count, parsed.seed); });
+      }
+      else if (pattern == "teardown")
+      {
+        measure(pattern, allocator, [&](memory_manager& heap) { return run_teardown(heap, parsed.operation_count, parsed.seed); });
+      }
+      else
+      {
+        std::fprintf(stderr, "unknown pattern %.*s\n", static_cast<int>(pattern.size()), pattern.data());
+        return 2;
+      }
+    }
+
+    for (const auto& [path, replayed] : traces)
+    {
+      measure(path, allocator, [&](memory_manager& heap) { return run_trace(heap, replayed); });
+    }
+  }
+
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,224 @@
+#include "common.hpp"
+#include "uefi.hpp"
+#include "efi_stub.hpp"
+#include <intrin.h>
+#include <cstdio>
+#include <cstdlib>
+#include <sched.h>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Host implementations of the boot services and hh::common routines the allocators depend on.
+// Pages come from mmap, so pool commit and release behave like AllocatePages/FreePages do in firmware.
+
+static void* map_pages(size_t size) noexcept
+{
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return memory == MAP_FAILED ? nullptr : memory;
+}
+
+static EFI_STATUS EFIAPI host_allocate_pages(EFI_ALLOCATE_TYPE type, EFI_MEMORY_TYPE memory_type, UINTN pages, EFI_PHYSICAL_ADDRESS* memory)
+{
+  if (type != AllocateAnyPages || memory == nullptr)
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  void* pages_memory = map_pages(EFI_PAGES_TO_SIZE(pages));
+
+  if (pages_memory == nullptr)
+  {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  *memory = reinterpret_cast<EFI_PHYSICAL_ADDRESS>(pages_memory);
+  return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI host_free_pages(EFI_PHYSICAL_ADDRESS memory, UINTN pages)
+{
+  return munmap(reinterpret_cast<void*>(memory), EFI_PAGES_TO_SIZE(pages)) == 0 ? EFI_SUCCESS : EFI_INVALID_PARAMETER;
+}
+
+static EFI_STATUS EFIAPI host_allocate_pool(EFI_MEMORY_TYPE pool_type, UINTN size, void** buffer)
+{
+  *buffer = std::malloc(size);
+  return *buffer != nullptr ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+static EFI_STATUS EFIAPI host_free_pool(void* buffer)
+{
+  std::free(buffer);
+  return EFI_SUCCESS;
+}
+
+static EFI_BOOT_SERVICES host_boot_services = { host_allocate_pages, host_free_pages, host_allocate_pool, host_free_pool };
+
+EFI_BOOT_SERVICES* gBS = &host_boot_services;
+EFI_GUID gEfiSampleDriverProtocolGuid = EFI_SAMPLE_DRIVER_PROTOCOL_GUID;
+
+namespace hh
+{
+  void bug_check(const bug_check_codes code, const uint64_t arg0, const uint64_t arg1,
+    const uint64_t arg2, const uint64_t arg3) noexcept
+  {
+    std::fprintf(stderr, "bug check %d (0x%llx, 0x%llx, 0x%llx, 0x%llx)\n", static_cast<int>(code), static_cast<unsigned long long>(arg0),
+      static_cast<unsigned long long>(arg1), static_cast<unsigned long long>(arg2), static_cast<unsigned long long>(arg3));
+    std::abort();
+  }
+}
+
+namespace hh::common
+{
+  void initialize_processors() noexcept
+  {
+  }
+
+  uint32_t processor_count() noexcept
+  {
+    static const uint32_t count = []
+      {
+        const long online_count = sysconf(_SC_NPROCESSORS_ONLN);
+        return online_count < 1 ? 1u : (online_count > max_processors ? max_processors : static_cast<uint32_t>(online_count));
+      }();
+
+    return count;
+  }
+
+  uint32_t current_processor() noexcept
+  {
+    const int processor_number = sched_getcpu();
+    return processor_number >= 0 && static_cast<uint32_t>(processor_number) < processor_count() ? processor_number : 0;
+  }
+
+  uint64_t processor_timestamp(uint32_t& processor) noexcept
+  {
+    processor = current_processor();
+    return __rdtsc();
+  }
+
+  // One thread per AP, the procedure counts as finished when all of them have been joined.
+  static std::vector<std::thread> procedure_threads{};
+  static volatile long running_threads = 0;
+  static bool procedure_parked = false;
+  // Set on the threads that stand in for APs.
+  static thread_local bool application_processor = false;
+
+  static void join_procedure_threads() noexcept
+  {
+    for (auto& thread : procedure_threads)
+    {
+      thread.join();
+    }
+
+    procedure_threads.clear();
+  }
+
+  static bool start_procedure(processor_procedure procedure, void* argument) noexcept
+  {
+    if (processor_count() < 2 || procedure_parked)
+    {
+      return false;
+    }
+
+    join_procedure_threads();
+    running_threads = processor_count() - 1;
+
+    for (uint32_t j = 1; j < processor_count(); j++)
+    {
+      procedure_threads.emplace_back([procedure, argument]
+        {
+          application_processor = true;
+          procedure(argument);
+          __atomic_sub_fetch(&running_threads, 1, __ATOMIC_RELEASE);
+        });
+    }
+
+    return true;
+  }
+
+  bool start_on_application_processors(processor_procedure procedure, void* argument) noexcept
+  {
+    return start_procedure(procedure, argument);
+  }
+
+  void wait_for_application_processors() noexcept
+  {
+    if (!procedure_parked)
+    {
+      join_procedure_threads();
+    }
+  }
+
+  bool application_processors_idle() noexcept
+  {
+    return __atomic_load_n(&running_threads, __ATOMIC_ACQUIRE) == 0;
+  }
+
+  bool park_application_processors(processor_procedure procedure, void* argument) noexcept
+  {
+    procedure_parked = start_procedure(procedure, argument);
+    return procedure_parked;
+  }
+
+  void unpark_application_processors() noexcept
+  {
+    if (procedure_parked)
+    {
+      join_procedure_threads();
+      procedure_parked = false;
+    }
+  }
+
+  // Every host thread may commit memory, except the ones that run a procedure in place of the APs.
+  bool is_bootstrap_processor() noexcept
+  {
+    return !application_processor;
+  }
+
+  void* allocate_pages(size_t size, size_t alignment) noexcept
+  {
+    size = EFI_PAGES_TO_SIZE(EFI_SIZE_TO_PAGES(size));
+    const size_t slack = alignment > page_size ? alignment - page_size : 0;
+    auto* memory = static_cast<uint8_t*>(map_pages(size + slack));
+
+    if (memory == nullptr || slack == 0)
+    {
+      return memory;
+    }
+
+    auto* aligned_memory = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(memory) + alignment - 1) & ~(alignment - 1));
+    const size_t head = aligned_memory - memory;
+    const size_t tail = slack - head;
+
+    if (head != 0)
+    {
+      munmap(memory, head);
+    }
+
+    if (tail != 0)
+    {
+      munmap(aligned_memory + size, tail);
+    }
+
+    return aligned_memory;
+  }
+
+  void free_pages(void* memory, size_t size) noexcept
+  {
+    munmap(memory, EFI_PAGES_TO_SIZE(EFI_SIZE_TO_PAGES(size)));
+  }
+
+  // Transparent huge pages are the closest host equivalent of promoting the firmware mappings.
+  uint32_t map_with_large_pages(void* memory, size_t size) noexcept
+  {
+    if (madvise(memory, size, MADV_HUGEPAGE) != 0)
+    {
+      return 0;
+    }
+
+    return static_cast<uint32_t>(size / large_page_size);
+  }
+}
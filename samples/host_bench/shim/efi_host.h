@@ -0,0 +1,79 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Subset of the UEFI base types and boot services the allocator headers use. Boot services are
+// backed by the C runtime and mmap in host_support.cpp.
+
+#define EFIAPI
+#define IN
+#define OUT
+#define OPTIONAL
+#define CONST const
+#define VOID void
+#define TRUE 1
+#define FALSE 0
+
+typedef uint64_t UINTN;
+typedef int64_t INTN;
+typedef uint64_t UINT64;
+typedef int64_t INT64;
+typedef uint32_t UINT32;
+typedef int32_t INT32;
+typedef uint16_t UINT16;
+typedef uint8_t UINT8;
+typedef char CHAR8;
+typedef uint16_t CHAR16;
+typedef unsigned char BOOLEAN;
+
+typedef UINTN EFI_STATUS;
+typedef void* EFI_HANDLE;
+typedef void* EFI_EVENT;
+typedef UINT64 EFI_PHYSICAL_ADDRESS;
+
+typedef struct
+{
+  UINT32 Data1;
+  UINT16 Data2;
+  UINT16 Data3;
+  UINT8 Data4[8];
+} EFI_GUID;
+
+#define EFI_SUCCESS 0
+#define EFI_ERROR(status) ((INTN)(status) < 0)
+#define EFI_INVALID_PARAMETER ((EFI_STATUS)0x8000000000000002ULL)
+#define EFI_OUT_OF_RESOURCES ((EFI_STATUS)0x8000000000000009ULL)
+#define EFI_NOT_FOUND ((EFI_STATUS)0x800000000000000EULL)
+#define EFI_NOT_READY ((EFI_STATUS)0x8000000000000006ULL)
+
+#define EFI_PAGE_SIZE 0x1000
+#define EFI_SIZE_TO_PAGES(size) (((size) >> 12) + (((size) & 0xFFF) ? 1 : 0))
+#define EFI_PAGES_TO_SIZE(pages) ((UINTN)(pages) << 12)
+
+typedef enum
+{
+  EfiReservedMemoryType,
+  EfiLoaderCode,
+  EfiLoaderData,
+  EfiBootServicesCode,
+  EfiBootServicesData,
+  EfiRuntimeServicesCode,
+  EfiRuntimeServicesData
+} EFI_MEMORY_TYPE;
+
+typedef enum
+{
+  AllocateAnyPages,
+  AllocateMaxAddress,
+  AllocateAddress
+} EFI_ALLOCATE_TYPE;
+
+typedef struct
+{
+  EFI_STATUS (EFIAPI* AllocatePages)(EFI_ALLOCATE_TYPE Type, EFI_MEMORY_TYPE MemoryType, UINTN Pages, EFI_PHYSICAL_ADDRESS* Memory);
+  EFI_STATUS (EFIAPI* FreePages)(EFI_PHYSICAL_ADDRESS Memory, UINTN Pages);
+  EFI_STATUS (EFIAPI* AllocatePool)(EFI_MEMORY_TYPE PoolType, UINTN Size, void** Buffer);
+  EFI_STATUS (EFIAPI* FreePool)(void* Buffer);
+} EFI_BOOT_SERVICES;
+
+extern EFI_BOOT_SERVICES* gBS;
@@ -0,0 +1,10 @@
+#pragma once
+
+extern "C"
+{
+#include <efi_host.h>
+#include "drvproto.h"
+}
+
+// MSVC keyword, the host compilers only see the class as an ordinary base.
+#define abstract
@@ -0,0 +1,92 @@
+#pragma once
+#include <x86intrin.h>
+#include <sched.h>
+#include <cstdint>
+
+// MSVC intrinsics used by the allocator headers, implemented with GCC/Clang builtins.
+
+inline unsigned char _interlockedbittestandset(volatile long* base, long bit)
+{
+  return (__atomic_fetch_or(base, 1L << bit, __ATOMIC_SEQ_CST) >> bit) & 1;
+}
+
+inline long _InterlockedIncrement(volatile long* addend)
+{
+  return __atomic_add_fetch(addend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline long _InterlockedDecrement(volatile long* addend)
+{
+  return __atomic_sub_fetch(addend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline long _InterlockedExchange(volatile long* target, long value)
+{
+  return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+inline long _InterlockedExchangeAdd(volatile long* addend, long value)
+{
+  return __atomic_fetch_add(addend, value, __ATOMIC_SEQ_CST);
+}
+
+inline long long _InterlockedIncrement64(volatile long long* addend)
+{
+  return __atomic_add_fetch(addend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline long _InterlockedCompareExchange(volatile long* destination, long exchange, long comparand)
+{
+  __atomic_compare_exchange_n(destination, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return comparand;
+}
+
+inline long long _InterlockedCompareExchange64(volatile long long* destination, long long exchange, long long comparand)
+{
+  __atomic_compare_exchange_n(destination, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return comparand;
+}
+
+inline void* _InterlockedCompareExchangePointer(void* volatile* destination, void* exchange, void* comparand)
+{
+  __atomic_compare_exchange_n(destination, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return comparand;
+}
+
+inline void* _InterlockedExchangePointer(void* volatile* target, void* value)
+{
+  return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+inline unsigned char _BitScanReverse64(unsigned long* index, unsigned long long mask)
+{
+  if (mask == 0)
+  {
+    return 0;
+  }
+
+  *index = 63 - __builtin_clzll(mask);
+  return 1;
+}
+
+inline void _ReadWriteBarrier()
+{
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+// The firmware locks and worker loops wait with _mm_pause(). Unlike firmware, the thread they wait for can be
+// preempted on the host, so every 1024th pause of a thread yields its processor instead.
+inline void host_pause()
+{
+  thread_local uint32_t pause_count = 0;
+
+  if (++pause_count % 1024 == 0)
+  {
+    sched_yield();
+    return;
+  }
+
+  __builtin_ia32_pause();
+}
+
+#define _mm_pause host_pause
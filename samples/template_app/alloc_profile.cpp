@@ -0,0 +1,343 @@
+#include "alloc_profile.hpp"
+#include "common.hpp"
+#include "config.hpp"
+#include "file_io.hpp"
+#include "exc_common.hpp"
+#include <intrin.h>
+#include <bit>
+#include <cstring>
+
+extern "C" void __hh_capture_context(exc::frame_walk_context* ctx, exc::machine_frame* mach);
+
+namespace hh
+{
+  // Folded lines are collected in a buffer of this size and written with one call.
+  static constexpr size_t flush_buffer_size = 0x10000;
+  // max_depth frames of "0x" and 8 hex digits with a separator, the count and the line end.
+  static constexpr size_t max_line_size = allocation_profiler::max_depth * 11 + 24;
+
+  // log2 of a positive normal number, good to about 1e-5, the sampler needs no better.
+  static double fast_log2(double value) noexcept
+  {
+    const auto bits = std::bit_cast<uint64_t>(value);
+    const auto exponent = static_cast<int64_t>(bits >> 52 & 0x7FF) - 1023;
+    // Mantissa in [1, 2), ln(m) = 2 atanh((m - 1) / (m + 1)) and the series converges fast for s < 1/3.
+    const auto m = std::bit_cast<double>((bits & 0xFFFFFFFFFFFFFull) | 0x3FF0000000000000ull);
+    const double s = (m - 1) / (m + 1);
+    const double s2 = s * s;
+    constexpr double log2_e = 1.4426950408889634;
+
+    return static_cast<double>(exponent) + 2 * log2_e * s * (1 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 * (1.0 / 7 + s2 / 9))));
+  }
+
+  // 2^value for value in (-1022, 0].
+  static double fast_exp2(double value) noexcept
+  {
+    auto integer = static_cast<int64_t>(value);
+    integer -= static_cast<double>(integer) > value ? 1 : 0;
+
+    // 2^f for f in [0, 1).
+    const double f = value - static_cast<double>(integer);
+    const double fraction = 1.0 + f * (0.6931472 + f * (0.2402265 + f * (0.0555041 + f * 0.0096181)));
+
+    return fraction * std::bit_cast<double>(static_cast<uint64_t>(integer + 1023) << 52);
+  }
+
+  // Return addresses of the callers of the caller, from the innermost, skipping the first skip of them.
+  // Stops at the first frame outside of the image, the firmware that started it has no .pdata of ours.
+  static __declspec(noinline) uint32_t capture_stack(const uint8_t** frames, uint32_t capacity, uint32_t skip) noexcept
+  {
+    exc::frame_walk_context ctx{};
+    exc::machine_frame mach{};
+    const auto pdata = exc::frame_walk_pdata::for_this_image();
+    uint32_t depth = 0;
+
+    // mach starts in this function, its own frame is unwound before the first address is stored.
+    __hh_capture_context(&ctx, &mach);
+
+    while (depth < capacity)
+    {
+      const uint64_t previous_rsp = mach.rsp;
+
+      if (const auto* function = pdata.find_function_entry(mach.rip); function != nullptr)
+      {
+        exc::frame_walk_pdata::unwind(*(pdata.image_base() + function->unwind_struct), ctx, mach);
+      }
+      else
+      {
+        // Leaf functions have no .pdata entry, the return address is on top of the stack.
+        mach.rip = *reinterpret_cast<const uint8_t* const*>(mach.rsp);
+        mach.rsp += 8;
+      }
+
+      // Unwind data that doesn't move up the stack can't be followed further.
+      if (mach.rsp <= previous_rsp || !pdata.contains_address(mach.rip))
+      {
+        break;
+      }
+
+      if (skip != 0)
+      {
+        skip--;
+        continue;
+      }
+
+      frames[depth++] = mach.rip;
+    }
+
+    return depth;
+  }
+
+  static char* write_hex(char* out, uint64_t value) noexcept
+  {
+    char digits[16];
+    uint32_t count = 0;
+
+    do
+    {
+      digits[count++] = "0123456789abcdef"[value & 0xF];
+      value >>= 4;
+    } while (value != 0);
+
+    *out++ = '0';
+    *out++ = 'x';
+
+    while (count != 0)
+    {
+      *out++ = digits[--count];
+    }
+
+    return out;
+  }
+
+  static char* write_decimal(char* out, uint64_t value) noexcept
+  {
+    char digits[20];
+    uint32_t count = 0;
+
+    do
+    {
+      digits[count++] = static_cast<char>('0' + value % 10);
+      value /= 10;
+    } while (value != 0);
+
+    while (count != 0)
+    {
+      *out++ = digits[--count];
+    }
+
+    return out;
+  }
+
+  allocation_profiler::allocation_profiler(uint64_t sampling_interval, uint64_t stack_capacity) noexcept
+    : stacks_{}, stack_capacity_{}, stack_count_{}, dropped_count_{}, sampling_interval_{ static_cast<double>(sampling_interval) },
+    stacks_lock_{}, paused_{}, processors_{}
+  {
+    unsigned long highest_bit = 0;
+    uint32_t processor = 0;
+    const uint64_t seed = common::processor_timestamp(processor);
+
+    config::lock_profile::name(&stacks_lock_, "allocation profile");
+
+    for (uint32_t j = 0; j < common::max_processors; j++)
+    {
+      // xorshift must not start from 0.
+      processors_[j].random = (seed + j) * 0x9E3779B97F4A7C15 | 1;
+      processors_[j].bytes_until_sample = next_sample_distance(processors_[j]);
+    }
+
+    if (!_BitScanReverse64(&highest_bit, stack_capacity))
+    {
+      return;
+    }
+
+    stack_capacity_ = 1ull << highest_bit;
+    stacks_ = static_cast<stack_entry*>(common::allocate_pages(stack_capacity_ * sizeof(stack_entry)));
+
+    if (stacks_ == nullptr)
+    {
+      stack_capacity_ = 0;
+      return;
+    }
+
+    for (uint64_t j = 0; j < stack_capacity_; j++)
+    {
+      stacks_[j].depth = 0;
+    }
+  }
+
+  allocation_profiler::~allocation_profiler() noexcept
+  {
+    if (stacks_ != nullptr)
+    {
+      common::free_pages(stacks_, stack_capacity_ * sizeof(stack_entry));
+    }
+  }
+
+  int64_t allocation_profiler::next_sample_distance(processor_state& state) const noexcept
+  {
+    state.random ^= state.random << 13;
+    state.random ^= state.random >> 7;
+    state.random ^= state.random << 17;
+
+    // Uniform in (0, 1], -ln of it is exponentially distributed with the mean of 1.
+    const double uniform = static_cast<double>((state.random >> 38) + 1) / static_cast<double>(1ull << 26);
+    constexpr double ln_2 = 0.6931471805599453;
+
+    return static_cast<int64_t>(-fast_log2(uniform) * ln_2 * sampling_interval_) + 1;
+  }
+
+  double allocation_profiler::estimated_bytes(size_t size) const noexcept
+  {
+    // An allocation of size bytes is sampled with the chance 1 - e^(-size / interval).
+    constexpr double log2_e = 1.4426950408889634;
+    const double ratio = static_cast<double>(size) / sampling_interval_;
+
+    if (ratio > 64)
+    {
+      return static_cast<double>(size);
+    }
+
+    // For small ratios 1 - e^-x loses the precision the series keeps.
+    const double chance = ratio < 0.01 ? ratio * (1 - ratio / 2) : 1 - fast_exp2(-ratio * log2_e);
+
+    return static_cast<double>(size) / chance;
+  }
+
+  __declspec(noinline) void allocation_profiler::take_sample(size_t size, uint32_t processor) noexcept
+  {
+    // A sample spends the whole distance even if the allocation crossed several, the weight makes up for it.
+    processors_[processor].bytes_until_sample = next_sample_distance(processors_[processor]);
+
+    if (paused_ || stacks_ == nullptr)
+    {
+      return;
+    }
+
+    const uint8_t* frames[max_depth];
+    // The first frame is this function.
+    const uint32_t depth = capture_stack(frames, max_depth, 1);
+    uint64_t hash = depth;
+
+    for (uint32_t j = 0; j < depth; j++)
+    {
+      hash = (hash ^ reinterpret_cast<uint64_t>(frames[j])) * 0x9E3779B97F4A7C15;
+      hash ^= hash >> 29;
+    }
+
+    common::spinlock_guard _{ &stacks_lock_ };
+
+    if (depth == 0 || paused_)
+    {
+      dropped_count_++;
+      return;
+    }
+
+    for (uint64_t slot = hash & (stack_capacity_ - 1);; slot = (slot + 1) & (stack_capacity_ - 1))
+    {
+      auto& entry = stacks_[slot];
+
+      if (entry.depth == 0)
+      {
+        // New stacks are dropped once the table is 7/8 full, probes stay short.
+        if (stack_count_ >= stack_capacity_ - stack_capacity_ / 8)
+        {
+          dropped_count_++;
+          return;
+        }
+
+        entry.hash = hash;
+        entry.sample_count = 0;
+        entry.estimated_bytes = 0;
+        entry.depth = depth;
+
+        for (uint32_t j = 0; j < depth; j++)
+        {
+          entry.frames[j] = frames[j];
+        }
+
+        stack_count_++;
+      }
+      else if (entry.hash != hash || entry.depth != depth || memcmp(entry.frames, frames, depth * sizeof(frames[0])) != 0)
+      {
+        continue;
+      }
+
+      entry.sample_count++;
+      entry.estimated_bytes += static_cast<uint64_t>(estimated_bytes(size));
+      return;
+    }
+  }
+
+  EFI_STATUS allocation_profiler::flush(EFI_HANDLE image_handle, const CHAR16* file_name) noexcept
+  {
+    EFI_FILE_PROTOCOL* file = nullptr;
+
+    if (stacks_ == nullptr)
+    {
+      return EFI_NOT_READY;
+    }
+
+    auto status = common::create_image_volume_file(image_handle, file_name, &file);
+
+    if (EFI_ERROR(status))
+    {
+      return status;
+    }
+
+    auto* buffer = static_cast<char*>(common::allocate_pages(flush_buffer_size));
+
+    if (buffer == nullptr)
+    {
+      file->Close(file);
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    // Samples in progress finish before the table is read.
+    {
+      common::spinlock_guard _{ &stacks_lock_ };
+      _InterlockedExchange(&paused_, 1);
+    }
+
+    const auto image_base = reinterpret_cast<uint64_t>(&globals::__ImageBase);
+    char* cursor = buffer;
+
+    for (uint64_t j = 0; j < stack_capacity_ && !EFI_ERROR(status); j++)
+    {
+      const auto& entry = stacks_[j];
+
+      if (entry.depth == 0)
+      {
+        continue;
+      }
+
+      for (uint32_t k = entry.depth; k != 0; k--)
+      {
+        cursor = write_hex(cursor, reinterpret_cast<uint64_t>(entry.frames[k - 1]) - image_base);
+        *cursor++ = k != 1 ? ';' : ' ';
+      }
+
+      cursor = write_decimal(cursor, entry.estimated_bytes);
+      *cursor++ = '\n';
+
+      if (cursor + max_line_size > buffer + flush_buffer_size)
+      {
+        status = common::write_file(file, buffer, cursor - buffer);
+        cursor = buffer;
+      }
+    }
+
+    if (!EFI_ERROR(status) && cursor != buffer)
+    {
+      status = common::write_file(file, buffer, cursor - buffer);
+    }
+
+    _InterlockedExchange(&paused_, 0);
+
+    common::free_pages(buffer, flush_buffer_size);
+
+    const auto close_status = file->Close(file);
+
+    return EFI_ERROR(status) ? status : close_status;
+  }
+}
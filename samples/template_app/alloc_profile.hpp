@@ -0,0 +1,107 @@
+#pragma once
+#include "delete_constructors.hpp"
+#include "globals.hpp"
+#include "common.hpp"
+#include "uefi.hpp"
+#include <cstdint>
+#include <cstddef>
+
+namespace hh
+{
+  // Sampling profiler of heap allocations. Every processor counts down the bytes it allocates, when the count
+  // runs out the call stack is walked with the .pdata unwinder and the sample is added to a table keyed by the
+  // stack. Like in tcmalloc the countdown is drawn from an exponential distribution with the mean of the
+  // sampling interval, so every allocated byte has the same chance to be sampled whatever the allocation
+  // sizes, and an allocation that isn't sampled costs one subtraction. Samples are weighted by the inverse
+  // of that chance, the totals estimate the bytes allocated from every stack.
+  class allocation_profiler : non_relocatable
+  {
+  public:
+    static constexpr uint32_t max_depth = 32;
+
+  private:
+    // Written only by the processor that owns it.
+    struct alignas(64) processor_state
+    {
+      int64_t bytes_until_sample;
+      uint64_t random;
+    };
+
+    struct stack_entry
+    {
+      uint64_t hash;
+      uint64_t sample_count;
+      uint64_t estimated_bytes;
+      // 0 marks a free slot.
+      uint32_t depth;
+      // Return addresses, the innermost caller first.
+      const uint8_t* frames[max_depth];
+    };
+
+    stack_entry* stacks_;
+    uint64_t stack_capacity_;
+    uint64_t stack_count_;
+    uint64_t dropped_count_;
+    double sampling_interval_;
+    volatile long stacks_lock_;
+    volatile long paused_;
+    processor_state processors_[common::max_processors];
+
+  private:
+    int64_t next_sample_distance(processor_state& state) const noexcept;
+    double estimated_bytes(size_t size) const noexcept;
+    // Out of line so that the countdown in allocated() stays a few instructions.
+    void take_sample(size_t size, uint32_t processor) noexcept;
+
+  public:
+    // Stack capacity is rounded down to a power of two. The table is taken with AllocatePages, never from
+    // the profiled heap.
+    allocation_profiler(uint64_t sampling_interval, uint64_t stack_capacity) noexcept;
+    ~allocation_profiler() noexcept;
+
+    void allocated(size_t size, uint32_t processor) noexcept
+    {
+      auto& state = processors_[processor];
+
+      state.bytes_until_sample -= static_cast<int64_t>(size);
+
+      if (state.bytes_until_sample <= 0) [[unlikely]]
+      {
+        take_sample(size, processor);
+      }
+    }
+
+    // Samples lost because the stack table was full or the stack couldn't be walked.
+    uint64_t dropped_count() const noexcept
+    {
+      return dropped_count_;
+    }
+
+    // Writes the table to file_name on the volume the image was loaded from as folded stacks, one line per
+    // stack: "0x1a2b;0x3c4d;0x5e6f 1048576". Frames are image relative return addresses from the outermost
+    // caller, the number is the estimated bytes allocated from the stack. Sampling is paused for the
+    // duration of the flush. BSP only, boot services must be available.
+    EFI_STATUS flush(EFI_HANDLE image_handle, const CHAR16* file_name) noexcept;
+  };
+
+  // Profile policies for config::allocation_profile. Allocators call them for every allocation.
+  struct no_allocation_profile
+  {
+    static constexpr bool enabled = false;
+
+    static void allocated(size_t, uint32_t) noexcept {}
+  };
+
+  struct sampled_allocation_profile
+  {
+    static constexpr bool enabled = true;
+
+    static void allocated(size_t size, uint32_t processor) noexcept
+    {
+      if (globals::allocation_profile != nullptr)
+      {
+        globals::allocation_profile->allocated(size, processor);
+      }
+    }
+  };
+}
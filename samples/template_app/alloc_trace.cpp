@@ -0,0 +1,133 @@
+#include "alloc_trace.hpp"
+#include "common.hpp"
+#include "file_io.hpp"
+
+namespace hh
+{
+  // Encoded records are collected in a buffer of this size and written with one call.
+  static constexpr size_t flush_buffer_size = 0x10000;
+
+  trace_recorder::trace_recorder(uint64_t capacity) noexcept
+    : records_{}, ring_capacity_{}, ring_count_{ common::processor_count() }, paused_{}, cursors_{}
+  {
+    unsigned long highest_bit = 0;
+
+    if (!_BitScanReverse64(&highest_bit, capacity / ring_count_))
+    {
+      return;
+    }
+
+    ring_capacity_ = 1ull << highest_bit;
+    records_ = static_cast<trace_record*>(common::allocate_pages(ring_capacity_ * ring_count_ * sizeof(trace_record)));
+
+    if (records_ == nullptr)
+    {
+      ring_capacity_ = 0;
+    }
+  }
+
+  trace_recorder::~trace_recorder() noexcept
+  {
+    if (records_ != nullptr)
+    {
+      common::free_pages(records_, ring_capacity_ * ring_count_ * sizeof(trace_record));
+    }
+  }
+
+  EFI_STATUS trace_recorder::flush(EFI_HANDLE image_handle, const CHAR16* file_name) noexcept
+  {
+    EFI_FILE_PROTOCOL* file = nullptr;
+
+    if (records_ == nullptr)
+    {
+      return EFI_NOT_READY;
+    }
+
+    auto status = common::create_image_volume_file(image_handle, file_name, &file);
+
+    if (EFI_ERROR(status))
+    {
+      return status;
+    }
+
+    auto* buffer = static_cast<uint8_t*>(common::allocate_pages(flush_buffer_size));
+
+    if (buffer == nullptr)
+    {
+      file->Close(file);
+      return EFI_OUT_OF_RESOURCES;
+    }
+
+    _InterlockedExchange(&paused_, 1);
+
+    // Surviving range of every ring, the rings are merged by TSC below.
+    uint64_t positions[common::max_processors] = {};
+    uint64_t ends[common::max_processors] = {};
+    uint64_t record_count = 0;
+    uint64_t lost_count = 0;
+    uint64_t first_tsc = UINT64_MAX;
+
+    for (uint32_t j = 0; j < ring_count_; j++)
+    {
+      ends[j] = cursors_[j].next_record;
+      positions[j] = ends[j] > ring_capacity_ ? ends[j] - ring_capacity_ : 0;
+      record_count += ends[j] - positions[j];
+      lost_count += positions[j];
+
+      if (positions[j] != ends[j] && ring(j)[positions[j] & (ring_capacity_ - 1)].tsc < first_tsc)
+      {
+        first_tsc = ring(j)[positions[j] & (ring_capacity_ - 1)].tsc;
+      }
+    }
+
+    first_tsc = record_count != 0 ? first_tsc : 0;
+    trace_codec codec{ first_tsc };
+    uint8_t* cursor = buffer + trace_codec::header_size;
+
+    trace_codec::write_header(buffer, record_count, lost_count, first_tsc);
+
+    for (uint64_t j = 0; j < record_count && !EFI_ERROR(status); j++)
+    {
+      const trace_record* oldest = nullptr;
+      uint32_t oldest_ring = 0;
+
+      for (uint32_t k = 0; k < ring_count_; k++)
+      {
+        if (positions[k] == ends[k])
+        {
+          continue;
+        }
+
+        const auto* candidate = &ring(k)[positions[k] & (ring_capacity_ - 1)];
+
+        if (oldest == nullptr || candidate->tsc < oldest->tsc)
+        {
+          oldest = candidate;
+          oldest_ring = k;
+        }
+      }
+
+      positions[oldest_ring]++;
+      cursor = codec.encode(*oldest, cursor);
+
+      if (cursor + trace_codec::max_record_size > buffer + flush_buffer_size)
+      {
+        status = common::write_file(file, buffer, cursor - buffer);
+        cursor = buffer;
+      }
+    }
+
+    if (!EFI_ERROR(status) && cursor != buffer)
+    {
+      status = common::write_file(file, buffer, cursor - buffer);
+    }
+
+    _InterlockedExchange(&paused_, 0);
+
+    common::free_pages(buffer, flush_buffer_size);
+
+    const auto close_status = file->Close(file);
+
+    return EFI_ERROR(status) ? status : close_status;
+  }
+}
@@ -0,0 +1,297 @@
+#pragma once
+#include "delete_constructors.hpp"
+#include "globals.hpp"
+#include "common.hpp"
+#include "uefi.hpp"
+#include <cstdint>
+#include <cstddef>
+#include <intrin.h>
+
+namespace hh
+{
+  enum class trace_op : uint8_t
+  {
+    allocate,
+    deallocate,
+    // In-place resize, the block keeps its address. Moving reallocations are recorded as an allocation and a free.
+    reallocate
+  };
+
+  struct trace_record
+  {
+    uint64_t tsc;
+    uint64_t ptr;
+    uint32_t size;
+    trace_op op;
+    // log2 of the requested alignment, 0 for the default one.
+    uint8_t align_log2;
+  };
+
+  // File format, all integers are little endian.
+  //
+  // Header, 32 bytes:
+  //   char[8]  magic          "HHTRACE1"
+  //   uint64   record_count   number of records that follow
+  //   uint64   lost_count     records overwritten in the ring before the flush
+  //   uint64   first_tsc      TSC of the first record
+  //
+  // Record:
+  //   uint8    kind           bits 0-1 trace_op, bits 2-7 align_log2
+  //   varint   tsc_delta      zigzag, TSC minus the TSC of the previous record
+  //   varint   ptr_delta      zigzag, (ptr >> 3) minus (previous ptr >> 3), blocks are at least 8 byte aligned
+  //   varint   size           allocate and reallocate only
+  //
+  // Varints are LEB128: 7 bits per byte starting with the lowest ones, bit 7 is set on every byte except the last.
+  // Records of all processors are merged by TSC, deltas are negative only if the TSCs of the processors aren't synchronized.
+  class trace_codec
+  {
+  public:
+    static constexpr char magic[8] = { 'H', 'H', 'T', 'R', 'A', 'C', 'E', '1' };
+    static constexpr size_t header_size = 32;
+    // kind + three 64-bit varints.
+    static constexpr size_t max_record_size = 1 + 10 * 3;
+
+  private:
+    uint64_t previous_tsc_;
+    uint64_t previous_ptr_;
+
+  private:
+    static uint8_t* write_varint(uint8_t* out, uint64_t value) noexcept
+    {
+      while (value >= 0x80)
+      {
+        *out++ = static_cast<uint8_t>(value) | 0x80;
+        value >>= 7;
+      }
+
+      *out++ = static_cast<uint8_t>(value);
+      return out;
+    }
+
+    static const uint8_t* read_varint(const uint8_t* in, const uint8_t* end, uint64_t& value) noexcept
+    {
+      value = 0;
+
+      for (uint32_t shift = 0; in < end && shift < 64; shift += 7)
+      {
+        const uint8_t byte = *in++;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+        if (!(byte & 0x80))
+        {
+          return in;
+        }
+      }
+
+      return nullptr;
+    }
+
+    static uint64_t zigzag(int64_t value) noexcept
+    {
+      return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    static int64_t unzigzag(uint64_t value) noexcept
+    {
+      return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+  public:
+    explicit trace_codec(uint64_t first_tsc) noexcept : previous_tsc_{ first_tsc }, previous_ptr_{} {}
+
+    static void write_header(uint8_t* out, uint64_t record_count, uint64_t lost_count, uint64_t first_tsc) noexcept
+    {
+      const uint64_t fields[] = { record_count, lost_count, first_tsc };
+
+      for (size_t j = 0; j < sizeof(magic); j++)
+      {
+        out[j] = magic[j];
+      }
+
+      for (size_t j = 0; j < sizeof(fields); j++)
+      {
+        out[sizeof(magic) + j] = static_cast<uint8_t>(fields[j / 8] >> (j % 8 * 8));
+      }
+    }
+
+    // Returns false if the buffer doesn't start with a trace header.
+    static bool read_header(const uint8_t* in, size_t size, uint64_t& record_count, uint64_t& lost_count, uint64_t& first_tsc) noexcept
+    {
+      uint64_t fields[3] = {};
+
+      if (size < header_size)
+      {
+        return false;
+      }
+
+      for (size_t j = 0; j < sizeof(magic); j++)
+      {
+        if (in[j] != static_cast<uint8_t>(magic[j]))
+        {
+          return false;
+        }
+      }
+
+      for (size_t j = 0; j < sizeof(fields); j++)
+      {
+        fields[j / 8] |= static_cast<uint64_t>(in[sizeof(magic) + j]) << (j % 8 * 8);
+      }
+
+      record_count = fields[0];
+      lost_count = fields[1];
+      first_tsc = fields[2];
+
+      return true;
+    }
+
+    // Out must have room for max_record_size bytes. Returns the end of the encoded record.
+    uint8_t* encode(const trace_record& record, uint8_t* out) noexcept
+    {
+      *out++ = static_cast<uint8_t>(static_cast<uint8_t>(record.op) | record.align_log2 << 2);
+      out = write_varint(out, zigzag(static_cast<int64_t>(record.tsc - previous_tsc_)));
+      out = write_varint(out, zigzag(static_cast<int64_t>((record.ptr >> 3) - (previous_ptr_ >> 3))));
+
+      if (record.op != trace_op::deallocate)
+      {
+        out = write_varint(out, record.size);
+      }
+
+      previous_tsc_ = record.tsc;
+      previous_ptr_ = record.ptr;
+
+      return out;
+    }
+
+    // Returns the end of the decoded record or nullptr if the input is truncated or malformed.
+    const uint8_t* decode(const uint8_t* in, const uint8_t* end, trace_record& record) noexcept
+    {
+      uint64_t tsc_delta = 0;
+      uint64_t ptr_delta = 0;
+      uint64_t size = 0;
+
+      if (in >= end || (*in & 3) > static_cast<uint8_t>(trace_op::reallocate))
+      {
+        return nullptr;
+      }
+
+      record.op = static_cast<trace_op>(*in & 3);
+      record.align_log2 = *in++ >> 2;
+
+      if ((in = read_varint(in, end, tsc_delta)) == nullptr || (in = read_varint(in, end, ptr_delta)) == nullptr)
+      {
+        return nullptr;
+      }
+
+      if (record.op != trace_op::deallocate && (in = read_varint(in, end, size)) == nullptr)
+      {
+        return nullptr;
+      }
+
+      previous_tsc_ += unzigzag(tsc_delta);
+      previous_ptr_ = ((previous_ptr_ >> 3) + unzigzag(ptr_delta)) << 3;
+
+      record.tsc = previous_tsc_;
+      record.ptr = previous_ptr_;
+      record.size = static_cast<uint32_t>(size);
+
+      return in;
+    }
+  };
+
+  // Rings of the most recent allocator operations, one per processor. A record costs one rdtscp and
+  // a few plain stores, the oldest records are overwritten when a ring is full.
+  class trace_recorder : non_relocatable
+  {
+  private:
+    // Written only by the processor that owns the ring.
+    struct alignas(64) ring_cursor
+    {
+      uint64_t next_record;
+    };
+
+    trace_record* records_;
+    uint64_t ring_capacity_;
+    uint32_t ring_count_;
+    volatile long paused_;
+    ring_cursor cursors_[common::max_processors];
+
+  private:
+    trace_record* ring(uint32_t processor) const noexcept
+    {
+      return records_ + ring_capacity_ * processor;
+    }
+
+  public:
+    // Capacity is shared by the processors, every ring is rounded down to a power of two. The rings are taken
+    // with AllocatePages, never from the traced heap.
+    explicit trace_recorder(uint64_t capacity) noexcept;
+    ~trace_recorder() noexcept;
+
+    void record(trace_op op, const void* ptr, size_t size, size_t align) noexcept
+    {
+      if (paused_ || records_ == nullptr)
+      {
+        return;
+      }
+
+      uint32_t processor = 0;
+      const uint64_t tsc = common::processor_timestamp(processor);
+      auto& record = ring(processor)[cursors_[processor].next_record++ & (ring_capacity_ - 1)];
+      unsigned long align_log2 = 0;
+
+      if (align != 0)
+      {
+        _BitScanReverse64(&align_log2, align);
+      }
+
+      record.tsc = tsc;
+      record.ptr = reinterpret_cast<uint64_t>(ptr);
+      record.size = static_cast<uint32_t>(size);
+      record.op = op;
+      record.align_log2 = static_cast<uint8_t>(align_log2);
+    }
+
+    // Writes the ring to file_name on the volume the image was loaded from, an existing file is replaced.
+    // Recording is paused for the duration of the flush. BSP only, boot services must be available.
+    EFI_STATUS flush(EFI_HANDLE image_handle, const CHAR16* file_name) noexcept;
+  };
+
+  // Trace policies for config::allocation_trace. Allocators call them for every operation.
+  struct no_allocation_trace
+  {
+    static constexpr bool enabled = false;
+
+    static void allocated(const void*, size_t, size_t) noexcept {}
+    static void deallocated(const void*) noexcept {}
+    static void resized(const void*, size_t) noexcept {}
+  };
+
+  struct ring_allocation_trace
+  {
+    static constexpr bool enabled = true;
+
+    static void allocated(const void* ptr, size_t size, size_t align) noexcept
+    {
+      if (globals::allocation_trace != nullptr)
+      {
+        globals::allocation_trace->record(trace_op::allocate, ptr, size, align);
+      }
+    }
+
+    static void deallocated(const void* ptr) noexcept
+    {
+      if (globals::allocation_trace != nullptr)
+      {
+        globals::allocation_trace->record(trace_op::deallocate, ptr, 0, 0);
+      }
+    }
+
+    static void resized(const void* ptr, size_t size) noexcept
+    {
+      if (globals::allocation_trace != nullptr)
+      {
+        globals::allocation_trace->record(trace_op::reallocate, ptr, size, 0);
+      }
+    }
+  };
+}
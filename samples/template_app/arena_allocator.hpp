@@ -0,0 +1,261 @@
+#pragma once
+#include "delete_constructors.hpp"
+#include "memory_manager.hpp"
+#include "common.hpp"
+#include "globals.hpp"
+#include <intrin.h>
+#include <cstdint>
+#include <new>
+
+namespace hh
+{
+  // Monotonic heap for phases that free everything together. Allocation bumps a pointer inside a chunk
+  // taken from the parent heap, deallocation of a single object is a no-op and all chunks go back to
+  // the parent when the arena is released or destroyed. Blocks of other heaps are forwarded to the parent.
+  // There is no lock, an arena belongs to the processor that uses it.
+  class arena_allocator final : public memory_manager
+  {
+  public:
+    static constexpr size_t default_chunk_size = common::page_size * 16;
+
+  private:
+    static constexpr size_t max_chunk_size = common::large_page_size;
+    static constexpr size_t object_alignment = 16;
+
+    struct chunk_header
+    {
+      chunk_header* next;
+      size_t size;
+    };
+
+    memory_manager& parent_;
+    chunk_header* chunks_;
+    uint8_t* cursor_;
+    uint8_t* limit_;
+    // Start of the newest block, it's the only one that can be resized or given back.
+    uint8_t* last_block_;
+    size_t next_chunk_size_;
+    size_t reserved_bytes_;
+
+  private:
+    static uint8_t* align_up(uint8_t* ptr, size_t align) noexcept
+    {
+      return reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(ptr) + align - 1) & ~static_cast<uintptr_t>(align - 1));
+    }
+
+    bool add_chunk(size_t required) noexcept
+    {
+      size_t chunk_size = next_chunk_size_;
+
+      while (chunk_size < required + sizeof(chunk_header))
+      {
+        chunk_size *= 2;
+      }
+
+      // The parent takes 32 bit sizes.
+      if (chunk_size > UINT32_MAX)
+      {
+        return false;
+      }
+
+      auto* chunk = static_cast<chunk_header*>(parent_.allocate(static_cast<uint32_t>(chunk_size)));
+
+      if (chunk == nullptr)
+      {
+        return false;
+      }
+
+      chunk->next = chunks_;
+      chunk->size = chunk_size;
+      chunks_ = chunk;
+      cursor_ = reinterpret_cast<uint8_t*>(chunk + 1);
+      limit_ = reinterpret_cast<uint8_t*>(chunk) + chunk_size;
+      last_block_ = nullptr;
+      reserved_bytes_ += chunk_size;
+      next_chunk_size_ = chunk_size * 2 < max_chunk_size ? chunk_size * 2 : max_chunk_size;
+
+      return true;
+    }
+
+    void* bump(size_t allocation_size, size_t align) noexcept
+    {
+      allocation_size = (allocation_size + object_alignment - 1) & ~(object_alignment - 1);
+      uint8_t* block = align_up(cursor_, align);
+
+      if (cursor_ == nullptr || block + allocation_size > limit_)
+      {
+        // The parent may return a chunk aligned to less than object_alignment.
+        if (!add_chunk(allocation_size + align))
+        {
+          return nullptr;
+        }
+
+        block = align_up(cursor_, align);
+      }
+
+      cursor_ = block + allocation_size;
+      last_block_ = block;
+
+      return block;
+    }
+
+    bool owns(const void* ptr) const noexcept
+    {
+      for (auto* chunk = chunks_; chunk != nullptr; chunk = chunk->next)
+      {
+        if (ptr > chunk && ptr < reinterpret_cast<const uint8_t*>(chunk) + chunk->size)
+        {
+          return true;
+        }
+      }
+
+      return false;
+    }
+
+  public:
+    // chunk_size is the size of the first chunk, kept between a page and max_chunk_size.
+    explicit arena_allocator(memory_manager& parent, size_t chunk_size = default_chunk_size) noexcept
+      : parent_{ parent }, chunks_{}, cursor_{}, limit_{}, last_block_{},
+      next_chunk_size_{ chunk_size < common::page_size ? common::page_size : (chunk_size > max_chunk_size ? max_chunk_size : chunk_size) },
+      reserved_bytes_{}
+    {
+    }
+
+    void* allocate(uint32_t allocation_size) noexcept override
+    {
+      return bump(allocation_size, object_alignment);
+    }
+
+    void* allocate_align(uint32_t allocation_size, std::align_val_t align) noexcept override
+    {
+      const auto alignment = static_cast<size_t>(align);
+      return bump(allocation_size, alignment > object_alignment ? alignment : object_alignment);
+    }
+
+    // Only the newest block is given back, memory of older ones is reclaimed by release().
+    void deallocate(void* ptr_to_allocation) noexcept override
+    {
+      if (ptr_to_allocation == last_block_ && last_block_ != nullptr)
+      {
+        cursor_ = last_block_;
+        last_block_ = nullptr;
+      }
+      else if (!owns(ptr_to_allocation))
+      {
+        parent_.deallocate(ptr_to_allocation);
+      }
+    }
+
+    // Blocks of the parent keep the size, so it can skip its lookup.
+    void deallocate_sized(void* ptr_to_allocation, uint32_t allocation_size) noexcept override
+    {
+      if (ptr_to_allocation == last_block_ || owns(ptr_to_allocation))
+      {
+        deallocate(ptr_to_allocation);
+      }
+      else
+      {
+        parent_.deallocate_sized(ptr_to_allocation, allocation_size);
+      }
+    }
+
+    // A growing vector that was allocated last extends without a copy.
+    bool try_expand_in_place(void* ptr_to_allocation, uint32_t new_size) noexcept override
+    {
+      if (ptr_to_allocation != last_block_ || last_block_ == nullptr)
+      {
+        return false;
+      }
+
+      const size_t aligned_size = (static_cast<size_t>(new_size) + object_alignment - 1) & ~(object_alignment - 1);
+
+      if (last_block_ + aligned_size > limit_)
+      {
+        return false;
+      }
+
+      cursor_ = last_block_ + aligned_size;
+      return true;
+    }
+
+    void* reallocate(void* ptr_to_allocation, uint32_t old_size, uint32_t new_size) noexcept override
+    {
+      if (ptr_to_allocation != nullptr && !owns(ptr_to_allocation))
+      {
+        return parent_.reallocate(ptr_to_allocation, old_size, new_size);
+      }
+
+      return memory_manager::reallocate(ptr_to_allocation, old_size, new_size);
+    }
+
+    // Frees every object of the arena at once.
+    void release() noexcept
+    {
+      while (chunks_ != nullptr)
+      {
+        auto* next = chunks_->next;
+        parent_.deallocate_sized(chunks_, static_cast<uint32_t>(chunks_->size));
+        chunks_ = next;
+      }
+
+      cursor_ = nullptr;
+      limit_ = nullptr;
+      last_block_ = nullptr;
+      reserved_bytes_ = 0;
+    }
+
+    // Bytes taken from the parent heap.
+    size_t reserved_bytes() const noexcept
+    {
+      return reserved_bytes_;
+    }
+
+    ~arena_allocator() noexcept override
+    {
+      release();
+    }
+  };
+
+  // Routes plain new/delete and everything built on them (std::vector, std::map...) of the calling processor
+  // to an arena for the lifetime of the scope. Other processors keep using their heap. Objects allocated
+  // in the scope must not outlive it, blocks of other heaps freed in the scope go back to their owner.
+  class scoped_arena : non_relocatable
+  {
+  private:
+    arena_allocator arena_;
+    uint32_t processor_;
+    memory_manager* previous_heap_;
+
+  private:
+    // Without a heap, before global_heap::create() or after destroy(), there is nothing to take chunks from.
+    static memory_manager& parent_heap() noexcept
+    {
+      auto* heap = current_heap();
+
+      if (heap == nullptr) [[unlikely]]
+      {
+        bug_check(bug_check_codes::invalid_cruntime_parameter);
+      }
+
+      return *heap;
+    }
+
+  public:
+    explicit scoped_arena(size_t chunk_size = arena_allocator::default_chunk_size) noexcept
+      : arena_{ parent_heap(), chunk_size }, processor_{ common::current_processor() },
+      previous_heap_{ globals::scoped_heaps[processor_] }
+    {
+      globals::scoped_heaps[processor_] = &arena_;
+    }
+
+    ~scoped_arena() noexcept
+    {
+      globals::scoped_heaps[processor_] = previous_heap_;
+    }
+
+    arena_allocator& arena() noexcept
+    {
+      return arena_;
+    }
+  };
+}
@@ -0,0 +1,1059 @@
+#include "benchmarks.hpp"
+#include "memory_manager.hpp"
+#include "vector.hpp"
+#include "arena_allocator.hpp"
+#include "memory_resource.hpp"
+#include "compacting_heap.hpp"
+#include "task_scheduler.hpp"
+#include "parallel.hpp"
+#include "uefi.hpp"
+#include <intrin.h>
+#include <vector>
+#include <map>
+#include <memory_resource>
+#include <cstring>
+#include <new>
+
+namespace hh::benchmarks
+{
+  // Small deterministic generator, the benchmarks must not depend on firmware entropy.
+  class xorshift
+  {
+  private:
+    uint64_t state_;
+
+  public:
+    explicit xorshift(uint64_t seed) noexcept : state_{ seed } {}
+
+    uint64_t next() noexcept
+    {
+      state_ ^= state_ << 13;
+      state_ ^= state_ >> 7;
+      state_ ^= state_ << 17;
+      return state_;
+    }
+  };
+
+  uint64_t pointer_chase(memory_manager& heap, uint32_t node_count, uint32_t node_size, uint32_t hop_count)
+  {
+    auto** nodes = static_cast<void**>(heap.allocate(node_count * sizeof(void*)));
+
+    if (nodes == nullptr)
+    {
+      return 0;
+    }
+
+    uint32_t allocated_count = 0;
+
+    for (; allocated_count < node_count; allocated_count++)
+    {
+      nodes[allocated_count] = heap.allocate(node_size);
+
+      if (nodes[allocated_count] == nullptr)
+      {
+        break;
+      }
+    }
+
+    uint64_t cycles_per_hop = 0;
+
+    if (allocated_count > 1)
+    {
+      // Link the nodes into a single cycle in random order so the hardware prefetcher can't follow it.
+      xorshift random{ 0x2545F4914F6CDD1D };
+
+      for (uint32_t j = allocated_count - 1; j > 0; j--)
+      {
+        const auto k = static_cast<uint32_t>(random.next() % (j + 1));
+        auto* tmp = nodes[j];
+        nodes[j] = nodes[k];
+        nodes[k] = tmp;
+      }
+
+      for (uint32_t j = 0; j < allocated_count; j++)
+      {
+        *static_cast<void**>(nodes[j]) = nodes[(j + 1) % allocated_count];
+      }
+
+      void* volatile* cursor = static_cast<void* volatile*>(nodes[0]);
+      const uint64_t start = __rdtsc();
+
+      for (uint32_t j = 0; j < hop_count; j++)
+      {
+        cursor = static_cast<void* volatile*>(*cursor);
+      }
+
+      cycles_per_hop = (__rdtsc() - start) / hop_count;
+    }
+
+    for (uint32_t j = 0; j < allocated_count; j++)
+    {
+      heap.deallocate(nodes[j]);
+    }
+
+    heap.deallocate(nodes);
+
+    return cycles_per_hop;
+  }
+
+  void compare_large_page_arena()
+  {
+    // 64 MB of nodes is far beyond the reach of the 4 KB TLB but fits into the 2 MB one.
+    constexpr uint32_t node_count = 1 << 20;
+    constexpr uint32_t node_size = 64;
+    constexpr uint32_t hop_count = 1 << 24;
+    constexpr size_t heap_size = common::large_page_size * 48;
+
+    {
+      tlsf_allocator<fixed_size<heap_size>, false> small_page_heap{};
+      Print(L"pointer chase, 4 KB pool: %lu cycles/hop\n"_w, pointer_chase(small_page_heap, node_count, node_size, hop_count));
+    }
+
+    {
+      tlsf_allocator<large_page_arena<heap_size>, false> large_page_heap{};
+      Print(L"pointer chase, 2 MB arena: %lu cycles/hop\n"_w, pointer_chase(large_page_heap, node_count, node_size, hop_count));
+    }
+  }
+
+  void compare_vector_growth()
+  {
+    constexpr uint32_t element_count = 1000000;
+
+    {
+      std::vector<uint32_t> elements{};
+      uint32_t relocation_count = 0;
+      const uint64_t start = __rdtsc();
+
+      for (uint32_t j = 0; j < element_count; j++)
+      {
+        const auto* old_data = elements.data();
+        elements.push_back(j);
+        relocation_count += old_data != nullptr && old_data != elements.data();
+      }
+
+      Print(L"push_back x%u, std::vector: %lu cycles, %u relocations\n"_w, element_count, __rdtsc() - start, relocation_count);
+    }
+
+    {
+      vector<uint32_t> elements{};
+      const uint64_t start = __rdtsc();
+
+      for (uint32_t j = 0; j < element_count; j++)
+      {
+        elements.push_back(j);
+      }
+
+      Print(L"push_back x%u, hh::vector: %lu cycles, %u relocations\n"_w, element_count, __rdtsc() - start, elements.relocation_count());
+    }
+  }
+
+  uint64_t teardown(memory_manager& heap, uint32_t node_count, uint32_t node_size)
+  {
+    void* head = nullptr;
+
+    for (uint32_t j = 0; j < node_count; j++)
+    {
+      auto* node = static_cast<void**>(heap.allocate(node_size));
+
+      if (node == nullptr)
+      {
+        break;
+      }
+
+      *node = head;
+      head = node;
+    }
+
+    const uint64_t start = __rdtsc();
+
+    while (head != nullptr)
+    {
+      auto* next = *static_cast<void**>(head);
+      heap.deallocate_sized(head, node_size);
+      head = next;
+    }
+
+    heap.flush();
+
+    return __rdtsc() - start;
+  }
+
+  void compare_deferred_free()
+  {
+    constexpr uint32_t node_count = 1000000;
+    constexpr uint32_t node_size = 48;
+
+    {
+      tlsf_allocator<> heap{};
+      Print(L"teardown x%u, immediate free: %lu cycles\n"_w, node_count, teardown(heap, node_count, node_size));
+    }
+
+    {
+      tlsf_allocator<geometric_growth<>, true, 32> heap{};
+      Print(L"teardown x%u, deferred free: %lu cycles\n"_w, node_count, teardown(heap, node_count, node_size));
+    }
+  }
+
+  uint64_t fill_pmr_containers(std::pmr::memory_resource* resource, uint32_t element_count)
+  {
+    const uint64_t start = __rdtsc();
+
+    {
+      std::pmr::vector<uint64_t> values{ resource };
+      std::pmr::map<uint32_t, uint32_t> index{ resource };
+      xorshift random{ 0x2545F4914F6CDD1D };
+      // Volatile keeps the traversal from being optimized away.
+      volatile uint64_t sum = 0;
+
+      for (uint32_t j = 0; j < element_count; j++)
+      {
+        values.push_back(random.next());
+        index.emplace(static_cast<uint32_t>(values.back()), j);
+      }
+
+      for (const auto& [key, position] : index)
+      {
+        sum += values[position];
+      }
+    }
+
+    return __rdtsc() - start;
+  }
+
+  void compare_pmr_containers()
+  {
+    constexpr uint32_t element_count = 100000;
+
+    Print(L"pmr vector + map x%u, global heap: %lu cycles\n"_w, element_count, fill_pmr_containers(std::pmr::get_default_resource(), element_count));
+
+    {
+      arena_allocator arena{ *globals::mem_manager };
+      heap_resource resource{ arena };
+      Print(L"pmr vector + map x%u, container arena: %lu cycles\n"_w, element_count, fill_pmr_containers(&resource, element_count));
+    }
+
+    // The standard resources, with the global heap as their upstream.
+    {
+      heap_resource upstream{ *globals::mem_manager };
+      std::pmr::monotonic_buffer_resource resource{ &upstream };
+      Print(L"pmr vector + map x%u, monotonic_buffer_resource: %lu cycles\n"_w, element_count, fill_pmr_containers(&resource, element_count));
+    }
+
+    {
+      heap_resource upstream{ *globals::mem_manager };
+      std::pmr::unsynchronized_pool_resource resource{ &upstream };
+      Print(L"pmr vector + map x%u, unsynchronized_pool_resource: %lu cycles\n"_w, element_count, fill_pmr_containers(&resource, element_count));
+    }
+  }
+
+  void compare_compaction()
+  {
+    constexpr size_t pool_size = common::page_size * 1024;
+    constexpr uint32_t max_objects = 8192;
+    constexpr uint32_t large_size = 256 * 1024;
+
+    compacting_heap heap{ pool_size, max_objects };
+    compacting_heap::handle objects[max_objects] = {};
+    xorshift random{ 0x9E3779B97F4A7C15 };
+    uint32_t object_count = 0;
+
+    // Fill the pool with small objects and free every other one, no free block is bigger than an object.
+    while (object_count < max_objects)
+    {
+      objects[object_count] = heap.allocate(64 + static_cast<uint32_t>(random.next() % 4032));
+
+      if (objects[object_count] == compacting_heap::null_handle)
+      {
+        break;
+      }
+
+      object_count++;
+    }
+
+    for (uint32_t j = 1; j < object_count; j += 2)
+    {
+      heap.deallocate(objects[j]);
+    }
+
+    Print(L"compaction, %u objects, largest free block before: %lu bytes\n"_w, object_count / 2, heap.largest_free_block());
+
+    const uint64_t start = __rdtsc();
+    uint32_t moved_count = 0;
+
+    // Incremental steps, the way an idle callback would run them.
+    for (uint32_t moves = heap.compact(64); moves != 0; moves = heap.compact(64))
+    {
+      moved_count += moves;
+    }
+
+    const uint64_t cycles = __rdtsc() - start;
+    uint32_t large_count = 0;
+
+    while (heap.allocate(large_size) != compacting_heap::null_handle)
+    {
+      large_count++;
+    }
+
+    Print(L"compaction, %u objects moved: %lu cycles, largest free block after: %lu bytes, %u x %u KB allocated\n"_w,
+      moved_count, cycles, heap.largest_free_block(), large_count, large_size / 1024);
+  }
+
+  // Latencies in TSC cycles, 8 linear buckets per power of two keep every percentile within 12.5%.
+  struct latency_histogram
+  {
+    static constexpr uint32_t bucket_count = 62 * 8;
+
+    uint32_t counts[bucket_count];
+    uint64_t max;
+
+    static uint32_t bucket_of(uint64_t cycles) noexcept
+    {
+      unsigned long highest_bit = 0;
+
+      if (cycles < 8)
+      {
+        return static_cast<uint32_t>(cycles);
+      }
+
+      _BitScanReverse64(&highest_bit, cycles);
+      return (highest_bit - 2) * 8 + static_cast<uint32_t>(cycles >> (highest_bit - 3) & 7);
+    }
+
+    // The largest latency that falls into the bucket.
+    static uint64_t bucket_limit(uint32_t bucket) noexcept
+    {
+      if (bucket < 8)
+      {
+        return bucket;
+      }
+
+      const uint32_t highest_bit = bucket / 8 + 2;
+      return ((8ull + bucket % 8 + 1) << (highest_bit - 3)) - 1;
+    }
+
+    void record(uint64_t cycles) noexcept
+    {
+      counts[bucket_of(cycles)]++;
+      max = cycles > max ? cycles : max;
+    }
+
+    void merge(const latency_histogram& other) noexcept
+    {
+      for (uint32_t j = 0; j < bucket_count; j++)
+      {
+        counts[j] += other.counts[j];
+      }
+
+      max = other.max > max ? other.max : max;
+    }
+
+    latency_percentiles percentiles() const noexcept
+    {
+      latency_percentiles percentiles{ 0, 0, 0, max };
+      uint64_t total_count = 0;
+
+      for (const auto count : counts)
+      {
+        total_count += count;
+      }
+
+      const uint64_t ranks[] = { total_count / 2, total_count - total_count / 100, total_count - total_count / 1000 };
+      uint64_t* targets[] = { &percentiles.p50, &percentiles.p99, &percentiles.p999 };
+      uint64_t seen_count = 0;
+      uint32_t next_rank = 0;
+
+      for (uint32_t j = 0; j < bucket_count && next_rank < 3; j++)
+      {
+        seen_count += counts[j];
+
+        while (next_rank < 3 && seen_count != 0 && seen_count >= ranks[next_rank])
+        {
+          *targets[next_rank++] = bucket_limit(j);
+        }
+      }
+
+      return percentiles;
+    }
+  };
+
+  struct scalability_thread
+  {
+    // Single producer, single consumer ring of blocks the previous thread sends here to be freed.
+    static constexpr uint32_t mailbox_size = 256;
+
+    void* volatile mailbox[mailbox_size];
+    alignas(64) volatile uint32_t mailbox_tail;
+    alignas(64) volatile uint32_t mailbox_head;
+    uint64_t allocation_count;
+    uint64_t failed_count;
+    uint64_t end_tsc;
+    latency_histogram allocate_latencies;
+    latency_histogram free_latencies;
+  };
+
+  struct scalability_run
+  {
+    memory_manager* heap;
+    uint32_t thread_count;
+    uint32_t operation_count;
+    volatile long ready_count;
+    volatile long finished_count;
+    volatile uint64_t start_tsc;
+    scalability_thread threads[common::max_processors];
+  };
+
+  static bool send_block(scalability_thread& thread, void* block) noexcept
+  {
+    const uint32_t tail = thread.mailbox_tail;
+
+    if (tail - thread.mailbox_head == scalability_thread::mailbox_size)
+    {
+      return false;
+    }
+
+    thread.mailbox[tail % scalability_thread::mailbox_size] = block;
+    thread.mailbox_tail = tail + 1;
+
+    return true;
+  }
+
+  static void* receive_block(scalability_thread& thread) noexcept
+  {
+    const uint32_t head = thread.mailbox_head;
+
+    if (head == thread.mailbox_tail)
+    {
+      return nullptr;
+    }
+
+    void* block = thread.mailbox[head % scalability_thread::mailbox_size];
+    thread.mailbox_head = head + 1;
+
+    return block;
+  }
+
+  static void timed_free(memory_manager& heap, scalability_thread& thread, void* block) noexcept
+  {
+    const uint64_t start = __rdtsc();
+    heap.deallocate(block);
+    thread.free_latencies.record(__rdtsc() - start);
+  }
+
+  // Runs on every processor, the ones outside of the run return at once. Must not use boot services.
+  static void scalability_worker(void* argument)
+  {
+    constexpr uint32_t working_set = 128;
+    auto& run = *static_cast<scalability_run*>(argument);
+    const uint32_t index = common::current_processor();
+
+    if (index >= run.thread_count)
+    {
+      return;
+    }
+
+    auto& heap = *run.heap;
+    auto& self = run.threads[index];
+    auto& next = run.threads[(index + 1) % run.thread_count];
+    xorshift random{ 0x9E3779B97F4A7C15 * (index + 1) };
+    void* slots[working_set] = {};
+
+    // The last thread to arrive starts the clock, nobody allocates before everybody is ready.
+    if (static_cast<uint32_t>(_InterlockedIncrement(&run.ready_count)) == run.thread_count)
+    {
+      run.start_tsc = __rdtsc();
+    }
+
+    while (static_cast<uint32_t>(run.ready_count) != run.thread_count)
+    {
+      _mm_pause();
+    }
+
+    for (uint32_t j = 0; j < run.operation_count; j++)
+    {
+      const uint64_t value = random.next();
+      // Mostly small objects, a quarter of buffers up to a page and a few bigger ones.
+      const uint32_t size_class = value % 20;
+      const auto size = static_cast<uint32_t>(size_class < 14 ? 16 + (value >> 8) % 240 : size_class < 19 ? 256 + (value >> 8) % 3840 : 4096 + (value >> 8) % 28672);
+
+      const uint64_t start = __rdtsc();
+      void* block = heap.allocate(size);
+      self.allocate_latencies.record(__rdtsc() - start);
+
+      if (block == nullptr)
+      {
+        self.failed_count++;
+        continue;
+      }
+
+      self.allocation_count++;
+
+      // Half of the blocks are freed by the next processor, the rest replace a random block of the working set.
+      if (!(value & 0x80) || !send_block(next, block))
+      {
+        auto& slot = slots[(value >> 32) % working_set];
+
+        if (slot != nullptr)
+        {
+          timed_free(heap, self, slot);
+        }
+
+        slot = block;
+      }
+
+      while (void* remote = receive_block(self))
+      {
+        timed_free(heap, self, remote);
+      }
+    }
+
+    self.end_tsc = __rdtsc();
+    _InterlockedIncrement(&run.finished_count);
+
+    // The previous thread may still be sending.
+    while (static_cast<uint32_t>(run.finished_count) != run.thread_count)
+    {
+      while (void* remote = receive_block(self))
+      {
+        timed_free(heap, self, remote);
+      }
+
+      _mm_pause();
+    }
+
+    while (void* remote = receive_block(self))
+    {
+      heap.deallocate(remote);
+    }
+
+    for (auto* slot : slots)
+    {
+      if (slot != nullptr)
+      {
+        heap.deallocate(slot);
+      }
+    }
+  }
+
+  scalability_result allocator_scalability(memory_manager& heap, uint32_t thread_count, uint32_t operation_count)
+  {
+    scalability_result result{};
+    // Taken from firmware, the run state must not disturb the measured heap.
+    auto* run = static_cast<scalability_run*>(common::allocate_pages(sizeof(scalability_run)));
+
+    if (run == nullptr)
+    {
+      return result;
+    }
+
+    memset(run, 0, sizeof(scalability_run));
+    run->heap = &heap;
+    run->thread_count = thread_count;
+    run->operation_count = operation_count;
+
+    // APs can't grow the heap, the BSP grows it up front by the peak the threads may reach.
+    {
+      constexpr uint32_t chunk_size = 64 * 1024;
+      const uint32_t chunk_count = thread_count * 64;
+      auto** chunks = static_cast<void**>(common::allocate_pages(chunk_count * sizeof(void*)));
+
+      if (chunks != nullptr)
+      {
+        for (uint32_t j = 0; j < chunk_count; j++)
+        {
+          chunks[j] = heap.allocate(chunk_size);
+        }
+
+        for (uint32_t j = 0; j < chunk_count; j++)
+        {
+          if (chunks[j] != nullptr)
+          {
+            heap.deallocate(chunks[j]);
+          }
+        }
+
+        common::free_pages(chunks, chunk_count * sizeof(void*));
+      }
+    }
+
+    if (thread_count > 1 && !common::start_on_application_processors(scalability_worker, run))
+    {
+      common::free_pages(run, sizeof(scalability_run));
+      return result;
+    }
+
+    scalability_worker(run);
+    common::wait_for_application_processors();
+
+    // Merged into the first thread.
+    auto& merged = run->threads[0];
+
+    for (uint32_t j = 0; j < thread_count; j++)
+    {
+      const auto& thread = run->threads[j];
+
+      result.cycles = thread.end_tsc - run->start_tsc > result.cycles ? thread.end_tsc - run->start_tsc : result.cycles;
+      result.allocation_count += thread.allocation_count;
+      result.failed_count += thread.failed_count;
+
+      if (j != 0)
+      {
+        merged.allocate_latencies.merge(thread.allocate_latencies);
+        merged.free_latencies.merge(thread.free_latencies);
+      }
+    }
+
+    result.allocate = merged.allocate_latencies.percentiles();
+    result.free = merged.free_latencies.percentiles();
+
+    common::free_pages(run, sizeof(scalability_run));
+    return result;
+  }
+
+  void compare_allocator_scalability()
+  {
+    constexpr uint32_t operation_count = 200000;
+    const uint32_t processor_count = common::processor_count();
+    per_cpu_tlsf_allocator<> per_cpu_heap{};
+    memory_manager* heaps[] = { globals::mem_manager, &per_cpu_heap };
+    const CHAR16* names[] = { L"tlsf_allocator"_w, L"per_cpu_tlsf_allocator"_w };
+
+    for (uint32_t j = 0; j < 2; j++)
+    {
+      // Powers of two and all processors.
+      for (uint32_t thread_count = 1;; thread_count *= 2)
+      {
+        thread_count = thread_count < processor_count ? thread_count : processor_count;
+        const auto result = allocator_scalability(*heaps[j], thread_count, operation_count);
+
+        if (result.allocation_count == 0)
+        {
+          Print(L"scalability, %s, %u threads: not run\n"_w, names[j], thread_count);
+          break;
+        }
+
+        Print(L"scalability, %s, %u threads: %lu allocations/Mcycle, %lu failed\n"_w, names[j], thread_count,
+          result.allocation_count * 1000000 / result.cycles, result.failed_count);
+        Print(L"  allocate p50 %lu, p99 %lu, p99.9 %lu, max %lu cycles; free p50 %lu, p99 %lu, p99.9 %lu, max %lu cycles\n"_w,
+          result.allocate.p50, result.allocate.p99, result.allocate.p999, result.allocate.max,
+          result.free.p50, result.free.p99, result.free.p999, result.free.max);
+
+        if (thread_count == processor_count)
+        {
+          break;
+        }
+      }
+    }
+  }
+
+  struct alignas(64) lock_contention_thread
+  {
+    uint64_t acquisition_count;
+    latency_histogram acquire_latencies;
+  };
+
+  template<class Locking>
+  struct lock_contention_run
+  {
+    typename Locking::lock_type lock;
+    uint32_t thread_count;
+    uint64_t duration;
+    volatile long ready_count;
+    volatile uint64_t start_tsc;
+    // Written in the critical section.
+    volatile uint64_t shared_counter;
+    lock_contention_thread threads[common::max_processors];
+  };
+
+  // Runs on every processor, the ones outside of the run return at once. Must not use boot services.
+  template<class Locking>
+  static void lock_contention_worker(void* argument)
+  {
+    auto& run = *static_cast<lock_contention_run<Locking>*>(argument);
+    const uint32_t index = common::current_processor();
+
+    if (index >= run.thread_count)
+    {
+      return;
+    }
+
+    auto& self = run.threads[index];
+    xorshift random{ 0x9E3779B97F4A7C15 * (index + 1) };
+
+    if (static_cast<uint32_t>(_InterlockedIncrement(&run.ready_count)) == run.thread_count)
+    {
+      run.start_tsc = __rdtsc();
+    }
+
+    while (static_cast<uint32_t>(run.ready_count) != run.thread_count)
+    {
+      _mm_pause();
+    }
+
+    const uint64_t end_tsc = run.start_tsc + run.duration;
+
+    for (uint64_t now = __rdtsc(); now < end_tsc; now = __rdtsc())
+    {
+      {
+        typename Locking::guard _{ &run.lock };
+
+        self.acquire_latencies.record(__rdtsc() - now);
+
+        // About as long as a TLSF allocation holds the heap lock.
+        run.shared_counter = run.shared_counter + 1;
+
+        for (uint32_t j = 0; j < 8; j++)
+        {
+          _mm_pause();
+        }
+      }
+
+      self.acquisition_count++;
+
+      // Some work outside of the lock, so a releasing processor doesn't always win it back.
+      for (uint64_t j = random.next() % 64; j != 0; j--)
+      {
+        _mm_pause();
+      }
+    }
+  }
+
+  // thread_count processors take the same lock for duration TSC cycles. Prints acquisitions per million cycles,
+  // the acquisition latency percentiles and the acquisitions of the least and the most lucky processor,
+  // which are equal for a perfectly fair lock.
+  template<class Locking>
+  static void lock_contention(const CHAR16* name, uint32_t thread_count, uint64_t duration)
+  {
+    auto* memory = common::allocate_pages(sizeof(lock_contention_run<Locking>));
+
+    if (memory == nullptr)
+    {
+      return;
+    }
+
+    auto* run = new (memory) lock_contention_run<Locking>{};
+
+    run->thread_count = thread_count;
+    run->duration = duration;
+
+    if (!common::start_on_application_processors(lock_contention_worker<Locking>, run))
+    {
+      Print(L"lock contention, %s, %u threads: not run\n"_w, name, thread_count);
+      common::free_pages(memory, sizeof(lock_contention_run<Locking>));
+      return;
+    }
+
+    lock_contention_worker<Locking>(run);
+    common::wait_for_application_processors();
+
+    auto& merged = run->threads[0].acquire_latencies;
+    uint64_t acquisition_count = 0;
+    uint64_t min_count = UINT64_MAX;
+    uint64_t max_count = 0;
+
+    for (uint32_t j = 0; j < thread_count; j++)
+    {
+      const uint64_t count = run->threads[j].acquisition_count;
+
+      acquisition_count += count;
+      min_count = count < min_count ? count : min_count;
+      max_count = count > max_count ? count : max_count;
+
+      if (j != 0)
+      {
+        merged.merge(run->threads[j].acquire_latencies);
+      }
+    }
+
+    const auto acquire = merged.percentiles();
+
+    Print(L"lock contention, %s, %u threads: %lu acquisitions/Mcycle, acquire p50 %lu, p99 %lu, p99.9 %lu, max %lu cycles, "
+      L"per thread min %lu, max %lu\n"_w, name, thread_count, acquisition_count * 1000000 / duration,
+      acquire.p50, acquire.p99, acquire.p999, acquire.max, min_count, max_count);
+
+    common::free_pages(memory, sizeof(lock_contention_run<Locking>));
+  }
+
+  void compare_lock_contention()
+  {
+    constexpr uint64_t duration = 100000000;
+    const uint32_t processor_count = common::processor_count();
+
+    for (uint32_t thread_count = 2; thread_count <= 16 && thread_count <= processor_count; thread_count *= 2)
+    {
+      lock_contention<common::spin_locking>(L"spinlock"_w, thread_count, duration);
+      lock_contention<common::ticket_locking>(L"ticket_lock"_w, thread_count, duration);
+      lock_contention<common::mcs_locking>(L"mcs_lock"_w, thread_count, duration);
+    }
+  }
+
+  // A small snapshot like heap statistics. Writers store the same number into every field, so a reader that
+  // sees different ones has read a torn value.
+  struct read_mostly_value
+  {
+    uint64_t fields[4];
+  };
+
+  struct spinlock_read_mostly
+  {
+    volatile long lock;
+    read_mostly_value value;
+
+    read_mostly_value load(uint32_t) noexcept
+    {
+      common::spinlock_guard _{ &lock };
+      return value;
+    }
+
+    void store(const read_mostly_value& new_value) noexcept
+    {
+      common::spinlock_guard _{ &lock };
+      value = new_value;
+    }
+  };
+
+  struct rw_spinlock_read_mostly
+  {
+    common::rw_spinlock lock;
+    read_mostly_value value;
+
+    read_mostly_value load(uint32_t processor) noexcept
+    {
+      lock.lock_shared(processor);
+      const auto result = value;
+      lock.unlock_shared(processor);
+
+      return result;
+    }
+
+    void store(const read_mostly_value& new_value) noexcept
+    {
+      common::write_lock_guard _{ &lock };
+      value = new_value;
+    }
+  };
+
+  struct seqlock_read_mostly
+  {
+    common::seqlock<read_mostly_value> value;
+
+    read_mostly_value load(uint32_t) noexcept
+    {
+      return value.load();
+    }
+
+    void store(const read_mostly_value& new_value) noexcept
+    {
+      value.store(new_value);
+    }
+  };
+
+  struct alignas(64) read_mostly_thread
+  {
+    uint64_t read_count;
+    uint64_t write_count;
+    uint64_t torn_count;
+  };
+
+  template<class Access>
+  struct read_mostly_run
+  {
+    Access access;
+    uint32_t thread_count;
+    uint64_t duration;
+    volatile long ready_count;
+    volatile uint64_t start_tsc;
+    read_mostly_thread threads[common::max_processors];
+  };
+
+  // One access in write_interval is a write.
+  static constexpr uint64_t write_interval = 4096;
+
+  // Runs on every processor, the ones outside of the run return at once. Must not use boot services.
+  template<class Access>
+  static void read_mostly_worker(void* argument)
+  {
+    auto& run = *static_cast<read_mostly_run<Access>*>(argument);
+    const uint32_t index = common::current_processor();
+
+    if (index >= run.thread_count)
+    {
+      return;
+    }
+
+    auto& self = run.threads[index];
+    xorshift random{ 0x9E3779B97F4A7C15 * (index + 1) };
+
+    if (static_cast<uint32_t>(_InterlockedIncrement(&run.ready_count)) == run.thread_count)
+    {
+      run.start_tsc = __rdtsc();
+    }
+
+    while (static_cast<uint32_t>(run.ready_count) != run.thread_count)
+    {
+      _mm_pause();
+    }
+
+    const uint64_t end_tsc = run.start_tsc + run.duration;
+
+    // The clock is read once per batch, it costs more than a read of the value.
+    while (__rdtsc() < end_tsc)
+    {
+      for (uint32_t j = 0; j < 64; j++)
+      {
+        if (random.next() % write_interval == 0)
+        {
+          const uint64_t number = self.write_count++ * common::max_processors + index;
+
+          run.access.store({ number, number, number, number });
+          continue;
+        }
+
+        const auto value = run.access.load(index);
+
+        self.read_count++;
+
+        if (value.fields[0] != value.fields[1] || value.fields[0] != value.fields[2] || value.fields[0] != value.fields[3])
+        {
+          self.torn_count++;
+        }
+      }
+    }
+  }
+
+  // thread_count processors read a 32-byte value behind the given synchronization for duration TSC cycles
+  // and overwrite it once in write_interval accesses. Prints reads per million cycles and torn reads,
+  // which must be none.
+  template<class Access>
+  static void read_mostly(const CHAR16* name, uint32_t thread_count, uint64_t duration)
+  {
+    auto* memory = common::allocate_pages(sizeof(read_mostly_run<Access>));
+
+    if (memory == nullptr)
+    {
+      return;
+    }
+
+    auto* run = new (memory) read_mostly_run<Access>{};
+
+    run->thread_count = thread_count;
+    run->duration = duration;
+
+    if (thread_count > 1 && !common::start_on_application_processors(read_mostly_worker<Access>, run))
+    {
+      Print(L"read mostly, %s, %u threads: not run\n"_w, name, thread_count);
+      common::free_pages(memory, sizeof(read_mostly_run<Access>));
+      return;
+    }
+
+    read_mostly_worker<Access>(run);
+
+    if (thread_count > 1)
+    {
+      common::wait_for_application_processors();
+    }
+
+    uint64_t read_count = 0;
+    uint64_t write_count = 0;
+    uint64_t torn_count = 0;
+
+    for (uint32_t j = 0; j < thread_count; j++)
+    {
+      read_count += run->threads[j].read_count;
+      write_count += run->threads[j].write_count;
+      torn_count += run->threads[j].torn_count;
+    }
+
+    Print(L"read mostly, %s, %u threads: %lu reads/Mcycle, %lu writes, %lu torn reads\n"_w, name, thread_count,
+      read_count * 1000000 / duration, write_count, torn_count);
+
+    common::free_pages(memory, sizeof(read_mostly_run<Access>));
+  }
+
+  void compare_read_mostly()
+  {
+    constexpr uint64_t duration = 100000000;
+    const uint32_t processor_count = common::processor_count();
+
+    // Powers of two and all processors.
+    for (uint32_t thread_count = 1;; thread_count *= 2)
+    {
+      thread_count = thread_count < processor_count ? thread_count : processor_count;
+
+      read_mostly<spinlock_read_mostly>(L"spinlock"_w, thread_count, duration);
+      read_mostly<rw_spinlock_read_mostly>(L"rw_spinlock"_w, thread_count, duration);
+      read_mostly<seqlock_read_mostly>(L"seqlock"_w, thread_count, duration);
+
+      if (thread_count == processor_count)
+      {
+        break;
+      }
+    }
+  }
+
+  // Sum of count 32-bit elements, serially on the BSP and with parallel::reduce on every processor.
+  static void parallel_reduce(uint64_t count)
+  {
+    const size_t size = count * sizeof(uint32_t);
+    auto* elements = static_cast<uint32_t*>(common::allocate_pages(size));
+
+    if (elements == nullptr)
+    {
+      Print(L"parallel reduce, %lu elements: not run, out of memory\n"_w, count);
+      return;
+    }
+
+    // Touches every page before the clock starts.
+    for (uint64_t j = 0; j < count; j++)
+    {
+      elements[j] = static_cast<uint32_t>(j);
+    }
+
+    auto* global_scheduler = globals::scheduler;
+    task_scheduler scheduler{};
+
+    scheduler.start();
+
+    const uint32_t processor_count = scheduler.concurrency();
+
+    // The APs stay parked in scheduler, so the serial run can't borrow them.
+    globals::scheduler = nullptr;
+    const uint64_t serial_start = __rdtsc();
+    const uint64_t serial_sum = parallel::reduce(elements, elements + count, uint64_t{});
+    const uint64_t serial_cycles = __rdtsc() - serial_start;
+
+    globals::scheduler = &scheduler;
+    const uint64_t parallel_start = __rdtsc();
+    const uint64_t parallel_sum = parallel::reduce(elements, elements + count, uint64_t{});
+    const uint64_t parallel_cycles = __rdtsc() - parallel_start;
+
+    globals::scheduler = global_scheduler;
+    scheduler.stop();
+
+    const uint64_t speedup = serial_cycles * 100 / (parallel_cycles != 0 ? parallel_cycles : 1);
+
+    Print(L"parallel reduce, %lu elements, %u processors: serial %lu cycles, parallel %lu cycles, %lu.%02lux%a\n"_w,
+      count, processor_count, serial_cycles, parallel_cycles, speedup / 100, speedup % 100,
+      serial_sum == parallel_sum ? "" : ", sums differ");
+
+    common::free_pages(elements, size);
+  }
+
+  void compare_parallel_reduce()
+  {
+    parallel_reduce(1000000);
+    parallel_reduce(100000000);
+  }
+
+  void run_all()
+  {
+    compare_large_page_arena();
+    compare_vector_growth();
+    compare_deferred_free();
+    compare_pmr_containers();
+    compare_compaction();
+    compare_allocator_scalability();
+    compare_lock_contention();
+    compare_read_mostly();
+    compare_parallel_reduce();
+  }
+}
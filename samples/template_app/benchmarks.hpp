@@ -0,0 +1,78 @@
+#pragma once
+#include <cstdint>
+#include <memory_resource>
+
+namespace hh
+{
+  class memory_manager;
+
+  // In-firmware benchmarks. They print their results to the console, so they have to be started on the BSP
+  // while boot services are available.
+  namespace benchmarks
+  {
+    // Average TSC cycles per hop of a random walk over node_count heap nodes of node_size bytes.
+    uint64_t pointer_chase(memory_manager& heap, uint32_t node_count, uint32_t node_size, uint32_t hop_count);
+
+    // Pointer chasing over a 4 KB backed heap and over a 2 MB aligned large page arena.
+    void compare_large_page_arena();
+
+    // Appending 1M elements to std::vector and to hh::vector that grows in place when it can.
+    void compare_vector_growth();
+
+    // TSC cycles spent freeing a node_count long list of node_size byte nodes, batch flush included.
+    uint64_t teardown(memory_manager& heap, uint32_t node_count, uint32_t node_size);
+
+    // Tearing down a 1M node list with one lock acquisition per free and with deferred frees.
+    void compare_deferred_free();
+
+    // TSC cycles to fill, walk and destroy a std::pmr::vector and std::pmr::map of element_count elements.
+    uint64_t fill_pmr_containers(std::pmr::memory_resource* resource, uint32_t element_count);
+
+    // The pmr containers on the global heap and on an arena of their own.
+    void compare_pmr_containers();
+
+    // Large allocations in a fragmented compacting_heap before and after incremental compaction.
+    void compare_compaction();
+
+    // TSC cycles of one allocation or free at the given percentiles of a run.
+    struct latency_percentiles
+    {
+      uint64_t p50;
+      uint64_t p99;
+      uint64_t p999;
+      uint64_t max;
+    };
+
+    struct scalability_result
+    {
+      // From the moment all threads were ready until the last one finished its allocations.
+      uint64_t cycles;
+      uint64_t allocation_count;
+      uint64_t failed_count;
+      latency_percentiles allocate;
+      latency_percentiles free;
+    };
+
+    // thread_count processors, the BSP and APs started with StartupAllAPs, allocate operation_count mixed size blocks
+    // each from heap at the same time. Half of the blocks are freed by the next processor, the rest by their owner.
+    // Returns an empty result if the APs can't be started.
+    scalability_result allocator_scalability(memory_manager& heap, uint32_t thread_count, uint32_t operation_count);
+
+    // The spinlocked tlsf_allocator behind the global heap and per_cpu_tlsf_allocator at 1, 2, 4... processors.
+    void compare_allocator_scalability();
+
+    // spinlock_guard, ticket_lock and mcs_lock taken by 2, 4, 8 and 16 processors at once: acquisition latency
+    // and how evenly the acquisitions are spread over the processors.
+    void compare_lock_contention();
+
+    // A small value read by every processor and written once in a few thousand accesses, behind spinlock_guard,
+    // rw_spinlock and seqlock, at 1, 2, 4... processors.
+    void compare_read_mostly();
+
+    // parallel::reduce of 1M and 100M 32-bit elements serially and on every processor. Run it at -smp 1, 2, 4
+    // and 8 to see the scaling.
+    void compare_parallel_reduce();
+
+    void run_all();
+  }
+}
@@ -0,0 +1,322 @@
+#pragma once
+#include "delete_constructors.hpp"
+#include "common.hpp"
+#include "globals.hpp"
+#include "uefi.hpp"
+#include <intrin.h>
+#include <cstdint>
+#include <cstring>
+
+namespace hh
+{
+  // Binary buddy front-end for page aligned requests. Memory comes from firmware in 2 MB aligned chunks
+  // and is split into power of two blocks from 4 KB to 2 MB, every block is aligned to its size, so page
+  // alignment costs nothing and freed blocks merge back without leaving holes in the TLSF pools.
+  // Like slab_cache it has no lock of its own, the owning allocator serializes the calls.
+  class buddy_allocator : non_relocatable
+  {
+  public:
+    static constexpr uint32_t min_block_size = common::page_size;
+    static constexpr uint32_t max_block_size = common::large_page_size;
+
+  private:
+    static constexpr uint32_t order_count = 10;
+    static constexpr uint32_t chunk_pages = max_block_size / min_block_size;
+    static constexpr uint32_t max_chunks = 64;
+    // State of the first page of a block: its order, with free_flag set if the block is free.
+    // Other pages of a block are marked with tail_page.
+    static constexpr uint8_t free_flag = 0x80;
+    static constexpr uint8_t tail_page = 0x7F;
+    static constexpr size_t page_states_size = max_chunks * chunk_pages;
+
+    static_assert(max_block_size == min_block_size << (order_count - 1));
+
+    struct free_block
+    {
+      free_block* next;
+      free_block* prev;
+    };
+
+    uint8_t* chunks_[max_chunks];
+    uint32_t chunk_count_;
+    // chunk_pages states per chunk, taken from firmware with the first chunk.
+    uint8_t* page_states_;
+    free_block* free_lists_[order_count];
+
+  private:
+    static uint32_t order_for(size_t size) noexcept
+    {
+      const size_t page_count = (size + min_block_size - 1) / min_block_size;
+      unsigned long highest_bit = 0;
+
+      if (page_count <= 1)
+      {
+        return 0;
+      }
+
+      _BitScanReverse64(&highest_bit, page_count - 1);
+      return highest_bit + 1;
+    }
+
+    void push(uint32_t order, void* block) noexcept
+    {
+      auto* entry = static_cast<free_block*>(block);
+
+      entry->prev = nullptr;
+      entry->next = free_lists_[order];
+
+      if (entry->next != nullptr)
+      {
+        entry->next->prev = entry;
+      }
+
+      free_lists_[order] = entry;
+    }
+
+    void unlink(uint32_t order, free_block* entry) noexcept
+    {
+      if (entry->prev != nullptr)
+      {
+        entry->prev->next = entry->next;
+      }
+      else
+      {
+        free_lists_[order] = entry->next;
+      }
+
+      if (entry->next != nullptr)
+      {
+        entry->next->prev = entry->prev;
+      }
+    }
+
+    // Index of the chunk that contains ptr or max_chunks.
+    uint32_t chunk_of(const void* ptr) const noexcept
+    {
+      const auto* chunk = reinterpret_cast<const uint8_t*>(reinterpret_cast<uintptr_t>(ptr) & ~static_cast<uintptr_t>(max_block_size - 1));
+
+      for (uint32_t j = 0; j < chunk_count_; j++)
+      {
+        if (chunks_[j] == chunk)
+        {
+          return j;
+        }
+      }
+
+      return max_chunks;
+    }
+
+    uint8_t* states_of(uint32_t chunk) const noexcept
+    {
+      return page_states_ + chunk * chunk_pages;
+    }
+
+    // Chunks can only be taken on the BSP while boot services are available.
+    bool add_chunk() noexcept
+    {
+      if (chunk_count_ == max_chunks || !globals::boot_state || !common::is_bootstrap_processor())
+      {
+        return false;
+      }
+
+      if (page_states_ == nullptr)
+      {
+        page_states_ = static_cast<uint8_t*>(common::allocate_pages(page_states_size));
+
+        if (page_states_ == nullptr)
+        {
+          return false;
+        }
+      }
+
+      auto* chunk = static_cast<uint8_t*>(common::allocate_pages(max_block_size, max_block_size));
+
+      if (chunk == nullptr)
+      {
+        return false;
+      }
+
+      auto* states = states_of(chunk_count_);
+
+      states[0] = free_flag | (order_count - 1);
+
+      for (uint32_t j = 1; j < chunk_pages; j++)
+      {
+        states[j] = tail_page;
+      }
+
+      chunks_[chunk_count_++] = chunk;
+      push(order_count - 1, chunk);
+
+      return true;
+    }
+
+  public:
+    buddy_allocator() noexcept : chunks_{}, chunk_count_{}, page_states_{}, free_lists_{} {}
+
+    static constexpr bool fits(size_t size) noexcept
+    {
+      return size <= max_block_size;
+    }
+
+    // Block of at least size bytes aligned to its own size, which is a power of two of at least a page.
+    // Returns nullptr if no block is free and no chunk can be added.
+    void* allocate(size_t size) noexcept
+    {
+      const uint32_t order = order_for(size);
+      uint32_t free_order = order;
+
+      while (free_order < order_count && free_lists_[free_order] == nullptr)
+      {
+        free_order++;
+      }
+
+      if (free_order == order_count)
+      {
+        if (!add_chunk())
+        {
+          return nullptr;
+        }
+
+        free_order = order_count - 1;
+      }
+
+      auto* block = reinterpret_cast<uint8_t*>(free_lists_[free_order]);
+      unlink(free_order, free_lists_[free_order]);
+
+      const uint32_t chunk = chunk_of(block);
+      auto* states = states_of(chunk);
+      const auto page_index = static_cast<uint32_t>((block - chunks_[chunk]) / min_block_size);
+
+      // Split until the block has the requested order, the upper halves go to the free lists.
+      while (free_order > order)
+      {
+        free_order--;
+
+        const uint32_t buddy_index = page_index + (1u << free_order);
+        states[buddy_index] = free_flag | free_order;
+        push(free_order, chunks_[chunk] + static_cast<size_t>(buddy_index) * min_block_size);
+      }
+
+      states[page_index] = static_cast<uint8_t>(order);
+      return block;
+    }
+
+    bool owns(const void* ptr) const noexcept
+    {
+      return chunk_count_ != 0 && chunk_of(ptr) != max_chunks;
+    }
+
+    // Pointer must belong to the allocator.
+    size_t block_size(const void* ptr) const noexcept
+    {
+      const uint32_t chunk = chunk_of(ptr);
+      const auto page_index = static_cast<uint32_t>((static_cast<const uint8_t*>(ptr) - chunks_[chunk]) / min_block_size);
+
+      return static_cast<size_t>(min_block_size) << states_of(chunk)[page_index];
+    }
+
+    // Pointer must belong to the allocator. Returns the size of the released block.
+    size_t deallocate(void* ptr) noexcept
+    {
+      const uint32_t chunk = chunk_of(ptr);
+      auto* states = states_of(chunk);
+      auto page_index = static_cast<uint32_t>((static_cast<uint8_t*>(ptr) - chunks_[chunk]) / min_block_size);
+      uint32_t order = states[page_index];
+      const size_t size = static_cast<size_t>(min_block_size) << order;
+
+      // Merge with the buddy as long as it's a free block of the same order.
+      while (order < order_count - 1)
+      {
+        const uint32_t buddy_index = page_index ^ (1u << order);
+
+        if (states[buddy_index] != (free_flag | order))
+        {
+          break;
+        }
+
+        unlink(order, reinterpret_cast<free_block*>(chunks_[chunk] + static_cast<size_t>(buddy_index) * min_block_size));
+
+        states[page_index > buddy_index ? page_index : buddy_index] = tail_page;
+        page_index = page_index < buddy_index ? page_index : buddy_index;
+        order++;
+      }
+
+      states[page_index] = static_cast<uint8_t>(free_flag | order);
+      push(order, chunks_[chunk] + static_cast<size_t>(page_index) * min_block_size);
+
+      return size;
+    }
+
+    // Adds the chunks to a heap snapshot.
+    void accumulate(EFI_SAMPLE_HEAP_STATISTICS& statistics) const noexcept
+    {
+      for (uint32_t j = 0; j < chunk_count_; j++)
+      {
+        const auto* states = states_of(j);
+
+        statistics.PoolBytes += max_block_size;
+
+        for (uint32_t page_index = 0; page_index < chunk_pages; page_index += 1u << (states[page_index] & ~free_flag))
+        {
+          if (!(states[page_index] & free_flag))
+          {
+            statistics.UsedBlockCount++;
+            continue;
+          }
+
+          const size_t size = static_cast<size_t>(min_block_size) << (states[page_index] & ~free_flag);
+
+          statistics.FreeBlockCount++;
+          statistics.FreeBytes += size;
+
+          if (size > statistics.LargestFreeBlock)
+          {
+            statistics.LargestFreeBlock = size;
+          }
+        }
+      }
+    }
+
+    // Gives chunks without allocated blocks back to firmware. BSP only, boot services must be available.
+    void trim() noexcept
+    {
+      for (uint32_t j = 0; j < chunk_count_;)
+      {
+        if (states_of(j)[0] != (free_flag | (order_count - 1)))
+        {
+          j++;
+          continue;
+        }
+
+        unlink(order_count - 1, reinterpret_cast<free_block*>(chunks_[j]));
+        common::free_pages(chunks_[j], max_block_size);
+
+        // The last chunk takes the freed slot.
+        chunk_count_--;
+
+        if (j != chunk_count_)
+        {
+          chunks_[j] = chunks_[chunk_count_];
+          memcpy(states_of(j), states_of(chunk_count_), chunk_pages);
+        }
+      }
+    }
+
+    ~buddy_allocator() noexcept
+    {
+      if (globals::boot_state)
+      {
+        for (uint32_t j = 0; j < chunk_count_; j++)
+        {
+          common::free_pages(chunks_[j], max_block_size);
+        }
+
+        if (page_states_ != nullptr)
+        {
+          common::free_pages(page_states_, page_states_size);
+        }
+      }
+    }
+  };
+}
@@ -0,0 +1,56 @@
+; Captures the non-volatile context of the caller, so that `frame_walk_pdata`
+; can walk the stack from the point of the call without throwing. The layout
+; of the first argument is `exc::frame_walk_context`, of the second one
+; `exc::machine_frame`. Only the general purpose registers are captured,
+; .pdata unwinding reads them for the frame pointers and saved registers.
+;
+;     void __hh_capture_context(frame_walk_context* ctx, machine_frame* mach);
+;
+; This is a leaf function without a frame, it needs no .pdata entry.
+
+walk_ctx struct
+	$xmm     oword 9 dup (?)	; xmm6-xmm14
+	padding1 qword ?
+	dummy_rsp qword ?
+	$xmm15   oword ?
+
+	$rbx   qword ?		; 0xb0
+	$rbp   qword ?
+	$rsi   qword ?
+	$rdi   qword ?
+	$r12   qword ?
+	$r13   qword ?
+	$r14   qword ?
+	$r15   qword ?
+walk_ctx ends
+
+mach_fr struct
+	$rip   qword ?
+	$cs    qword ?
+	eflags qword ?
+	$rsp   qword ?
+	$ss    qword ?
+mach_fr ends
+
+.code
+
+__hh_capture_context proc public
+	mov [rcx + walk_ctx.$rbx], rbx
+	mov [rcx + walk_ctx.$rbp], rbp
+	mov [rcx + walk_ctx.$rsi], rsi
+	mov [rcx + walk_ctx.$rdi], rdi
+	mov [rcx + walk_ctx.$r12], r12
+	mov [rcx + walk_ctx.$r13], r13
+	mov [rcx + walk_ctx.$r14], r14
+	mov [rcx + walk_ctx.$r15], r15
+
+	; The caller resumes at our return address with rsp above it.
+	mov rax, [rsp]
+	mov [rdx + mach_fr.$rip], rax
+	lea rax, [rsp + 8]
+	mov [rdx + mach_fr.$rsp], rax
+
+	ret
+__hh_capture_context endp
+
+end
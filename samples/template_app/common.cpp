@@ -13,67 +13,351 @@ extern "C"
 
 namespace hh::common
 {
-  spinlock_guard::spinlock_guard(volatile long* lock) noexcept : lock_{ lock }
+  static constexpr uint32_t ia32_tsc_aux = 0xC0000103;
+  static EFI_MP_SERVICES_PROTOCOL* mp_services_ = nullptr;
+  static uint32_t processor_count_ = 1;
+  static bool tsc_aux_tagged_ = false;
+
+  static bool is_rdtscp_supported() noexcept
+  {
+    int regs[4] = {};
+
+    __cpuid(regs, 0x80000000);
+
+    if (static_cast<uint32_t>(regs[0]) < 0x80000001)
+    {
+      return false;
+    }
+
+    __cpuid(regs, 0x80000001);
+
+    return (regs[3] & (1 << 27)) != 0;
+  }
+
+  static void EFIAPI tag_processor(void* buffer)
+  {
+    auto* mp_services = static_cast<EFI_MP_SERVICES_PROTOCOL*>(buffer);
+    UINTN processor_number = 0;
+
+    mp_services->WhoAmI(mp_services, &processor_number);
+    __writemsr(ia32_tsc_aux, processor_number);
+  }
+
+  void initialize_processors() noexcept
+  {
+    if (EFI_ERROR(gBS->LocateProtocol(&gEfiMpServiceProtocolGuid, nullptr, reinterpret_cast<void**>(&mp_services_))))
+    {
+      mp_services_ = nullptr;
+      return;
+    }
+
+    UINTN total_count = 0;
+    UINTN enabled_count = 0;
+
+    if (EFI_ERROR(mp_services_->GetNumberOfProcessors(mp_services_, &total_count, &enabled_count)))
+    {
+      mp_services_ = nullptr;
+      return;
+    }
+
+    processor_count_ = total_count > max_processors ? max_processors : static_cast<uint32_t>(total_count);
+
+    if (!is_rdtscp_supported())
+    {
+      return;
+    }
+
+    tag_processor(mp_services_);
+
+    if (enabled_count > 1)
+    {
+      // Blocking call, every enabled AP has its TSC_AUX written when this returns.
+      mp_services_->StartupAllAPs(mp_services_, tag_processor, FALSE, nullptr, 0, mp_services_, nullptr);
+    }
+
+    tsc_aux_tagged_ = true;
+  }
+
+  uint32_t processor_count() noexcept
+  {
+    return processor_count_;
+  }
+
+  uint32_t current_processor() noexcept
+  {
+    uint32_t processor_number = 0;
+
+    if (tsc_aux_tagged_)
+    {
+      __rdtscp(&processor_number);
+    }
+    else if (mp_services_ != nullptr)
+    {
+      UINTN number = 0;
+      mp_services_->WhoAmI(mp_services_, &number);
+      processor_number = static_cast<uint32_t>(number);
+    }
+
+    // After ExitBootServices the OS owns TSC_AUX, so numbers outside of our tables fold onto the BSP slot.
+    return processor_number < processor_count_ ? processor_number : 0;
+  }
+
+  uint64_t processor_timestamp(uint32_t& processor) noexcept
+  {
+    if (tsc_aux_tagged_)
+    {
+      const uint64_t tsc = __rdtscp(&processor);
+      processor = processor < processor_count_ ? processor : 0;
+      return tsc;
+    }
+
+    processor = current_processor();
+    return __rdtsc();
+  }
+
+  // Signaled by MP services when the APs finish the procedure of start_on_application_processors().
+  static EFI_EVENT procedure_done_event_ = nullptr;
+  static bool procedure_running_ = false;
+  // Set while the running procedure only returns when its owner tells it to.
+  static bool procedure_parked_ = false;
+
+  bool application_processors_idle() noexcept
+  {
+    if (procedure_running_)
+    {
+      if (gBS->CheckEvent(procedure_done_event_) == EFI_NOT_READY)
+      {
+        return false;
+      }
+
+      procedure_running_ = false;
+    }
+
+    return true;
+  }
+
+  static void wait_for_procedure() noexcept
+  {
+    if (!procedure_running_)
+    {
+      return;
+    }
+
+    UINTN signaled_index = 0;
+    gBS->WaitForEvent(1, &procedure_done_event_, &signaled_index);
+    procedure_running_ = false;
+  }
+
+  static bool start_procedure(processor_procedure procedure, void* argument) noexcept
+  {
+    if (mp_services_ == nullptr || processor_count_ < 2 || procedure_parked_)
+    {
+      return false;
+    }
+
+    // MP services take one procedure at a time, a zero page pool refill may still be running.
+    wait_for_procedure();
+
+    if (procedure_done_event_ == nullptr && EFI_ERROR(gBS->CreateEvent(0, TPL_APPLICATION, nullptr, nullptr, &procedure_done_event_)))
+    {
+      procedure_done_event_ = nullptr;
+      return false;
+    }
+
+    // Non-blocking mode, MP services signal the event once every AP has returned.
+    const auto status = mp_services_->StartupAllAPs(mp_services_, reinterpret_cast<EFI_AP_PROCEDURE>(procedure), FALSE,
+      procedure_done_event_, 0, argument, nullptr);
+
+    procedure_running_ = !EFI_ERROR(status);
+    return procedure_running_;
+  }
+
+  bool start_on_application_processors(processor_procedure procedure, void* argument) noexcept
   {
-    lock_spinlock();
+    return start_procedure(procedure, argument);
   }
 
-  spinlock_guard::~spinlock_guard() noexcept
+  void wait_for_application_processors() noexcept
   {
-    if (lock_ != nullptr)
+    if (!procedure_parked_)
     {
-      unlock();
+      wait_for_procedure();
     }
   }
 
-  bool spinlock_guard::try_lock() noexcept
+  bool park_application_processors(processor_procedure procedure, void* argument) noexcept
   {
-    return (!(*lock_) && !_interlockedbittestandset(lock_, 0));
+    procedure_parked_ = start_procedure(procedure, argument);
+    return procedure_parked_;
   }
 
-  void spinlock_guard::unlock() noexcept
+  void unpark_application_processors() noexcept
   {
-    *lock_ = 0;
+    if (procedure_parked_)
+    {
+      wait_for_procedure();
+      procedure_parked_ = false;
+    }
   }
 
-  spinlock_guard::spinlock_guard(spinlock_guard&& obj) noexcept
+  bool is_bootstrap_processor() noexcept
   {
-    lock_ = obj.lock_;
-    obj.lock_ = nullptr;
+    constexpr uint32_t ia32_apic_base = 0x1B;
+    constexpr uint64_t bsp_flag = 1 << 8;
+
+    return (__readmsr(ia32_apic_base) & bsp_flag) != 0;
   }
 
-  spinlock_guard& spinlock_guard::operator=(spinlock_guard&& obj) noexcept
+  void* allocate_pages(size_t size, size_t alignment) noexcept
   {
-    if (lock_ != nullptr)
+    const UINTN page_count = EFI_SIZE_TO_PAGES(size);
+    const UINTN slack_pages = alignment > page_size ? EFI_SIZE_TO_PAGES(alignment) - 1 : 0;
+    EFI_PHYSICAL_ADDRESS memory = 0;
+
+    if (EFI_ERROR(gBS->AllocatePages(AllocateAnyPages, EfiRuntimeServicesData, page_count + slack_pages, &memory)))
+    {
+      return nullptr;
+    }
+
+    if (slack_pages == 0)
+    {
+      return reinterpret_cast<void*>(memory);
+    }
+
+    const EFI_PHYSICAL_ADDRESS aligned_memory = (memory + alignment - 1) & ~static_cast<EFI_PHYSICAL_ADDRESS>(alignment - 1);
+    const UINTN head_pages = EFI_SIZE_TO_PAGES(aligned_memory - memory);
+    const UINTN tail_pages = slack_pages - head_pages;
+
+    if (head_pages != 0)
     {
-      unlock();
+      gBS->FreePages(memory, head_pages);
     }
 
-    lock_ = obj.lock_;
-    obj.lock_ = nullptr;
+    if (tail_pages != 0)
+    {
+      gBS->FreePages(aligned_memory + EFI_PAGES_TO_SIZE(page_count), tail_pages);
+    }
+
+    return reinterpret_cast<void*>(aligned_memory);
+  }
+
+  void free_pages(void* memory, size_t size) noexcept
+  {
+    gBS->FreePages(reinterpret_cast<EFI_PHYSICAL_ADDRESS>(memory), EFI_SIZE_TO_PAGES(size));
+  }
+
+  // Flushes every TLB entry of the calling processor. Reloading CR3 would keep global entries, toggling CR4.PGE doesn't.
+  static void EFIAPI flush_tlb(void*)
+  {
+    constexpr uint64_t cr4_pge = 1ull << 7;
+    const uint64_t cr4 = __readcr4();
 
-    return *this;
+    if (cr4 & cr4_pge)
+    {
+      __writecr4(cr4 & ~cr4_pge);
+      __writecr4(cr4);
+    }
+    else
+    {
+      __writecr3(__readcr3());
+    }
   }
 
-  void spinlock_guard::lock_spinlock() noexcept
+  uint32_t map_with_large_pages(void* memory, size_t size) noexcept
   {
-    uint32_t wait = 1;
+    constexpr uint64_t present = 1ull << 0;
+    constexpr uint64_t writable = 1ull << 1;
+    constexpr uint64_t user = 1ull << 2;
+    constexpr uint64_t page_size_bit = 1ull << 7;
+    constexpr uint64_t pte_pat = 1ull << 7;
+    constexpr uint64_t pde_pat = 1ull << 12;
+    constexpr uint64_t execute_disable = 1ull << 63;
+    constexpr uint64_t address_mask = 0x000FFFFFFFFFF000ull;
+    // P, RW, US, PWT, PCD, PAT, G and XD have to match for a range to be merged.
+    constexpr uint64_t attribute_mask = execute_disable | (1ull << 8) | pte_pat | 0x1F;
+    constexpr uint64_t cr0_wp = 1ull << 16;
+    constexpr uint64_t cr4_la57 = 1ull << 12;
+
+    // An AP running our code could keep using the 4 KB translations, they are only flushed on idle APs.
+    if ((__readcr4() & cr4_la57) || !is_bootstrap_processor() || !application_processors_idle())
+    {
+      return 0;
+    }
 
-    while (!try_lock())
+    const auto* pml4 = reinterpret_cast<const uint64_t*>(__readcr3() & address_mask);
+    const auto begin = reinterpret_cast<uint64_t>(memory);
+    uint32_t promoted_count = 0;
+
+    for (uint64_t address = begin; address + large_page_size <= begin + size; address += large_page_size)
     {
-      for (uint32_t j = 0; j < wait; j++)
+      const uint64_t pml4e = pml4[(address >> 39) & 0x1FF];
+
+      if (!(pml4e & present))
+      {
+        continue;
+      }
+
+      const uint64_t pdpte = reinterpret_cast<const uint64_t*>(pml4e & address_mask)[(address >> 30) & 0x1FF];
+
+      if (!(pdpte & present) || (pdpte & page_size_bit))
+      {
+        continue;
+      }
+
+      auto* pde = &reinterpret_cast<uint64_t*>(pdpte & address_mask)[(address >> 21) & 0x1FF];
+
+      if (!(*pde & present) || (*pde & page_size_bit))
+      {
+        continue;
+      }
+
+      const auto* pt = reinterpret_cast<const uint64_t*>(*pde & address_mask);
+      const uint64_t first_pte = pt[0];
+      bool mergeable = (first_pte & present) && (first_pte & address_mask) == address;
+
+      for (uint32_t j = 1; j < 512 && mergeable; j++)
       {
-        _mm_pause();
+        mergeable = (pt[j] & address_mask) == address + j * page_size &&
+          (pt[j] & attribute_mask) == (first_pte & attribute_mask);
       }
 
-      if (wait * 2 > max_wait_)
+      if (!mergeable)
       {
-        wait = max_wait_;
+        continue;
       }
-      else
+
+      // Rights of the PDE restrict the PTEs, so the merged entry keeps the stricter of both.
+      uint64_t large_pde = address | page_size_bit | (first_pte & (attribute_mask & ~pte_pat & ~writable & ~user));
+      large_pde |= first_pte & *pde & (writable | user);
+      large_pde |= (first_pte | *pde) & execute_disable;
+      large_pde |= (first_pte & pte_pat) ? pde_pat : 0;
+
+      // Firmware may keep its page tables read-only.
+      const uint64_t rflags = __readeflags();
+      _disable();
+
+      const uint64_t cr0 = __readcr0();
+      __writecr0(cr0 & ~cr0_wp);
+      *pde = large_pde;
+      __writecr0(cr0);
+
+      __writeeflags(rflags);
+
+      promoted_count++;
+    }
+
+    if (promoted_count != 0)
+    {
+      // The page size of a mapping has changed, so every cached translation of it has to go, on every processor.
+      flush_tlb(nullptr);
+
+      if (mp_services_ != nullptr && processor_count_ > 1)
       {
-        wait *= 2;
+        // Blocking, the APs are idle and return right away.
+        mp_services_->StartupAllAPs(mp_services_, flush_tlb, FALSE, nullptr, 0, nullptr, nullptr);
       }
     }
+
+    return promoted_count;
   }
 }
@@ -1,10 +1,15 @@
 #pragma once
 #include "delete_constructors.hpp"
+#include <intrin.h>
 #include <cstdint>
+#include <cstddef>
+#include <type_traits>
 
 namespace hh::common
 {
   constexpr uint32_t page_size = 0x1000;
+  constexpr uint32_t large_page_size = 0x200000;
+  constexpr uint32_t max_processors = 64;
 
   // RAII spinlock.
   class spinlock_guard : non_copyable
@@ -24,4 +29,233 @@ namespace hh::common
     explicit spinlock_guard(volatile long* lock) noexcept;
     ~spinlock_guard() noexcept;
   };
+
+  // Fair FIFO lock. A waiter takes a ticket and spins until it's served, backing off in proportion
+  // to its place in the queue, so the lock is handed over in arrival order.
+  class ticket_lock : non_relocatable
+  {
+  private:
+    volatile long next_ticket_ = 0;
+    volatile long now_serving_ = 0;
+
+  public:
+    void lock() noexcept;
+    void unlock() noexcept;
+  };
+
+  // MCS queue lock. Waiters queue up nodes that live on their own stacks and each one spins on its own
+  // node, the owner hands the lock over with a single store to the next node. Fair like ticket_lock,
+  // but a release doesn't invalidate a line every waiter is reading.
+  class mcs_lock : non_relocatable
+  {
+  public:
+    struct alignas(64) node
+    {
+      node* volatile next;
+      volatile long waiting;
+    };
+
+  private:
+    node* volatile tail_ = nullptr;
+
+  public:
+    void lock(node& self) noexcept;
+    void unlock(node& self) noexcept;
+  };
+
+  // RAII ticket_lock, like spinlock_guard.
+  class ticket_lock_guard : non_copyable
+  {
+  private:
+    ticket_lock* lock_;
+
+  public:
+    ticket_lock_guard(ticket_lock_guard&&) noexcept;
+    ticket_lock_guard& operator=(ticket_lock_guard&&) noexcept;
+    explicit ticket_lock_guard(ticket_lock* lock) noexcept;
+    ~ticket_lock_guard() noexcept;
+  };
+
+  // RAII mcs_lock. The queue node is part of the guard, so unlike the other guards it can't be moved.
+  class mcs_lock_guard : non_relocatable
+  {
+  private:
+    mcs_lock* lock_;
+    mcs_lock::node node_;
+
+  public:
+    explicit mcs_lock_guard(mcs_lock* lock) noexcept;
+    ~mcs_lock_guard() noexcept;
+  };
+
+  // Reader-writer spinlock for data that is read all the time and written rarely. Every processor counts its
+  // readers on a cache line of its own, so readers on different processors never write to the same line. A writer
+  // announces itself and waits until the count of every processor drops to zero, new readers wait for it meanwhile,
+  // so writers don't starve. Takes max_processors cache lines, meant for long lived shared data.
+  class rw_spinlock : non_relocatable
+  {
+  private:
+    struct alignas(64) reader_count
+    {
+      volatile long count;
+    };
+
+    reader_count readers_[max_processors] = {};
+    alignas(64) volatile long writer_ = 0;
+
+  public:
+    // Read sections of the same processor may nest. processor must be the index of the calling processor.
+    void lock_shared(uint32_t processor) noexcept;
+    void unlock_shared(uint32_t processor) noexcept;
+    // Write sections don't nest, and a processor must not take it inside its own read section.
+    void lock() noexcept;
+    void unlock() noexcept;
+  };
+
+  // RAII read section of rw_spinlock. Remembers the processor, so it can't be moved to another one.
+  class read_lock_guard : non_relocatable
+  {
+  private:
+    rw_spinlock* lock_;
+    uint32_t processor_;
+
+  public:
+    explicit read_lock_guard(rw_spinlock* lock) noexcept;
+    ~read_lock_guard() noexcept;
+  };
+
+  // RAII write section of rw_spinlock.
+  class write_lock_guard : non_relocatable
+  {
+  private:
+    rw_spinlock* lock_;
+
+  public:
+    explicit write_lock_guard(rw_spinlock* lock) noexcept;
+    ~write_lock_guard() noexcept;
+  };
+
+  // Sequence lock for small trivially copyable snapshots. Readers don't write to shared memory at all, they copy
+  // the value and copy it again if a writer was in the middle of an update. Reads scale with any number of
+  // processors but a busy writer makes them retry, so keep the value small and the writes rare. Writers are
+  // serialized with a spinlock.
+  template<class T>
+  class seqlock : non_relocatable
+  {
+    static_assert(std::is_trivially_copyable_v<T>, "readers copy the value while it may be written");
+
+  private:
+    // Odd while a write is in progress.
+    volatile long sequence_ = 0;
+    volatile long writer_lock_ = 0;
+    T value_{};
+
+  public:
+    seqlock() noexcept = default;
+    explicit seqlock(const T& value) noexcept : value_{ value } {}
+
+    T load() const noexcept
+    {
+      while (true)
+      {
+        const long sequence = sequence_;
+
+        if ((sequence & 1) == 0)
+        {
+          // x86 doesn't reorder loads with other loads, only the compiler has to be kept from it.
+          _ReadWriteBarrier();
+          const T value = value_;
+          _ReadWriteBarrier();
+
+          if (sequence_ == sequence)
+          {
+            return value;
+          }
+        }
+
+        _mm_pause();
+      }
+    }
+
+    // Calls update with a reference to the value, readers retry until it returns.
+    template<class Update>
+    void modify(Update&& update) noexcept
+    {
+      spinlock_guard _{ &writer_lock_ };
+
+      // Nor does it reorder stores with other stores.
+      sequence_ = sequence_ + 1;
+      _ReadWriteBarrier();
+      update(value_);
+      _ReadWriteBarrier();
+      sequence_ = sequence_ + 1;
+    }
+
+    void store(const T& value) noexcept
+    {
+      modify([&value](T& current) { current = value; });
+    }
+  };
+
+  // Lock policies of the allocators, the lock member and the guard that takes it:
+  //
+  //   typename Locking::lock_type lock_{};
+  //   typename Locking::guard _{ &lock_ };
+  struct spin_locking
+  {
+    using lock_type = volatile long;
+    using guard = spinlock_guard;
+  };
+
+  struct ticket_locking
+  {
+    using lock_type = ticket_lock;
+    using guard = ticket_lock_guard;
+  };
+
+  struct mcs_locking
+  {
+    using lock_type = mcs_lock;
+    using guard = mcs_lock_guard;
+  };
+
+  // Locates EFI_MP_SERVICES_PROTOCOL and writes the processor number of every CPU into IA32_TSC_AUX,
+  // so current_processor() costs a single rdtscp. Must be called on the BSP while boot services are available.
+  void initialize_processors() noexcept;
+  // Number of processors that have their own slot in per-processor tables.
+  uint32_t processor_count() noexcept;
+  // Index of the calling processor in [0, processor_count()). Can be called from APs.
+  uint32_t current_processor() noexcept;
+  // TSC of the calling processor, its index is stored to processor. Costs one rdtscp once initialize_processors() has run.
+  uint64_t processor_timestamp(uint32_t& processor) noexcept;
+  // Boot services may only be called on the BSP, APs must check this before touching gBS.
+  bool is_bootstrap_processor() noexcept;
+
+  using processor_procedure = void(*)(void* argument);
+  // Starts procedure on every enabled AP and returns without waiting for it. Waits for the procedure started
+  // before to return first. Returns false if there are no APs or they are parked. The procedure must not use
+  // boot services. BSP only, boot services must be available.
+  bool start_on_application_processors(processor_procedure procedure, void* argument) noexcept;
+  // Waits until the APs finish the procedure started last. Returns at once while they are parked. BSP only.
+  void wait_for_application_processors() noexcept;
+  // True if no procedure runs on the APs, parked or not. BSP only, boot services must be available.
+  bool application_processors_idle() noexcept;
+  // Starts a procedure that keeps the APs until its owner tells it to return, like the task_scheduler workers.
+  // start_on_application_processors() fails until unpark_application_processors(). BSP only, boot services
+  // must be available.
+  bool park_application_processors(processor_procedure procedure, void* argument) noexcept;
+  // Waits until the parked procedure, told to return by its owner, has returned. BSP only.
+  void unpark_application_processors() noexcept;
+
+  // Allocates runtime data pages at the requested power of two alignment. Bigger alignments are
+  // over-allocated and the unaligned head and tail are given back to firmware.
+  void* allocate_pages(size_t size, size_t alignment = page_size) noexcept;
+  void free_pages(void* memory, size_t size) noexcept;
+  // Replaces 4 KB mappings of an identity mapped, 2 MB aligned range with 2 MB pages where all
+  // 512 PTEs map contiguous memory with the same attributes, and flushes the TLBs of all processors.
+  // Does nothing on an AP or while the APs run a procedure, they couldn't be flushed. The page table
+  // that mapped a promoted range stays allocated, firmware took it from its own pool and it can't be
+  // given back with FreePages: 4 KB per 2 MB page. Returns the number of promoted pages.
+  // BSP only, boot services must be available.
+  uint32_t map_with_large_pages(void* memory, size_t size) noexcept;
 }
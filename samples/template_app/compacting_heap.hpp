@@ -0,0 +1,299 @@
+#pragma once
+#include "delete_constructors.hpp"
+#include "common.hpp"
+#include "globals.hpp"
+#include "efi_stub.hpp"
+#include "tlsf.h"
+#include <cstdint>
+#include <new>
+
+namespace hh
+{
+  // Heap of movable objects for runtime images that stay up for days. Objects are referenced through handles,
+  // so compact() can slide live blocks down into the free blocks before them. Free space collects at the end of
+  // the pool and big requests succeed again without growing it. An allocation that fails compacts the whole
+  // pool and retries once.
+  //
+  // The address returned by get() is valid until the next compact() or allocate(), on any processor: an allocation
+  // that misses compacts the pool. pin() keeps a block in place until the matching unpin(), for DMA buffers and
+  // for code that holds the address while other processors may allocate. A handle that isn't live, freed twice,
+  // stale or out of range, stops the machine with a bug check instead of corrupting the pool.
+  // Objects are aligned to tlsf_align_size(). The pool and the handle table are taken from firmware once,
+  // the heap keeps working after ExitBootServices.
+  class compacting_heap : non_relocatable
+  {
+  public:
+    using handle = uint32_t;
+    static constexpr handle null_handle = 0;
+
+  private:
+    // Blocks moved per pool walk, the candidates are kept on the stack.
+    static constexpr uint32_t moves_per_walk_ = 256;
+
+    // Stored in front of every object, leads compaction from a block back to its handle.
+    struct block_prefix
+    {
+      handle owner;
+      uint32_t size;
+    };
+
+    struct handle_entry
+    {
+      block_prefix* block;
+      uint32_t pin_count;
+      // Next free entry, null_handle ends the list.
+      handle next_free;
+    };
+
+    struct walk_state
+    {
+      const compacting_heap* heap;
+      block_prefix* blocks[moves_per_walk_];
+      uint32_t count;
+      // The previous block is free or will slide before this one.
+      bool gap_before;
+    };
+
+    tlsf_t service_data_;
+    void* pool_memory_;
+    size_t pool_size_;
+    handle_entry* handles_;
+    size_t handle_table_size_;
+    uint32_t max_objects_;
+    handle free_handle_;
+    volatile long spinlock_;
+
+  private:
+    handle_entry& entry_of(handle object) const noexcept
+    {
+      return handles_[object - 1];
+    }
+
+    // Entry of a handle the caller passed in. Must be called under the lock.
+    handle_entry& live_entry_of(handle object) const noexcept
+    {
+      // null_handle wraps around to the biggest index.
+      if (object - 1 >= max_objects_ || handles_[object - 1].block == nullptr) [[unlikely]]
+      {
+        bug_check(bug_check_codes::invalid_cruntime_parameter, object);
+      }
+
+      return handles_[object - 1];
+    }
+
+    // Collects the blocks that can slide, in address order: unpinned blocks after a free block or after
+    // another block that slides.
+    static void collect_block(void* ptr, size_t, int used, void* user) noexcept
+    {
+      auto& walk = *static_cast<walk_state*>(user);
+      auto* block = static_cast<block_prefix*>(ptr);
+
+      if (!used)
+      {
+        walk.gap_before = true;
+        return;
+      }
+
+      walk.gap_before = walk.gap_before && walk.count < moves_per_walk_ && walk.heap->entry_of(block->owner).pin_count == 0;
+
+      if (walk.gap_before)
+      {
+        walk.blocks[walk.count++] = block;
+      }
+    }
+
+    // Must be called under the lock. Returns the number of blocks moved.
+    uint32_t compact_locked(uint32_t max_moves) noexcept
+    {
+      uint32_t moved_count = 0;
+
+      while (moved_count < max_moves)
+      {
+        walk_state walk{ this };
+
+        tlsf_walk_pool(tlsf_get_pool(service_data_), collect_block, &walk);
+
+        // Sliding a block leaves the gap right before the next one, so a run of adjacent blocks moves in one walk.
+        for (uint32_t j = 0; j < walk.count && moved_count < max_moves; j++)
+        {
+          auto* block = static_cast<block_prefix*>(tlsf_slide(service_data_, walk.blocks[j]));
+
+          entry_of(block->owner).block = block;
+          moved_count++;
+        }
+
+        if (walk.count < moves_per_walk_)
+        {
+          break;
+        }
+      }
+
+      return moved_count;
+    }
+
+  public:
+    // Needs boot services.
+    compacting_heap(size_t pool_size, uint32_t max_objects)
+      : service_data_{}, pool_memory_{}, pool_size_{}, handles_{}, handle_table_size_{}, max_objects_{ max_objects }, free_handle_{},
+      spinlock_{}
+    {
+      pool_size_ = (pool_size + common::page_size - 1) & ~static_cast<size_t>(common::page_size - 1);
+      handle_table_size_ = static_cast<size_t>(max_objects) * sizeof(handle_entry);
+      pool_memory_ = common::allocate_pages(pool_size_);
+      handles_ = static_cast<handle_entry*>(common::allocate_pages(handle_table_size_));
+
+      if (pool_memory_ == nullptr || handles_ == nullptr)
+      {
+        if (pool_memory_ != nullptr)
+        {
+          common::free_pages(pool_memory_, pool_size_);
+        }
+
+        if (handles_ != nullptr)
+        {
+          common::free_pages(handles_, handle_table_size_);
+        }
+
+        throw std::bad_alloc{};
+      }
+
+      service_data_ = tlsf_create_with_pool(pool_memory_, pool_size_);
+
+      for (uint32_t j = 0; j < max_objects; j++)
+      {
+        handles_[j] = { nullptr, 0, j + 1 < max_objects ? j + 2 : null_handle };
+      }
+
+      free_handle_ = max_objects != 0 ? 1 : null_handle;
+    }
+
+    // Returns null_handle when the pool is full even after compaction or when the handle table is exhausted.
+    handle allocate(uint32_t size) noexcept
+    {
+      common::spinlock_guard _{ &spinlock_ };
+
+      if (free_handle_ == null_handle)
+      {
+        return null_handle;
+      }
+
+      auto* block = static_cast<block_prefix*>(tlsf_malloc(service_data_, sizeof(block_prefix) + size));
+
+      if (block == nullptr && compact_locked(UINT32_MAX) != 0)
+      {
+        block = static_cast<block_prefix*>(tlsf_malloc(service_data_, sizeof(block_prefix) + size));
+      }
+
+      if (block == nullptr)
+      {
+        return null_handle;
+      }
+
+      const handle object = free_handle_;
+      auto& entry = entry_of(object);
+
+      free_handle_ = entry.next_free;
+      entry = { block, 0, null_handle };
+      *block = { object, size };
+
+      return object;
+    }
+
+    // Pinned objects may be freed too, the pins are dropped.
+    void deallocate(handle object) noexcept
+    {
+      if (object == null_handle)
+      {
+        return;
+      }
+
+      common::spinlock_guard _{ &spinlock_ };
+      auto& entry = live_entry_of(object);
+
+      tlsf_free(service_data_, entry.block);
+      entry = { nullptr, 0, free_handle_ };
+      free_handle_ = object;
+    }
+
+    // Current address of the object. Unless the object is pinned, an allocate() or compact() on any processor
+    // may move it as soon as this returns.
+    void* get(handle object) noexcept
+    {
+      common::spinlock_guard _{ &spinlock_ };
+      return live_entry_of(object).block + 1;
+    }
+
+    uint32_t size(handle object) noexcept
+    {
+      common::spinlock_guard _{ &spinlock_ };
+      return live_entry_of(object).block->size;
+    }
+
+    // Keeps the object in place until the matching unpin(). Returns its address.
+    void* pin(handle object) noexcept
+    {
+      common::spinlock_guard _{ &spinlock_ };
+      auto& entry = live_entry_of(object);
+
+      entry.pin_count++;
+      return entry.block + 1;
+    }
+
+    // An unpin() without a pin() is a bug check, the count would wrap and pin the object for good.
+    void unpin(handle object) noexcept
+    {
+      common::spinlock_guard _{ &spinlock_ };
+      auto& entry = live_entry_of(object);
+
+      if (entry.pin_count == 0) [[unlikely]]
+      {
+        bug_check(bug_check_codes::invalid_cruntime_parameter, object);
+        return;
+      }
+
+      entry.pin_count--;
+    }
+
+    // Slides up to max_moves objects towards the start of the pool, meant to be called at idle points.
+    // Returns the number of objects moved, 0 once the pool is compact.
+    uint32_t compact(uint32_t max_moves) noexcept
+    {
+      common::spinlock_guard _{ &spinlock_ };
+      return compact_locked(max_moves);
+    }
+
+    size_t largest_free_block() noexcept
+    {
+      size_t largest_size = 0;
+      common::spinlock_guard _{ &spinlock_ };
+
+      tlsf_walk_pool(tlsf_get_pool(service_data_), [](void*, size_t size, int used, void* user)
+        {
+          auto& largest_size = *static_cast<size_t*>(user);
+
+          if (!used && size > largest_size)
+          {
+            largest_size = size;
+          }
+        }, &largest_size);
+
+      return largest_size;
+    }
+
+    ~compacting_heap() noexcept
+    {
+      if (globals::boot_state)
+      {
+        if (pool_memory_ != nullptr)
+        {
+          common::free_pages(pool_memory_, pool_size_);
+        }
+
+        if (handles_ != nullptr)
+        {
+          common::free_pages(handles_, handle_table_size_);
+        }
+      }
+    }
+  };
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "alloc_profile.hpp"
+#include "alloc_trace.hpp"
+#include "lock_profile.hpp"
+#include "mem_tags.hpp"
+
+// Compile-time configuration of the image. Policies that are switched off compile to nothing.
+namespace hh::config
+{
+  // HH_ALLOCATION_TRACE=1 records every heap operation into globals::allocation_trace.
+#if HH_ALLOCATION_TRACE
+  using allocation_trace = ring_allocation_trace;
+#else
+  using allocation_trace = no_allocation_trace;
+#endif
+
+  // HH_ALLOCATION_TAGS=1 charges every heap block to the tag of the mem_tag_scope it was allocated in.
+#if HH_ALLOCATION_TAGS
+  using allocation_tags = counted_allocation_tags;
+#else
+  using allocation_tags = no_allocation_tags;
+#endif
+
+  // HH_ALLOCATION_PROFILE=1 samples the call stacks of heap allocations into globals::allocation_profile.
+#if HH_ALLOCATION_PROFILE
+  using allocation_profile = sampled_allocation_profile;
+#else
+  using allocation_profile = no_allocation_profile;
+#endif
+
+  // HH_LOCK_PROFILE=1 counts the acquisitions, spins and wait and hold cycles of every spinlock_guard lock
+  // into globals::lock_profile.
+#if HH_LOCK_PROFILE
+  using lock_profile = counted_lock_profile;
+#else
+  using lock_profile = no_lock_profile;
+#endif
+}
+
+namespace hh
+{
+  // Charges the allocations of the calling processor to a tag, see mem_tags.hpp.
+  using mem_tag_scope = basic_mem_tag_scope<config::allocation_tags>;
+}
@@ -4,7 +4,9 @@
 #include "efi_stub.hpp"
 #include "globals.hpp"
 #include "memory_manager.hpp"
+#include "global_heap.hpp"
 #include <stdexcept>
+#include <memory_resource>
 
 using _PVFV = void(__cdecl*)(void); // PVFV = Pointer to Void Func(Void)
 using _PIFV = int(__cdecl*)(void); // PIFV = Pointer to Int Func(Void)
@@ -163,245 +165,151 @@ extern "C" void __cdecl __ehvec_dtor(void* arr_end, size_t element_size,
   destroy_array_in_reversed_order(arr_end, element_size, count, destructor);
 }
 
-#define allocate_pool() if(hh::globals::boot_state) \
-{ \
-  if(EFI_ERROR(gBS->AllocatePool(EfiRuntimeServicesData, size, &pointer))) \
-  { \
-    hh::bug_check(hh::bug_check_codes::install_more_memory); \
-  } \
-} \
-else \
-{ \
-  hh::bug_check(hh::bug_check_codes::boot_services_unavailable); \
-} \
-
-#define deallocate_pool() if(hh::globals::boot_state) \
-{ \
-  gBS->FreePool(pointer); \
-} \
-else \
-{ \
-  hh::bug_check(hh::bug_check_codes::boot_services_unavailable); \
-} \
-
-void* __cdecl operator new(size_t size)
+// Arena override installed on this processor or no global heap yet, kept out of line so the operators
+// only inline the heap_type fast path.
+static __declspec(noinline) void* allocate_slow(size_t size, size_t align) noexcept
 {
-  void* pointer;
-
-  if (hh::globals::mem_manager != nullptr)
+  if (auto* heap = hh::current_heap(); heap != nullptr)
   {
-    pointer = hh::globals::mem_manager->allocate(size);
-  }
-  else
-  {
-    allocate_pool();
+    return align == 0 ? heap->allocate(size) : heap->allocate_align(size, std::align_val_t{ align });
   }
 
-  if(pointer == nullptr)
+  if (!hh::globals::boot_state)
   {
-    throw std::bad_alloc{};
+    hh::bug_check(hh::bug_check_codes::boot_services_unavailable);
   }
 
-  return pointer;
-}
-
-void* __cdecl operator new(size_t size, std::align_val_t align)
-{
-  void* pointer;
+  void* pointer = nullptr;
 
-  if (hh::globals::mem_manager != nullptr)
-  {
-    pointer = hh::globals::mem_manager->allocate_align(size, align);
-  }
-  else
+  if (EFI_ERROR(gBS->AllocatePool(EfiRuntimeServicesData, size, &pointer)))
   {
-    allocate_pool();
-  }
-
-  if (pointer == nullptr)
-  {
-    throw std::bad_alloc{};
+    hh::bug_check(hh::bug_check_codes::install_more_memory);
   }
 
   return pointer;
 }
 
-void* __cdecl operator new[](size_t size)
+static __declspec(noinline) void deallocate_slow(void* pointer, size_t size) noexcept
 {
-  void* pointer;
-
-  if (hh::globals::mem_manager != nullptr)
-  {
-    pointer = hh::globals::mem_manager->allocate(size);
-  }
-  else
+  if (auto* heap = hh::current_heap(); heap != nullptr)
   {
-    allocate_pool();
+    heap->deallocate_sized(pointer, size);
+    return;
   }
 
-  if (pointer == nullptr)
+  if (!hh::globals::boot_state)
   {
-    throw std::bad_alloc{};
+    hh::bug_check(hh::bug_check_codes::boot_services_unavailable);
   }
 
-  return pointer;
+  gBS->FreePool(pointer);
 }
 
-void* __cdecl operator new[](size_t size, std::align_val_t align)
+// Shared by all new overloads, align is 0 for the default alignment.
+static __forceinline void* allocate(size_t size, size_t align)
 {
   void* pointer;
+  auto* heap = hh::global_heap::get();
 
-  if (hh::globals::mem_manager != nullptr)
+  if (heap != nullptr && hh::globals::scoped_heaps[hh::common::current_processor()] == nullptr) [[likely]]
   {
-    pointer = hh::globals::mem_manager->allocate_align(size, align);
+    // Qualified calls bypass the vtable.
+    pointer = align == 0 ? heap->hh::config::heap_type::allocate(size)
+      : heap->hh::config::heap_type::allocate_align(size, std::align_val_t{ align });
   }
   else
   {
-    allocate_pool();
+    pointer = allocate_slow(size, align);
   }
 
+  // The heap has run its reclaimers already. The tags tell who filled it, if they are compiled in.
   if (pointer == nullptr)
   {
+    hh::config::allocation_tags::dump();
     throw std::bad_alloc{};
   }
 
   return pointer;
 }
 
-void __cdecl operator delete(void* pointer)
+// Shared by all delete overloads, size is 0 for the unsized ones.
+static __forceinline void deallocate(void* pointer, size_t size) noexcept
 {
   if (pointer == nullptr)
   {
     return;
   }
 
-  if (hh::globals::mem_manager != nullptr)
+  auto* heap = hh::global_heap::get();
+
+  if (heap != nullptr && hh::globals::scoped_heaps[hh::common::current_processor()] == nullptr) [[likely]]
   {
-    hh::globals::mem_manager->deallocate(pointer);
+    heap->hh::config::heap_type::deallocate_sized(pointer, size);
   }
   else
   {
-    deallocate_pool();
+    deallocate_slow(pointer, size);
   }
 }
 
-void __cdecl operator delete(void* pointer, [[maybe_unused]] std::align_val_t align)
+void* __cdecl operator new(size_t size)
 {
-  if (pointer == nullptr)
-  {
-    return;
-  }
-
-  if (hh::globals::mem_manager != nullptr)
-  {
-    hh::globals::mem_manager->deallocate(pointer);
-  }
-  else
-  {
-    deallocate_pool();
-  }
+  return allocate(size, 0);
 }
 
-void __cdecl operator delete(void* pointer, [[maybe_unused]] size_t size)
+void* __cdecl operator new(size_t size, std::align_val_t align)
 {
-  if (pointer == nullptr)
-  {
-    return;
-  }
-
-  if (hh::globals::mem_manager != nullptr)
-  {
-    hh::globals::mem_manager->deallocate(pointer);
-  }
-  else
-  {
-    deallocate_pool();
-  }
+  return allocate(size, static_cast<size_t>(align));
 }
 
-void __cdecl operator delete(void* pointer, [[maybe_unused]] size_t size, [[maybe_unused]] std::align_val_t align)
+void* __cdecl operator new[](size_t size)
 {
-  if (pointer == nullptr)
-  {
-    return;
-  }
+  return allocate(size, 0);
+}
 
-  if (hh::globals::mem_manager != nullptr)
-  {
-    hh::globals::mem_manager->deallocate(pointer);
-  }
-  else
-  {
-    deallocate_pool();
-  }
+void* __cdecl operator new[](size_t size, std::align_val_t align)
+{
+  return allocate(size, static_cast<size_t>(align));
 }
 
-void __cdecl operator delete[](void* pointer)
+void __cdecl operator delete(void* pointer)
 {
-  if (pointer == nullptr)
-  {
-    return;
-  }
+  deallocate(pointer, 0);
+}
 
-  if (hh::globals::mem_manager != nullptr)
-  {
-    hh::globals::mem_manager->deallocate(pointer);
-  }
-  else
-  {
-    deallocate_pool();
-  }
+void __cdecl operator delete(void* pointer, [[maybe_unused]] std::align_val_t align)
+{
+  deallocate(pointer, 0);
 }
 
-void __cdecl operator delete[](void* pointer, [[maybe_unused]] std::align_val_t align)
+void __cdecl operator delete(void* pointer, size_t size)
 {
-  if (pointer == nullptr)
-  {
-    return;
-  }
+  deallocate(pointer, size);
+}
 
-  if (hh::globals::mem_manager != nullptr)
-  {
-    hh::globals::mem_manager->deallocate(pointer);
-  }
-  else
-  {
-    deallocate_pool();
-  }
+void __cdecl operator delete(void* pointer, size_t size, [[maybe_unused]] std::align_val_t align)
+{
+  deallocate(pointer, size);
 }
 
-void __cdecl operator delete[](void* pointer, [[maybe_unused]] size_t size)
+void __cdecl operator delete[](void* pointer)
 {
-  if (pointer == nullptr)
-  {
-    return;
-  }
+  deallocate(pointer, 0);
+}
 
-  if (hh::globals::mem_manager != nullptr)
-  {
-    hh::globals::mem_manager->deallocate(pointer);
-  }
-  else
-  {
-    deallocate_pool();
-  }
+void __cdecl operator delete[](void* pointer, [[maybe_unused]] std::align_val_t align)
+{
+  deallocate(pointer, 0);
 }
 
-void __cdecl operator delete[](void* pointer, [[maybe_unused]] size_t size, [[maybe_unused]] std::align_val_t align)
+void __cdecl operator delete[](void* pointer, size_t size)
 {
-  if(pointer == nullptr)
-  {
-    return;
-  }
+  deallocate(pointer, size);
+}
 
-  if (hh::globals::mem_manager != nullptr)
-  {
-    hh::globals::mem_manager->deallocate(pointer);
-  }
-  else
-  {
-    deallocate_pool();
-  }
+void __cdecl operator delete[](void* pointer, size_t size, [[maybe_unused]] std::align_val_t align)
+{
+  deallocate(pointer, size);
 }
 
 [[noreturn]]
@@ -550,3 +458,102 @@ _Check_return_ double __cdecl ceil(_In_ double _X)
   return static_cast<double>(_X > static_cast<double>(v) ? v + 1 : v);
 }
 #endif
+
+// For <memory_resource> support:
+namespace
+{
+  // std::pmr::new_delete_resource(), blocks go through the global operator new and delete.
+  class new_delete_resource final : public std::pmr::memory_resource
+  {
+  private:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+      return alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__ ? ::operator new(bytes, std::align_val_t{ alignment }) : ::operator new(bytes);
+    }
+
+    void do_deallocate(void* ptr, size_t bytes, size_t alignment) override
+    {
+      if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+      {
+        ::operator delete(ptr, bytes, std::align_val_t{ alignment });
+      }
+      else
+      {
+        ::operator delete(ptr, bytes);
+      }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+      return this == &other;
+    }
+  };
+
+  // std::pmr::null_memory_resource(), every allocation fails.
+  class null_resource final : public std::pmr::memory_resource
+  {
+  private:
+    void* do_allocate(size_t, size_t) override
+    {
+      throw std::bad_alloc{};
+    }
+
+    void do_deallocate(void*, size_t, size_t) override
+    {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+      return this == &other;
+    }
+  };
+
+  new_delete_resource new_delete_instance{};
+  null_resource null_instance{};
+  std::pmr::memory_resource* volatile default_resource = &new_delete_instance;
+
+  std::pmr::memory_resource* exchange_default_resource(std::pmr::memory_resource* resource) noexcept
+  {
+    return static_cast<std::pmr::memory_resource*>(_InterlockedExchangePointer(
+      reinterpret_cast<void* volatile*>(&default_resource), resource != nullptr ? resource : &new_delete_instance));
+  }
+}
+
+// The unaligned flavors serve code compiled without aligned new, both share one default here.
+namespace std::pmr
+{
+  extern "C" memory_resource* __cdecl _Aligned_get_default_resource() noexcept
+  {
+    return default_resource;
+  }
+
+  extern "C" memory_resource* __cdecl _Unaligned_get_default_resource() noexcept
+  {
+    return default_resource;
+  }
+
+  extern "C" memory_resource* __cdecl _Aligned_set_default_resource(memory_resource* resource) noexcept
+  {
+    return exchange_default_resource(resource);
+  }
+
+  extern "C" memory_resource* __cdecl _Unaligned_set_default_resource(memory_resource* resource) noexcept
+  {
+    return exchange_default_resource(resource);
+  }
+
+  extern "C" memory_resource* __cdecl _Aligned_new_delete_resource() noexcept
+  {
+    return &new_delete_instance;
+  }
+
+  extern "C" memory_resource* __cdecl _Unaligned_new_delete_resource() noexcept
+  {
+    return &new_delete_instance;
+  }
+
+  extern "C" memory_resource* __cdecl null_memory_resource() noexcept
+  {
+    return &null_instance;
+  }
+}
@@ -8,8 +8,48 @@
     }
 extern EFI_GUID gEfiSampleDriverProtocolGuid;
 
+// Revision 1.0 adds heap telemetry after SampleValue.
+// Revision 1.1 appends the reclaim counters to EFI_SAMPLE_HEAP_STATISTICS.
+#define EFI_SAMPLE_DRIVER_PROTOCOL_REVISION 0x00010001
+
+#define EFI_SAMPLE_HEAP_HISTOGRAM_BUCKETS 16
+
+// Snapshot of the image heap. Bucket 0 of the histogram counts requests up to 16 bytes,
+// bucket N counts requests in (8 << N, 16 << N], the last bucket also takes everything bigger.
+typedef struct _EFI_SAMPLE_HEAP_STATISTICS
+{
+    UINT64 LiveBytes;
+    UINT64 PeakBytes;
+    UINT64 AllocationCount;
+    UINT64 DeallocationCount;
+    UINT64 FailedAllocationCount;
+    UINT64 SizeHistogram[EFI_SAMPLE_HEAP_HISTOGRAM_BUCKETS];
+    // Pool walk results.
+    UINT64 PoolBytes;
+    UINT64 UsedBlockCount;
+    UINT64 FreeBlockCount;
+    UINT64 FreeBytes;
+    UINT64 LargestFreeBlock;
+    // 100 - LargestFreeBlock * 100 / FreeBytes, 0 means all free memory is one block.
+    UINT64 FragmentationPercent;
+    // Failed allocations that ran the reclaim callbacks, and those of them that succeeded on a retry.
+    UINT64 ReclaimCount;
+    UINT64 ReclaimedAllocationCount;
+} EFI_SAMPLE_HEAP_STATISTICS;
+
+typedef struct _EFI_SAMPLE_DRIVER_PROTOCOL EFI_SAMPLE_DRIVER_PROTOCOL;
+
+typedef EFI_STATUS(EFIAPI* EFI_SAMPLE_GET_HEAP_STATISTICS)(
+    IN EFI_SAMPLE_DRIVER_PROTOCOL* This,
+    OUT EFI_SAMPLE_HEAP_STATISTICS* Statistics
+    );
+
 // Custom Protocol Definition
-typedef struct _EFI_SAMPLE_DRIVER_PROTOCOL
+struct _EFI_SAMPLE_DRIVER_PROTOCOL
 {
     EFI_HANDLE SampleValue;
-} EFI_SAMPLE_DRIVER_PROTOCOL, *PEFI_SAMPLE_DRIVER_PROTOCOL;
+    UINT64 Revision;
+    EFI_SAMPLE_GET_HEAP_STATISTICS GetHeapStatistics;
+};
+
+typedef EFI_SAMPLE_DRIVER_PROTOCOL* PEFI_SAMPLE_DRIVER_PROTOCOL;
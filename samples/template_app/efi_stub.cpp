@@ -1,4 +1,5 @@
 #include "efi_stub.hpp"
+#include "config.hpp"
 #include <cstdint>
 #include <intrin.h>
 
@@ -7,6 +8,12 @@ namespace hh
   void bug_check(const bug_check_codes code, const uint64_t arg0, const uint64_t arg1,
     const uint64_t arg2, const uint64_t arg3) noexcept
   {
+    // Tells who filled the heap, if tags are compiled in.
+    if (code == bug_check_codes::allocator_out_of_memory)
+    {
+      config::allocation_tags::dump();
+    }
+
     // add your own panic handler here
     __halt();
   }
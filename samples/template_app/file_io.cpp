@@ -0,0 +1,59 @@
+#include "file_io.hpp"
+
+extern "C"
+{
+#include <Protocol/LoadedImage.h>
+}
+
+namespace hh::common
+{
+  EFI_STATUS create_image_volume_file(EFI_HANDLE image_handle, const CHAR16* file_name, EFI_FILE_PROTOCOL** file) noexcept
+  {
+    EFI_LOADED_IMAGE_PROTOCOL* loaded_image = nullptr;
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* file_system = nullptr;
+    EFI_FILE_PROTOCOL* root = nullptr;
+    auto* name = const_cast<CHAR16*>(file_name);
+
+    auto status = gBS->HandleProtocol(image_handle, &gEfiLoadedImageProtocolGuid, reinterpret_cast<void**>(&loaded_image));
+
+    if (EFI_ERROR(status))
+    {
+      return status;
+    }
+
+    status = gBS->HandleProtocol(loaded_image->DeviceHandle, &gEfiSimpleFileSystemProtocolGuid, reinterpret_cast<void**>(&file_system));
+
+    if (EFI_ERROR(status))
+    {
+      return status;
+    }
+
+    status = file_system->OpenVolume(file_system, &root);
+
+    if (EFI_ERROR(status))
+    {
+      return status;
+    }
+
+    // Delete closes the handle, the file is created again below.
+    if (!EFI_ERROR(root->Open(root, file, name, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0)))
+    {
+      (*file)->Delete(*file);
+    }
+
+    status = root->Open(root, file, name, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+
+    // The file handle stays valid after the root is closed.
+    root->Close(root);
+
+    return status;
+  }
+
+  EFI_STATUS write_file(EFI_FILE_PROTOCOL* file, const void* buffer, size_t size) noexcept
+  {
+    UINTN written_size = size;
+    const auto status = file->Write(file, &written_size, const_cast<void*>(buffer));
+
+    return !EFI_ERROR(status) && written_size != size ? EFI_DEVICE_ERROR : status;
+  }
+}
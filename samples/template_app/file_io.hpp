@@ -0,0 +1,17 @@
+#pragma once
+#include "uefi.hpp"
+#include <cstddef>
+
+extern "C"
+{
+#include <Protocol/SimpleFileSystem.h>
+}
+
+namespace hh::common
+{
+  // Creates file_name on the volume the image was loaded from, an existing file is replaced.
+  // BSP only, boot services must be available.
+  EFI_STATUS create_image_volume_file(EFI_HANDLE image_handle, const CHAR16* file_name, EFI_FILE_PROTOCOL** file) noexcept;
+  // Fails with EFI_DEVICE_ERROR if the file system writes less than size bytes.
+  EFI_STATUS write_file(EFI_FILE_PROTOCOL* file, const void* buffer, size_t size) noexcept;
+}
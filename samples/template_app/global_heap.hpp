@@ -0,0 +1,53 @@
+#pragma once
+#include "memory_manager.hpp"
+#include "globals.hpp"
+#include <cstdint>
+#include <memory>
+#include <new>
+
+namespace hh
+{
+  namespace config
+  {
+    // Allocator behind the global new/delete. The operators call it without going through memory_manager,
+    // so its fast path is inlined into every new and delete of the image. HH_PER_CPU_HEAP=1 selects the
+    // per-processor heaps, they don't contend but can't grow, see per_cpu_tlsf_allocator.
+#if HH_PER_CPU_HEAP
+    using heap_type = per_cpu_tlsf_allocator<>;
+#else
+    using heap_type = tlsf_allocator<>;
+#endif
+  }
+
+  // Owner of the heap that serves the global new/delete. The heap is constructed in static storage,
+  // creating it doesn't depend on operator new. globals::mem_manager points to it while it exists.
+  class global_heap abstract
+  {
+  private:
+    alignas(config::heap_type) static inline uint8_t storage_[sizeof(config::heap_type)] = {};
+    static inline config::heap_type* heap_ = {};
+
+  public:
+    static config::heap_type& create()
+    {
+      heap_ = new (storage_) config::heap_type{};
+      globals::mem_manager = heap_;
+
+      return *heap_;
+    }
+
+    // Blocks freed after this go to the AllocatePool fallback, so nothing allocated from the heap may outlive it.
+    static void destroy() noexcept
+    {
+      globals::mem_manager = nullptr;
+      std::destroy_at(heap_);
+      heap_ = nullptr;
+    }
+
+    // Null before create() and after destroy().
+    static config::heap_type* get() noexcept
+    {
+      return heap_;
+    }
+  };
+}
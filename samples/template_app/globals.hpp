@@ -1,13 +1,34 @@
 #pragma once
+#include "common.hpp"
 
 namespace hh
 {
   class memory_manager;
+  class trace_recorder;
+  class tag_accounting;
+  class allocation_profiler;
+  class lock_profiler;
+  class task_scheduler;
 
   namespace globals
   {
     inline bool boot_state = true;
     inline memory_manager* mem_manager = {};
+    // Per-processor override of mem_manager installed by scoped_arena. An arena on one processor
+    // doesn't take new/delete of the others off their fast path.
+    inline memory_manager* scoped_heaps[common::max_processors] = {};
+    // Set while allocation tracing is compiled in and running, see alloc_trace.hpp.
+    inline trace_recorder* allocation_trace = {};
+    // Set while allocation tags are compiled in and counted, see mem_tags.hpp.
+    inline tag_accounting* allocation_tags = {};
+    // Tag index the allocations of each processor are charged to, set by mem_tag_scope.
+    inline uint32_t current_tag_indices[common::max_processors] = {};
+    // Set while the allocation profiler is compiled in and sampling, see alloc_profile.hpp.
+    inline allocation_profiler* allocation_profile = {};
+    // Set while the lock profiler is compiled in and counting, see lock_profile.hpp.
+    inline lock_profiler* lock_profile = {};
+    // Runs tasks on the APs once main has started it, see task_scheduler.hpp.
+    inline task_scheduler* scheduler = {};
     extern "C" unsigned char __ImageBase;
   }
 }
@@ -0,0 +1,177 @@
+#include "lock_profile.hpp"
+#include "uefi.hpp"
+#include <intrin.h>
+#include <cstring>
+
+namespace hh
+{
+  lock_profiler::lock_profiler() noexcept
+    : tables_{}, table_count_{ common::processor_count() }, names_{}, name_count_{}
+  {
+    tables_ = static_cast<processor_table*>(common::allocate_pages(sizeof(processor_table) * table_count_));
+
+    if (tables_ == nullptr)
+    {
+      table_count_ = 0;
+      return;
+    }
+
+    // Every slot starts free.
+    memset(tables_, 0, sizeof(processor_table) * table_count_);
+  }
+
+  lock_profiler::~lock_profiler() noexcept
+  {
+    if (tables_ != nullptr)
+    {
+      common::free_pages(tables_, sizeof(processor_table) * table_count_);
+    }
+  }
+
+  lock_profiler::lock_entry& lock_profiler::entry_of(processor_table& table, const volatile void* lock) noexcept
+  {
+    const auto hash = (reinterpret_cast<uint64_t>(lock) >> 3) * 0x9E3779B97F4A7C15;
+
+    for (uint32_t j = 0; j < max_locks; j++)
+    {
+      auto& entry = table.locks[(hash + j) & (max_locks - 1)];
+
+      if (entry.lock == lock)
+      {
+        return entry;
+      }
+
+      if (entry.lock == nullptr)
+      {
+        entry.lock = lock;
+        return entry;
+      }
+    }
+
+    return table.overflow;
+  }
+
+  const char* lock_profiler::name_of(const volatile void* lock) const noexcept
+  {
+    const auto count = name_count_ < static_cast<long>(max_names) ? name_count_ : static_cast<long>(max_names);
+
+    // The latest name of a lock wins.
+    for (long j = count; j != 0; j--)
+    {
+      if (names_[j - 1].lock == lock)
+      {
+        return names_[j - 1].name;
+      }
+    }
+
+    return nullptr;
+  }
+
+  void lock_profiler::name(const volatile void* lock, const char* name) noexcept
+  {
+    const long index = _InterlockedIncrement(&name_count_) - 1;
+
+    if (index < static_cast<long>(max_names))
+    {
+      names_[index] = { lock, name };
+    }
+  }
+
+  uint32_t lock_profiler::snapshot(lock_usage* usage, uint32_t capacity) noexcept
+  {
+    uint32_t count = 0;
+
+    for (uint32_t j = 0; j < table_count_; j++)
+    {
+      const auto& table = tables_[j];
+
+      for (uint32_t k = 0; k <= max_locks; k++)
+      {
+        const auto& entry = k < max_locks ? table.locks[k] : table.overflow;
+
+        if (entry.acquisition_count == 0)
+        {
+          continue;
+        }
+
+        // Merged by address, a lock taken on several processors has an entry in each of their tables.
+        uint32_t position = 0;
+
+        for (; position < count && usage[position].lock != entry.lock; position++)
+        {
+        }
+
+        if (position == count)
+        {
+          if (count == capacity)
+          {
+            continue;
+          }
+
+          usage[count++] = { entry.lock, entry.lock != nullptr ? name_of(entry.lock) : nullptr };
+        }
+
+        usage[position].acquisition_count += entry.acquisition_count;
+        usage[position].contended_count += entry.contended_count;
+        usage[position].spin_count += entry.spin_count;
+        usage[position].wait_cycles += entry.wait_cycles;
+        usage[position].hold_cycles += entry.hold_cycles;
+      }
+    }
+
+    // Insertion sort, the dump is rare and the locks are few.
+    for (uint32_t j = 1; j < count; j++)
+    {
+      const auto entry = usage[j];
+      uint32_t position = j;
+
+      for (; position > 0 && usage[position - 1].wait_cycles < entry.wait_cycles; position--)
+      {
+        usage[position] = usage[position - 1];
+      }
+
+      usage[position] = entry;
+    }
+
+    return count;
+  }
+
+  void lock_profiler::dump() noexcept
+  {
+    // Too big for the stack, and the heap may be the lock being profiled.
+    constexpr uint32_t capacity = max_locks + 1;
+    auto* usage = static_cast<lock_usage*>(common::allocate_pages(sizeof(lock_usage) * capacity));
+
+    if (usage == nullptr)
+    {
+      return;
+    }
+
+    const uint32_t count = snapshot(usage, capacity);
+
+    Print(L"Locks by wait time:\n"_w);
+
+    for (uint32_t j = 0; j < count; j++)
+    {
+      const auto& entry = usage[j];
+
+      if (entry.name != nullptr)
+      {
+        Print(L"  %-18a"_w, entry.name);
+      }
+      else if (entry.lock != nullptr)
+      {
+        Print(L"  0x%p"_w, entry.lock);
+      }
+      else
+      {
+        Print(L"  %-18a"_w, "untracked");
+      }
+
+      Print(L" %12lu wait, %12lu hold cycles, %lu of %lu acquisitions contended, %lu spins\n"_w,
+        entry.wait_cycles, entry.hold_cycles, entry.contended_count, entry.acquisition_count, entry.spin_count);
+    }
+
+    common::free_pages(usage, sizeof(lock_usage) * capacity);
+  }
+}
@@ -0,0 +1,214 @@
+#pragma once
+#include "delete_constructors.hpp"
+#include "globals.hpp"
+#include "common.hpp"
+#include <intrin.h>
+#include <cstdint>
+#include <cstddef>
+
+namespace hh
+{
+  struct lock_usage
+  {
+    const volatile void* lock;
+    // Null unless the lock was named with lock_profiler::name().
+    const char* name;
+    uint64_t acquisition_count;
+    // Acquisitions that found the lock taken.
+    uint64_t contended_count;
+    // Pauses spent in the backoff loop.
+    uint64_t spin_count;
+    uint64_t wait_cycles;
+    uint64_t hold_cycles;
+  };
+
+  // Contention of spinlock_guard locks, per lock address. Every processor counts into a table of its own,
+  // so the profiler takes no lock and its counters never share a cache line with another processor.
+  // Hold times come from a small per-processor stack of the locks the processor holds.
+  class lock_profiler : non_relocatable
+  {
+  public:
+    // Locks tracked per processor, acquisitions of further locks go to an overflow entry.
+    static constexpr uint32_t max_locks = 256;
+    static constexpr uint32_t max_names = 32;
+
+  private:
+    static constexpr uint32_t max_held_locks = 16;
+
+    struct lock_entry
+    {
+      const volatile void* lock;
+      uint64_t acquisition_count;
+      uint64_t contended_count;
+      uint64_t spin_count;
+      uint64_t wait_cycles;
+      uint64_t hold_cycles;
+    };
+
+    struct held_lock
+    {
+      const volatile void* lock;
+      uint64_t acquired_tsc;
+      lock_entry* entry;
+    };
+
+    // Written only by the processor that owns it.
+    struct alignas(64) processor_table
+    {
+      lock_entry locks[max_locks];
+      lock_entry overflow;
+      held_lock held[max_held_locks];
+      uint32_t held_count;
+    };
+
+    struct lock_name
+    {
+      const volatile void* lock;
+      const char* name;
+    };
+
+    processor_table* tables_;
+    uint32_t table_count_;
+    lock_name names_[max_names];
+    volatile long name_count_;
+
+  private:
+    lock_entry& entry_of(processor_table& table, const volatile void* lock) noexcept;
+    const char* name_of(const volatile void* lock) const noexcept;
+
+  public:
+    // The tables are taken with AllocatePages, never from the heap.
+    lock_profiler() noexcept;
+    ~lock_profiler() noexcept;
+
+    // Called by the lock right after it's taken. wait_start_tsc is the TSC when the attempt started.
+    void acquired(const volatile void* lock, uint64_t wait_start_tsc, uint64_t spin_count) noexcept
+    {
+      uint32_t processor = 0;
+      const uint64_t tsc = common::processor_timestamp(processor);
+
+      if (processor >= table_count_)
+      {
+        return;
+      }
+
+      auto& table = tables_[processor];
+      auto& entry = entry_of(table, lock);
+
+      entry.acquisition_count++;
+
+      if (spin_count != 0)
+      {
+        entry.contended_count++;
+        entry.spin_count += spin_count;
+        entry.wait_cycles += tsc - wait_start_tsc;
+      }
+
+      if (table.held_count < max_held_locks)
+      {
+        table.held[table.held_count++] = { lock, tsc, &entry };
+      }
+    }
+
+    // Called by the lock right before it's released.
+    void released(const volatile void* lock) noexcept
+    {
+      uint32_t processor = 0;
+      const uint64_t tsc = common::processor_timestamp(processor);
+
+      if (processor >= table_count_)
+      {
+        return;
+      }
+
+      auto& table = tables_[processor];
+
+      // Guards are scoped, the lock is almost always on the top.
+      for (uint32_t j = table.held_count; j != 0; j--)
+      {
+        if (table.held[j - 1].lock != lock)
+        {
+          continue;
+        }
+
+        table.held[j - 1].entry->hold_cycles += tsc - table.held[j - 1].acquired_tsc;
+
+        for (uint32_t k = j; k < table.held_count; k++)
+        {
+          table.held[k - 1] = table.held[k];
+        }
+
+        table.held_count--;
+        return;
+      }
+    }
+
+    // Shown instead of the address in the dump. The name must outlive the profiler.
+    void name(const volatile void* lock, const char* name) noexcept;
+
+    // Fills up to capacity entries merged over the processors, sorted by wait cycles from the longest.
+    // Reads the tables without stopping the other processors, counters of a busy lock may be a bit off.
+    // Returns the number of entries filled.
+    uint32_t snapshot(lock_usage* usage, uint32_t capacity) noexcept;
+    // Prints the snapshot to the console. Boot services must be available.
+    void dump() noexcept;
+  };
+
+  // Lock profile policies for config::lock_profile. spinlock_guard calls them for every acquisition.
+  struct no_lock_profile
+  {
+    static constexpr bool enabled = false;
+
+    static uint64_t wait_started() noexcept
+    {
+      return 0;
+    }
+
+    static void acquired(const volatile void*, uint64_t, uint64_t) noexcept {}
+    static void released(const volatile void*) noexcept {}
+    static void name(const volatile void*, const char*) noexcept {}
+    static void dump() noexcept {}
+  };
+
+  struct counted_lock_profile
+  {
+    static constexpr bool enabled = true;
+
+    static uint64_t wait_started() noexcept
+    {
+      return __rdtsc();
+    }
+
+    static void acquired(const volatile void* lock, uint64_t wait_start_tsc, uint64_t spin_count) noexcept
+    {
+      if (globals::lock_profile != nullptr)
+      {
+        globals::lock_profile->acquired(lock, wait_start_tsc, spin_count);
+      }
+    }
+
+    static void released(const volatile void* lock) noexcept
+    {
+      if (globals::lock_profile != nullptr)
+      {
+        globals::lock_profile->released(lock);
+      }
+    }
+
+    static void name(const volatile void* lock, const char* name) noexcept
+    {
+      if (globals::lock_profile != nullptr)
+      {
+        globals::lock_profile->name(lock, name);
+      }
+    }
+
+    static void dump() noexcept
+    {
+      if (globals::lock_profile != nullptr && globals::boot_state)
+      {
+        globals::lock_profile->dump();
+      }
+    }
+  };
+}
@@ -0,0 +1,267 @@
+#include "common.hpp"
+#include "config.hpp"
+#include <intrin.h>
+
+// The locks don't depend on boot services, the host build compiles this file as it is.
+namespace hh::common
+{
+  spinlock_guard::spinlock_guard(volatile long* lock) noexcept : lock_{ lock }
+  {
+    lock_spinlock();
+  }
+
+  spinlock_guard::~spinlock_guard() noexcept
+  {
+    if (lock_ != nullptr)
+    {
+      unlock();
+    }
+  }
+
+  bool spinlock_guard::try_lock() noexcept
+  {
+    return (!(*lock_) && !_interlockedbittestandset(lock_, 0));
+  }
+
+  void spinlock_guard::unlock() noexcept
+  {
+    config::lock_profile::released(lock_);
+    // x86 doesn't move earlier stores past this one, the barrier keeps the compiler from doing it.
+    _ReadWriteBarrier();
+    *lock_ = 0;
+  }
+
+  spinlock_guard::spinlock_guard(spinlock_guard&& obj) noexcept
+  {
+    lock_ = obj.lock_;
+    obj.lock_ = nullptr;
+  }
+
+  spinlock_guard& spinlock_guard::operator=(spinlock_guard&& obj) noexcept
+  {
+    if (lock_ != nullptr)
+    {
+      unlock();
+    }
+
+    lock_ = obj.lock_;
+    obj.lock_ = nullptr;
+
+    return *this;
+  }
+
+  void spinlock_guard::lock_spinlock() noexcept
+  {
+    const uint64_t wait_start = config::lock_profile::wait_started();
+    uint64_t spin_count = 0;
+    uint32_t wait = 1;
+
+    while (!try_lock())
+    {
+      for (uint32_t j = 0; j < wait; j++)
+      {
+        _mm_pause();
+      }
+
+      spin_count += wait;
+
+      if (wait * 2 > max_wait_)
+      {
+        wait = max_wait_;
+      }
+      else
+      {
+        wait *= 2;
+      }
+    }
+
+    config::lock_profile::acquired(lock_, wait_start, spin_count);
+  }
+
+  void ticket_lock::lock() noexcept
+  {
+    const long ticket = _InterlockedExchangeAdd(&next_ticket_, 1);
+
+    for (long ahead = ticket - now_serving_; ahead != 0; ahead = ticket - now_serving_)
+    {
+      // Every holder ahead of us takes a while, no need to keep reading the line in the meantime.
+      for (long j = 0; j < ahead * 64; j++)
+      {
+        _mm_pause();
+      }
+    }
+
+    // The critical section must not be read before the lock is ours.
+    _ReadWriteBarrier();
+  }
+
+  void ticket_lock::unlock() noexcept
+  {
+    _ReadWriteBarrier();
+    // Only the owner writes now_serving_.
+    now_serving_ = now_serving_ + 1;
+  }
+
+  void mcs_lock::lock(node& self) noexcept
+  {
+    self.next = nullptr;
+    self.waiting = 1;
+
+    auto* previous = static_cast<node*>(_InterlockedExchangePointer(reinterpret_cast<void* volatile*>(&tail_), &self));
+
+    if (previous == nullptr)
+    {
+      return;
+    }
+
+    previous->next = &self;
+
+    while (self.waiting)
+    {
+      _mm_pause();
+    }
+
+    _ReadWriteBarrier();
+  }
+
+  void mcs_lock::unlock(node& self) noexcept
+  {
+    if (self.next == nullptr)
+    {
+      if (_InterlockedCompareExchangePointer(reinterpret_cast<void* volatile*>(&tail_), nullptr, &self) == &self)
+      {
+        return;
+      }
+
+      // A waiter has swapped itself in but hasn't linked to us yet.
+      while (self.next == nullptr)
+      {
+        _mm_pause();
+      }
+    }
+
+    _ReadWriteBarrier();
+    self.next->waiting = 0;
+  }
+
+  ticket_lock_guard::ticket_lock_guard(ticket_lock* lock) noexcept : lock_{ lock }
+  {
+    lock_->lock();
+  }
+
+  ticket_lock_guard::~ticket_lock_guard() noexcept
+  {
+    if (lock_ != nullptr)
+    {
+      lock_->unlock();
+    }
+  }
+
+  ticket_lock_guard::ticket_lock_guard(ticket_lock_guard&& obj) noexcept
+  {
+    lock_ = obj.lock_;
+    obj.lock_ = nullptr;
+  }
+
+  ticket_lock_guard& ticket_lock_guard::operator=(ticket_lock_guard&& obj) noexcept
+  {
+    if (lock_ != nullptr)
+    {
+      lock_->unlock();
+    }
+
+    lock_ = obj.lock_;
+    obj.lock_ = nullptr;
+
+    return *this;
+  }
+
+  mcs_lock_guard::mcs_lock_guard(mcs_lock* lock) noexcept : lock_{ lock }, node_{}
+  {
+    lock_->lock(node_);
+  }
+
+  mcs_lock_guard::~mcs_lock_guard() noexcept
+  {
+    lock_->unlock(node_);
+  }
+
+  void rw_spinlock::lock_shared(uint32_t processor) noexcept
+  {
+    auto& count = readers_[processor].count;
+
+    while (true)
+    {
+      // The interlocked increment is a full barrier, writer_ is read after the count is visible. A nested
+      // section passes, the writer is waiting for the outer one anyway.
+      if (_InterlockedIncrement(&count) != 1 || !writer_)
+      {
+        return;
+      }
+
+      _InterlockedDecrement(&count);
+
+      while (writer_)
+      {
+        _mm_pause();
+      }
+    }
+  }
+
+  void rw_spinlock::unlock_shared(uint32_t processor) noexcept
+  {
+    // Interlocked, a processor whose ID isn't known shares slot 0 with the BSP.
+    _InterlockedDecrement(&readers_[processor].count);
+  }
+
+  void rw_spinlock::lock() noexcept
+  {
+    uint32_t wait = 1;
+
+    while (writer_ || _interlockedbittestandset(&writer_, 0))
+    {
+      for (uint32_t j = 0; j < wait; j++)
+      {
+        _mm_pause();
+      }
+
+      wait = wait < 1024 ? wait * 2 : wait;
+    }
+
+    for (uint32_t j = 0; j < processor_count(); j++)
+    {
+      while (readers_[j].count != 0)
+      {
+        _mm_pause();
+      }
+    }
+
+    _ReadWriteBarrier();
+  }
+
+  void rw_spinlock::unlock() noexcept
+  {
+    _ReadWriteBarrier();
+    writer_ = 0;
+  }
+
+  read_lock_guard::read_lock_guard(rw_spinlock* lock) noexcept : lock_{ lock }, processor_{ current_processor() }
+  {
+    lock_->lock_shared(processor_);
+  }
+
+  read_lock_guard::~read_lock_guard() noexcept
+  {
+    lock_->unlock_shared(processor_);
+  }
+
+  write_lock_guard::write_lock_guard(rw_spinlock* lock) noexcept : lock_{ lock }
+  {
+    lock_->lock();
+  }
+
+  write_lock_guard::~write_lock_guard() noexcept
+  {
+    lock_->unlock();
+  }
+}
@@ -17,6 +17,12 @@ extern "C"
 #include "type_info.hpp"
 #include "common.hpp"
 #include "globals.hpp"
+#include "config.hpp"
+#include "global_heap.hpp"
+#include "zero_page_pool.hpp"
+#include "task_scheduler.hpp"
+#include "parallel.hpp"
+#include "benchmarks.hpp"
 #include <vector>
 
 extern "C" EFI_GUID gEfiSampleDriverProtocolGuid = EFI_SAMPLE_DRIVER_PROTOCOL_GUID;
@@ -36,13 +42,75 @@ extern "C" EFI_STATUS EFIAPI UefiUnload(IN EFI_HANDLE ImageHandle)
 
 using namespace hh;
 
+static EFI_STATUS EFIAPI get_heap_statistics(IN EFI_SAMPLE_DRIVER_PROTOCOL* This, OUT EFI_SAMPLE_HEAP_STATISTICS* Statistics)
+{
+  if (Statistics == nullptr)
+  {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (globals::mem_manager == nullptr)
+  {
+    return EFI_NOT_READY;
+  }
+
+  *Statistics = globals::mem_manager->statistics();
+
+  return EFI_SUCCESS;
+}
+
+static EFI_SAMPLE_DRIVER_PROTOCOL sample_protocol = { nullptr, EFI_SAMPLE_DRIVER_PROTOCOL_REVISION, get_heap_statistics };
+
 extern "C" EFI_STATUS EFIAPI UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE * SystemTable)
 {
   dead_loop();
 
-  globals::mem_manager = new tlsf_allocator{};
+  common::initialize_processors();
+  auto& heap = global_heap::create();
 
+  if constexpr (config::lock_profile::enabled)
   {
+    // Before the other objects so that their locks are counted from the start.
+    globals::lock_profile = new lock_profiler{};
+  }
+
+  // Zeroed page tables and buffers come ready from the pool, the APs zero the next ones in the meantime.
+  auto* zero_pool = new zero_page_pool{ heap };
+  heap.attach_zero_pool(zero_pool);
+  zero_pool->refill();
+
+  if constexpr (config::allocation_trace::enabled)
+  {
+    globals::allocation_trace = new trace_recorder{ 1 << 20 };
+  }
+
+  if constexpr (config::allocation_tags::enabled)
+  {
+    globals::allocation_tags = new tag_accounting{ 1 << 20 };
+  }
+
+  if constexpr (config::allocation_profile::enabled)
+  {
+    // A sample every 512 KB on average.
+    globals::allocation_profile = new allocation_profiler{ 512 * 1024, 4096 };
+  }
+
+  // Lets other images and shell tools query the heap of this image.
+  sample_protocol.SampleValue = ImageHandle;
+  gBS->InstallProtocolInterface(&ImageHandle, &gEfiSampleDriverProtocolGuid, EFI_NATIVE_INTERFACE, &sample_protocol);
+
+#if HH_BENCHMARKS
+  benchmarks::run_all();
+#endif
+
+#if HH_TASK_SCHEDULER
+  // From here on the APs run tasks, common::start_on_application_processors() fails until the scheduler stops.
+  globals::scheduler = new task_scheduler{};
+  globals::scheduler->start();
+#endif
+
+  {
+    mem_tag_scope _{ mem_tag("Demo") };
     std::vector<int> nums;
 
     for (std::size_t j = 0; j < 1000; j++)
@@ -55,6 +123,12 @@ extern "C" EFI_STATUS EFIAPI UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_T
       Print(L"%d\n"_w, elem);
     }
 
+    // A small grain so that 1000 elements are split at all, the default one suits millions. Without the
+    // scheduler every call borrows the APs on its own.
+    parallel::transform(nums.begin(), nums.end(), nums.begin(), [](int elem) { return elem * 2; }, 128);
+    parallel::sort(nums.begin(), nums.end(), std::greater<>{}, 128);
+    Print(L"%ld\n"_w, parallel::reduce(nums.begin(), nums.end(), 0ll, std::plus<>{}, 128));
+
     try
     {
       throw std::exception{ "test exception" };
@@ -65,7 +139,65 @@ extern "C" EFI_STATUS EFIAPI UefiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_T
     }
   }
 
-  delete globals::mem_manager;
+  gBS->UninstallProtocolInterface(ImageHandle, &gEfiSampleDriverProtocolGuid, &sample_protocol);
+
+#if HH_TASK_SCHEDULER
+  {
+    auto* scheduler = globals::scheduler;
+
+    globals::scheduler = nullptr;
+    delete scheduler;
+  }
+#endif
+
+  if constexpr (config::allocation_trace::enabled)
+  {
+    auto* recorder = globals::allocation_trace;
+
+    if (EFI_ERROR(recorder->flush(ImageHandle, L"\\alloc.trace"_w)))
+    {
+      Print(L"Failed to write the allocation trace\n"_w);
+    }
+
+    globals::allocation_trace = nullptr;
+    delete recorder;
+  }
+
+  if constexpr (config::allocation_profile::enabled)
+  {
+    auto* profiler = globals::allocation_profile;
+
+    if (EFI_ERROR(profiler->flush(ImageHandle, L"\\alloc.folded"_w)))
+    {
+      Print(L"Failed to write the allocation profile\n"_w);
+    }
+
+    globals::allocation_profile = nullptr;
+    delete profiler;
+  }
+
+  if constexpr (config::lock_profile::enabled)
+  {
+    auto* profiler = globals::lock_profile;
+
+    profiler->dump();
+    globals::lock_profile = nullptr;
+    delete profiler;
+  }
+
+  if constexpr (config::allocation_tags::enabled)
+  {
+    auto* accounting = globals::allocation_tags;
+
+    accounting->dump();
+    globals::allocation_tags = nullptr;
+    delete accounting;
+  }
+
+  heap.attach_zero_pool(nullptr);
+  delete zero_pool;
+
+  global_heap::destroy();
 
   return EFI_SUCCESS;
 }
@@ -0,0 +1,307 @@
+#include "mem_tags.hpp"
+#include "config.hpp"
+#include "uefi.hpp"
+#include <intrin.h>
+#include <cstring>
+
+namespace hh
+{
+  // A block table is never filled beyond 7/8 of its capacity, probe sequences stay short.
+  static constexpr uint64_t max_load_numerator = 7;
+  static constexpr uint64_t max_load_denominator = 8;
+
+  tag_accounting::tag_accounting(uint64_t block_capacity) noexcept
+    : counters_{}, tables_{}, entries_{}, table_count_{ common::processor_count() }, table_capacity_{}, tags_{}, tag_count_{ 1 },
+    tags_lock_{}
+  {
+    unsigned long highest_bit = 0;
+
+    config::lock_profile::name(&tags_lock_, "tag registry");
+
+    counters_ = static_cast<processor_counters*>(common::allocate_pages(sizeof(processor_counters) * common::max_processors));
+    tables_ = static_cast<block_table*>(common::allocate_pages(sizeof(block_table) * table_count_));
+
+    // AllocatePages doesn't zero the pages.
+    if (counters_ != nullptr)
+    {
+      memset(counters_, 0, sizeof(processor_counters) * common::max_processors);
+    }
+
+    if (tables_ != nullptr)
+    {
+      memset(tables_, 0, sizeof(block_table) * table_count_);
+    }
+
+    if (counters_ == nullptr || tables_ == nullptr || !_BitScanReverse64(&highest_bit, block_capacity / table_count_))
+    {
+      return;
+    }
+
+    table_capacity_ = 1ull << highest_bit;
+    entries_ = static_cast<block_entry*>(common::allocate_pages(table_capacity_ * table_count_ * sizeof(block_entry)));
+
+    if (entries_ == nullptr)
+    {
+      table_capacity_ = 0;
+      return;
+    }
+
+    memset(entries_, 0, table_capacity_ * table_count_ * sizeof(block_entry));
+
+    for (uint32_t j = 0; j < table_count_; j++)
+    {
+      tables_[j].entries = entries_ + table_capacity_ * j;
+      config::lock_profile::name(&tables_[j].lock, "tag block table");
+    }
+  }
+
+  tag_accounting::~tag_accounting() noexcept
+  {
+    if (counters_ != nullptr)
+    {
+      common::free_pages(counters_, sizeof(processor_counters) * common::max_processors);
+    }
+
+    if (tables_ != nullptr)
+    {
+      common::free_pages(tables_, sizeof(block_table) * table_count_);
+    }
+
+    if (entries_ != nullptr)
+    {
+      common::free_pages(entries_, table_capacity_ * table_count_ * sizeof(block_entry));
+    }
+  }
+
+  uint64_t tag_accounting::find_locked(const block_table& table, const void* block) const noexcept
+  {
+    for (uint64_t slot = slot_of(block); table.entries[slot].block != nullptr; slot = (slot + 1) & (table_capacity_ - 1))
+    {
+      if (table.entries[slot].block == block)
+      {
+        return slot;
+      }
+    }
+
+    return table_capacity_;
+  }
+
+  // Linear probing without tombstones: entries after the hole that hash at or before it move into it.
+  void tag_accounting::remove_locked(block_table& table, uint64_t slot) noexcept
+  {
+    const uint64_t mask = table_capacity_ - 1;
+    auto* entries = table.entries;
+    uint64_t hole = slot;
+
+    for (uint64_t next = (hole + 1) & mask; entries[next].block != nullptr; next = (next + 1) & mask)
+    {
+      const uint64_t home = slot_of(entries[next].block);
+
+      // Distance from home to next is at least the distance from home to the hole.
+      if (((next - home) & mask) >= ((next - hole) & mask))
+      {
+        entries[hole] = entries[next];
+        hole = next;
+      }
+    }
+
+    entries[hole] = {};
+    table.count--;
+  }
+
+  bool tag_accounting::tag_index_of(const void* block, uint32_t processor, bool remove, uint32_t& tag_index) noexcept
+  {
+    // Most blocks are freed by the processor that allocated them.
+    for (uint32_t j = 0; j < table_count_; j++)
+    {
+      auto& table = tables_[(processor + j) % table_count_];
+      common::spinlock_guard _{ &table.lock };
+      const uint64_t slot = find_locked(table, block);
+
+      if (slot == table_capacity_)
+      {
+        continue;
+      }
+
+      tag_index = table.entries[slot].tag_index;
+
+      if (remove)
+      {
+        remove_locked(table, slot);
+      }
+
+      return true;
+    }
+
+    return false;
+  }
+
+  uint32_t tag_accounting::index_of(uint32_t tag) noexcept
+  {
+    common::spinlock_guard _{ &tags_lock_ };
+
+    for (uint32_t j = 0; j < tag_count_; j++)
+    {
+      if (tags_[j] == tag)
+      {
+        return j;
+      }
+    }
+
+    if (tag_count_ == max_tags)
+    {
+      return 0;
+    }
+
+    tags_[tag_count_] = tag;
+    return tag_count_++;
+  }
+
+  void tag_accounting::allocated(const void* block, size_t block_size, uint32_t processor) noexcept
+  {
+    if (counters_ == nullptr)
+    {
+      return;
+    }
+
+    const uint32_t tag_index = globals::current_tag_indices[processor];
+    auto& counters = counters_[processor].tags[tag_index];
+
+    counters.allocated_bytes += block_size;
+    counters.allocation_count++;
+
+    if (table_capacity_ == 0)
+    {
+      return;
+    }
+
+    auto& table = tables_[processor];
+    common::spinlock_guard _{ &table.lock };
+
+    if ((table.count + 1) * max_load_denominator > table_capacity_ * max_load_numerator)
+    {
+      table.untracked_count++;
+      return;
+    }
+
+    uint64_t slot = slot_of(block);
+
+    while (table.entries[slot].block != nullptr && table.entries[slot].block != block)
+    {
+      slot = (slot + 1) & (table_capacity_ - 1);
+    }
+
+    table.count += table.entries[slot].block == nullptr;
+    table.entries[slot] = { block, tag_index };
+  }
+
+  void tag_accounting::deallocated(const void* block, size_t block_size, uint32_t processor) noexcept
+  {
+    uint32_t tag_index = 0;
+
+    // Untracked blocks were charged to a tag nobody remembers.
+    if (counters_ == nullptr || table_capacity_ == 0 || !tag_index_of(block, processor, true, tag_index))
+    {
+      return;
+    }
+
+    auto& counters = counters_[processor].tags[tag_index];
+
+    counters.freed_bytes += block_size;
+    counters.deallocation_count++;
+  }
+
+  void tag_accounting::resized(const void* block, size_t old_block_size, size_t new_block_size) noexcept
+  {
+    const uint32_t processor = common::current_processor();
+    uint32_t tag_index = 0;
+
+    if (counters_ == nullptr || table_capacity_ == 0 || !tag_index_of(block, processor, false, tag_index))
+    {
+      return;
+    }
+
+    auto& counters = counters_[processor].tags[tag_index];
+
+    counters.allocated_bytes += new_block_size;
+    counters.freed_bytes += old_block_size;
+  }
+
+  uint32_t tag_accounting::snapshot(mem_tag_usage* usage, uint32_t capacity) noexcept
+  {
+    uint32_t count = 0;
+
+    if (counters_ == nullptr)
+    {
+      return 0;
+    }
+
+    for (uint32_t j = 0; j < tag_count_ && count < capacity; j++)
+    {
+      mem_tag_usage entry = { tags_[j] };
+      int64_t live_bytes = 0;
+
+      for (uint32_t k = 0; k < common::processor_count(); k++)
+      {
+        const auto& counters = counters_[k].tags[j];
+
+        live_bytes += counters.allocated_bytes - counters.freed_bytes;
+        entry.allocation_count += counters.allocation_count;
+        entry.deallocation_count += counters.deallocation_count;
+      }
+
+      if (entry.allocation_count == 0)
+      {
+        continue;
+      }
+
+      entry.live_bytes = live_bytes > 0 ? live_bytes : 0;
+
+      // Insertion sort, there are at most max_tags entries.
+      uint32_t position = count++;
+
+      for (; position > 0 && usage[position - 1].live_bytes < entry.live_bytes; position--)
+      {
+        usage[position] = usage[position - 1];
+      }
+
+      usage[position] = entry;
+    }
+
+    return count;
+  }
+
+  void tag_accounting::dump() noexcept
+  {
+    mem_tag_usage usage[max_tags];
+    const uint32_t count = snapshot(usage, max_tags);
+
+    Print(L"Allocations by tag:\n"_w);
+
+    for (uint32_t j = 0; j < count; j++)
+    {
+      char name[5] = {};
+
+      for (uint32_t k = 0; k < 4; k++)
+      {
+        const auto c = static_cast<char>(usage[j].tag >> (k * 8));
+        name[k] = c >= 0x20 && c < 0x7F ? c : '.';
+      }
+
+      Print(L"  %a %16lu bytes live, %lu allocations, %lu frees\n"_w, usage[j].tag == untagged ? "none" : name,
+        usage[j].live_bytes, usage[j].allocation_count, usage[j].deallocation_count);
+    }
+
+    uint64_t untracked_count = 0;
+
+    for (uint32_t j = 0; tables_ != nullptr && j < table_count_; j++)
+    {
+      untracked_count += tables_[j].untracked_count;
+    }
+
+    if (untracked_count != 0)
+    {
+      Print(L"  %lu blocks weren't tracked, their frees aren't counted\n"_w, untracked_count);
+    }
+  }
+}
@@ -0,0 +1,191 @@
+#pragma once
+#include "delete_constructors.hpp"
+#include "globals.hpp"
+#include "common.hpp"
+#include <cstdint>
+#include <cstddef>
+
+namespace hh
+{
+  // Four characters in memory order, like NT pool tags: mem_tag("Net ").
+  consteval uint32_t mem_tag(const char (&name)[5])
+  {
+    return static_cast<uint8_t>(name[0]) | static_cast<uint8_t>(name[1]) << 8 | static_cast<uint8_t>(name[2]) << 16
+      | static_cast<uint32_t>(static_cast<uint8_t>(name[3])) << 24;
+  }
+
+  // Blocks allocated outside of any mem_tag_scope.
+  constexpr uint32_t untagged = 0;
+
+  struct mem_tag_usage
+  {
+    uint32_t tag;
+    uint64_t live_bytes;
+    uint64_t allocation_count;
+    uint64_t deallocation_count;
+  };
+
+  // Heap usage per allocation tag. Counters are kept per processor and per tag, a table of live blocks
+  // remembers the tag of every block so its free is charged to the same tag. Every processor records the
+  // blocks it allocates in a table of its own, behind a lock of its own, so the accounting doesn't serialize
+  // the processors. A free looks in the table of the freeing processor first and in the others after it.
+  // The tables have a fixed capacity, blocks allocated while one is full stay charged to their tag after
+  // they are freed.
+  class tag_accounting : non_relocatable
+  {
+  public:
+    static constexpr uint32_t max_tags = 64;
+
+  private:
+    struct tag_counters
+    {
+      uint64_t allocated_bytes;
+      uint64_t freed_bytes;
+      uint64_t allocation_count;
+      uint64_t deallocation_count;
+    };
+
+    // Written only by the processor that owns the row.
+    struct alignas(64) processor_counters
+    {
+      tag_counters tags[max_tags];
+    };
+
+    struct block_entry
+    {
+      const void* block;
+      uint32_t tag_index;
+    };
+
+    // Blocks allocated by one processor.
+    struct alignas(64) block_table
+    {
+      block_entry* entries;
+      uint64_t count;
+      uint64_t untracked_count;
+      volatile long lock;
+    };
+
+    processor_counters* counters_;
+    block_table* tables_;
+    block_entry* entries_;
+    uint32_t table_count_;
+    // Entries of each table.
+    uint64_t table_capacity_;
+    // Index 0 is untagged.
+    uint32_t tags_[max_tags];
+    uint32_t tag_count_;
+    volatile long tags_lock_;
+
+  private:
+    uint64_t slot_of(const void* block) const noexcept
+    {
+      return (reinterpret_cast<uint64_t>(block) >> 3) * 0x9E3779B97F4A7C15 & (table_capacity_ - 1);
+    }
+
+    // Must be called under the lock of the table. Returns table_capacity_ if the block isn't in it.
+    uint64_t find_locked(const block_table& table, const void* block) const noexcept;
+    void remove_locked(block_table& table, uint64_t slot) noexcept;
+    // Tag index of a block, looked up from the table of processor on. Returns false if no table has it.
+    bool tag_index_of(const void* block, uint32_t processor, bool remove, uint32_t& tag_index) noexcept;
+
+  public:
+    // Block capacity is shared by the processors, each table gets its part rounded down to a power of two.
+    // The counters and the tables are taken with AllocatePages, never from the accounted heap.
+    explicit tag_accounting(uint64_t block_capacity) noexcept;
+    ~tag_accounting() noexcept;
+
+    // Index of the tag, registered on first use. Tags that don't fit in max_tags are charged as untagged.
+    uint32_t index_of(uint32_t tag) noexcept;
+
+    void allocated(const void* block, size_t block_size, uint32_t processor) noexcept;
+    void deallocated(const void* block, size_t block_size, uint32_t processor) noexcept;
+    void resized(const void* block, size_t old_block_size, size_t new_block_size) noexcept;
+
+    // Fills up to capacity entries, sorted by live bytes from the biggest. Returns the number of entries filled.
+    uint32_t snapshot(mem_tag_usage* usage, uint32_t capacity) noexcept;
+    // Prints the snapshot to the console. Boot services must be available.
+    void dump() noexcept;
+  };
+
+  // Charges the allocations of the calling processor to tag until the scope ends. Scopes nest, the innermost
+  // one wins. Use it as hh::mem_tag_scope, see config.hpp, it compiles to nothing when tags are switched off.
+  template<class Policy, bool Enabled = Policy::enabled>
+  class basic_mem_tag_scope : non_relocatable
+  {
+  private:
+    uint32_t processor_;
+    uint32_t previous_index_;
+
+  public:
+    explicit basic_mem_tag_scope(uint32_t tag) noexcept
+      : processor_{ common::current_processor() }, previous_index_{ globals::current_tag_indices[processor_] }
+    {
+      if (globals::allocation_tags != nullptr)
+      {
+        globals::current_tag_indices[processor_] = globals::allocation_tags->index_of(tag);
+      }
+    }
+
+    ~basic_mem_tag_scope() noexcept
+    {
+      globals::current_tag_indices[processor_] = previous_index_;
+    }
+  };
+
+  template<class Policy>
+  class basic_mem_tag_scope<Policy, false> : non_relocatable
+  {
+  public:
+    explicit basic_mem_tag_scope(uint32_t) noexcept {}
+  };
+
+  // Tag policies for config::allocation_tags. Allocators call them for every operation.
+  struct no_allocation_tags
+  {
+    static constexpr bool enabled = false;
+
+    static void allocated(const void*, size_t, uint32_t) noexcept {}
+    static void deallocated(const void*, size_t, uint32_t) noexcept {}
+    static void resized(const void*, size_t, size_t) noexcept {}
+    static void dump() noexcept {}
+  };
+
+  struct counted_allocation_tags
+  {
+    static constexpr bool enabled = true;
+
+    static void allocated(const void* block, size_t block_size, uint32_t processor) noexcept
+    {
+      if (globals::allocation_tags != nullptr)
+      {
+        globals::allocation_tags->allocated(block, block_size, processor);
+      }
+    }
+
+    static void deallocated(const void* block, size_t block_size, uint32_t processor) noexcept
+    {
+      if (globals::allocation_tags != nullptr)
+      {
+        globals::allocation_tags->deallocated(block, block_size, processor);
+      }
+    }
+
+    static void resized(const void* block, size_t old_block_size, size_t new_block_size) noexcept
+    {
+      if (globals::allocation_tags != nullptr)
+      {
+        globals::allocation_tags->resized(block, old_block_size, new_block_size);
+      }
+    }
+
+    // Prints with boot services, so only on the BSP before ExitBootServices.
+    static void dump() noexcept
+    {
+      if (globals::allocation_tags != nullptr && globals::boot_state && common::is_bootstrap_processor())
+      {
+        globals::allocation_tags->dump();
+      }
+    }
+  };
+}
@@ -3,77 +3,1133 @@
 #include "uefi.hpp"
 #include "common.hpp"
 #include "tlsf.h"
+#include "slab_cache.hpp"
+#include "buddy_allocator.hpp"
+#include "zero_page_pool.hpp"
 #include "globals.hpp"
+#include "config.hpp"
+#include "efi_stub.hpp"
+#include <intrin.h>
+#include <cstring>
 
 namespace hh
 {
+  // Called when an allocation of required_size bytes fails. Releases cached memory back to the heap and
+  // returns the number of bytes released, 0 if it had nothing to give.
+  using reclaim_procedure = size_t(*)(void* context, size_t required_size);
+
   // Heap manager interface.
   class memory_manager abstract : non_relocatable
   {
+  private:
+    // Net growth of a processor's live bytes after which it refreshes the global peak.
+    static constexpr int64_t peak_check_step_ = 0x10000;
+    static constexpr uint32_t max_reclaimers_ = 16;
+
+    // Written only by the processor that owns the slot, so no lock and no interlocked operations are needed.
+    struct alignas(64) processor_counters
+    {
+      uint64_t allocated_bytes;
+      uint64_t freed_bytes;
+      uint64_t allocation_count;
+      uint64_t deallocation_count;
+      uint64_t failed_count;
+      int64_t bytes_since_peak_check;
+      uint64_t size_histogram[EFI_SAMPLE_HEAP_HISTOGRAM_BUCKETS];
+      uint64_t reclaim_count;
+      uint64_t reclaimed_count;
+      // Set while the processor runs the reclaimers, their own failed allocations don't reclaim again.
+      bool reclaiming;
+    };
+
+    struct reclaimer
+    {
+      reclaim_procedure procedure;
+      void* context;
+      uint32_t priority;
+    };
+
+    processor_counters counters_[common::max_processors] = {};
+    volatile long long peak_bytes_ = {};
+    zero_page_pool* zero_pool_ = {};
+    // Sorted by priority, guarded by reclaim_lock_.
+    reclaimer reclaimers_[max_reclaimers_] = {};
+    uint32_t reclaimer_count_ = {};
+    volatile long reclaim_lock_ = {};
+
+  private:
+    static uint32_t histogram_bucket(size_t size) noexcept
+    {
+      unsigned long highest_bit = 0;
+
+      if (size <= 16)
+      {
+        return 0;
+      }
+
+      _BitScanReverse64(&highest_bit, size - 1);
+
+      return highest_bit - 3 < EFI_SAMPLE_HEAP_HISTOGRAM_BUCKETS ? highest_bit - 3 : EFI_SAMPLE_HEAP_HISTOGRAM_BUCKETS - 1;
+    }
+
+    int64_t live_bytes() const noexcept
+    {
+      int64_t live_bytes = 0;
+
+      for (uint32_t j = 0; j < common::processor_count(); j++)
+      {
+        live_bytes += counters_[j].allocated_bytes - counters_[j].freed_bytes;
+      }
+
+      return live_bytes;
+    }
+
+    void update_peak() noexcept
+    {
+      const int64_t live = live_bytes();
+      long long peak = peak_bytes_;
+
+      while (live > peak)
+      {
+        const long long previous = _InterlockedCompareExchange64(&peak_bytes_, live, peak);
+
+        if (previous == peak)
+        {
+          break;
+        }
+
+        peak = previous;
+      }
+    }
+
   protected:
-    volatile long spinlock_ = {};
+    // Usable size of the block is counted, so live bytes include the allocator's rounding.
+    void record_allocation(const void* ptr, size_t requested_size, size_t block_size, size_t align = 0) noexcept
+    {
+      const uint32_t processor = common::current_processor();
+
+      config::allocation_trace::allocated(ptr, requested_size, align);
+      config::allocation_tags::allocated(ptr, block_size, processor);
+      config::allocation_profile::allocated(requested_size, processor);
+
+      auto& counters = counters_[processor];
+
+      counters.allocated_bytes += block_size;
+      counters.allocation_count++;
+      counters.size_histogram[histogram_bucket(requested_size)]++;
+      counters.bytes_since_peak_check += block_size;
+
+      if (counters.bytes_since_peak_check > peak_check_step_)
+      {
+        counters.bytes_since_peak_check = 0;
+        update_peak();
+      }
+    }
+
+    void record_failure(size_t requested_size) noexcept
+    {
+      auto& counters = counters_[common::current_processor()];
+
+      counters.failed_count++;
+      counters.size_histogram[histogram_bucket(requested_size)]++;
+    }
+
+    void record_deallocation(const void* ptr, size_t block_size, uint32_t processor = common::current_processor()) noexcept
+    {
+      config::allocation_trace::deallocated(ptr);
+      config::allocation_tags::deallocated(ptr, block_size, processor);
+
+      auto& counters = counters_[processor];
+
+      counters.freed_bytes += block_size;
+      counters.deallocation_count++;
+      counters.bytes_since_peak_check -= block_size;
+    }
+
+    // In-place resize, the block isn't counted as a new allocation.
+    void record_resize(const void* ptr, size_t requested_size, size_t old_block_size, size_t new_block_size) noexcept
+    {
+      config::allocation_trace::resized(ptr, requested_size);
+      config::allocation_tags::resized(ptr, old_block_size, new_block_size);
+
+      auto& counters = counters_[common::current_processor()];
+
+      counters.allocated_bytes += new_block_size;
+      counters.freed_bytes += old_block_size;
+      counters.bytes_since_peak_check += new_block_size - old_block_size;
+    }
+
+    // Called by an allocator after a failed attempt, outside of its own locks. Runs the reclaimers in priority
+    // order and calls retry after each one that released memory, until retry returns a block. Retry must record
+    // the allocation it makes, the failure is recorded here.
+    template<class Retry>
+    void* reclaim_and_retry(size_t requested_size, Retry&& retry) noexcept
+    {
+      auto& counters = counters_[common::current_processor()];
+      void* ptr = nullptr;
+
+      if (reclaimer_count_ != 0 && !counters.reclaiming)
+      {
+        counters.reclaiming = true;
+        counters.reclaim_count++;
+
+        {
+          common::spinlock_guard _{ &reclaim_lock_ };
+
+          for (uint32_t j = 0; j < reclaimer_count_ && ptr == nullptr; j++)
+          {
+            if (reclaimers_[j].procedure(reclaimers_[j].context, requested_size) != 0)
+            {
+              ptr = retry();
+            }
+          }
+        }
+
+        counters.reclaiming = false;
+      }
+
+      if (ptr == nullptr)
+      {
+        record_failure(requested_size);
+        return nullptr;
+      }
+
+      counters.reclaimed_count++;
+      return ptr;
+    }
+
+    // tlsf_walker that accumulates pool walk results into EFI_SAMPLE_HEAP_STATISTICS.
+    static void accumulate_block(void* ptr, size_t size, int used, void* user) noexcept
+    {
+      auto& statistics = *static_cast<EFI_SAMPLE_HEAP_STATISTICS*>(user);
+
+      statistics.PoolBytes += size + tlsf_alloc_overhead();
+
+      if (used)
+      {
+        statistics.UsedBlockCount++;
+        return;
+      }
+
+      statistics.FreeBlockCount++;
+      statistics.FreeBytes += size;
+
+      if (size > statistics.LargestFreeBlock)
+      {
+        statistics.LargestFreeBlock = size;
+      }
+    }
+
+    // Fills the pool walk part of a snapshot.
+    virtual void walk_pools(EFI_SAMPLE_HEAP_STATISTICS& statistics) noexcept {}
 
   public:
     memory_manager() = default;
+
+    // Counters are read without stopping other processors, so a snapshot taken under load is approximate.
+    EFI_SAMPLE_HEAP_STATISTICS statistics() noexcept
+    {
+      EFI_SAMPLE_HEAP_STATISTICS statistics = {};
+
+      update_peak();
+
+      for (uint32_t j = 0; j < common::processor_count(); j++)
+      {
+        const auto& counters = counters_[j];
+
+        statistics.AllocationCount += counters.allocation_count;
+        statistics.DeallocationCount += counters.deallocation_count;
+        statistics.FailedAllocationCount += counters.failed_count;
+        statistics.ReclaimCount += counters.reclaim_count;
+        statistics.ReclaimedAllocationCount += counters.reclaimed_count;
+
+        for (uint32_t k = 0; k < EFI_SAMPLE_HEAP_HISTOGRAM_BUCKETS; k++)
+        {
+          statistics.SizeHistogram[k] += counters.size_histogram[k];
+        }
+      }
+
+      const int64_t live = live_bytes();
+      statistics.LiveBytes = live > 0 ? live : 0;
+      statistics.PeakBytes = peak_bytes_;
+
+      walk_pools(statistics);
+
+      if (statistics.FreeBytes != 0)
+      {
+        statistics.FragmentationPercent = 100 - statistics.LargestFreeBlock * 100 / statistics.FreeBytes;
+      }
+
+      return statistics;
+    }
+
     virtual void* allocate(uint32_t allocation_size) = 0;
     virtual void* allocate_align(uint32_t allocation_size, std::align_val_t align) = 0;
     virtual void deallocate(void* ptr_to_allocation) = 0;
+
+    // Allocation_size is the size the block was allocated or last resized with, allocators that can find
+    // the block from it skip the lookup. 0 means the size is unknown.
+    virtual void deallocate_sized(void* ptr_to_allocation, uint32_t allocation_size)
+    {
+      deallocate(ptr_to_allocation);
+    }
+
+    // Resizes the block without moving it. Returns false if the memory after the block is taken.
+    virtual bool try_expand_in_place(void* ptr_to_allocation, uint32_t new_size) noexcept
+    {
+      return false;
+    }
+
+    // Resizes the block, moving it only if it can't be resized in place. The first min(old_size, new_size)
+    // bytes are preserved. On failure returns nullptr and leaves the block untouched.
+    virtual void* reallocate(void* ptr_to_allocation, uint32_t old_size, uint32_t new_size)
+    {
+      if (ptr_to_allocation == nullptr)
+      {
+        return allocate(new_size);
+      }
+
+      if (try_expand_in_place(ptr_to_allocation, new_size))
+      {
+        return ptr_to_allocation;
+      }
+
+      auto* new_ptr = allocate(new_size);
+
+      if (new_ptr != nullptr)
+      {
+        memcpy(new_ptr, ptr_to_allocation, old_size < new_size ? old_size : new_size);
+        deallocate_sized(ptr_to_allocation, old_size);
+      }
+
+      return new_ptr;
+    }
+
+    // Reclaimers run in ascending order of priority, caches that are cheap to rebuild should use low values.
+    // A reclaimer may run on any processor and must not add or remove reclaimers. Returns false when the
+    // registry is full.
+    bool add_reclaimer(reclaim_procedure procedure, void* context, uint32_t priority) noexcept
+    {
+      common::spinlock_guard _{ &reclaim_lock_ };
+
+      if (reclaimer_count_ == max_reclaimers_)
+      {
+        return false;
+      }
+
+      uint32_t position = reclaimer_count_;
+
+      for (; position > 0 && reclaimers_[position - 1].priority > priority; position--)
+      {
+        reclaimers_[position] = reclaimers_[position - 1];
+      }
+
+      reclaimers_[position] = { procedure, context, priority };
+      reclaimer_count_++;
+
+      return true;
+    }
+
+    // Waits for a reclaim that is running on another processor.
+    void remove_reclaimer(reclaim_procedure procedure, void* context) noexcept
+    {
+      common::spinlock_guard _{ &reclaim_lock_ };
+
+      for (uint32_t j = 0; j < reclaimer_count_; j++)
+      {
+        if (reclaimers_[j].procedure == procedure && reclaimers_[j].context == context)
+        {
+          memmove(&reclaimers_[j], &reclaimers_[j + 1], (reclaimer_count_ - j - 1) * sizeof(reclaimer));
+          reclaimer_count_--;
+          return;
+        }
+      }
+    }
+
+    // Pool must take its blocks from this heap, nullptr detaches it.
+    void attach_zero_pool(zero_page_pool* pool) noexcept
+    {
+      zero_pool_ = pool;
+    }
+
+    // Zero-filled block. Blocks of a page and more are page aligned, they come from the attached zero page
+    // pool when it has one ready and are zeroed here otherwise.
+    void* allocate_zeroed(uint32_t allocation_size)
+    {
+      if (allocation_size >= common::page_size && zero_pool_ != nullptr)
+      {
+        if (auto* ptr = zero_pool_->take(allocation_size); ptr != nullptr)
+        {
+          return ptr;
+        }
+      }
+
+      auto* ptr = allocation_size >= common::page_size ? allocate_align(allocation_size, std::align_val_t{ common::page_size }) : allocate(allocation_size);
+
+      if (ptr != nullptr)
+      {
+        zero_memory(ptr, allocation_size);
+      }
+
+      return ptr;
+    }
+
+    // Returns unused memory to firmware. Allocators that can't shrink ignore the call.
+    virtual void trim() noexcept {}
+
+    // Gives back the frees the allocator holds back on any processor.
+    virtual void flush() noexcept {}
     virtual ~memory_manager() = default;
   };
 
+  // Heap starts with InitialSize bytes and adds a pool GrowthFactor times bigger than the previous one
+  // every time it runs out of memory. Empty pools can be returned to firmware by trim().
+  template<size_t InitialSize = common::page_size * 256, size_t GrowthFactor = 2,
+    size_t MaxPoolSize = common::page_size * 16384, bool ReleaseEmptyPools = true>
+  struct geometric_growth
+  {
+    static constexpr size_t initial_size = InitialSize;
+    static constexpr size_t pool_alignment = common::page_size;
+    static constexpr bool can_grow = true;
+    static constexpr bool release_empty_pools = ReleaseEmptyPools;
+    static constexpr bool map_with_large_pages = false;
+
+    static constexpr size_t next_pool_size(size_t last_pool_size, size_t required_size) noexcept
+    {
+      size_t pool_size = last_pool_size * GrowthFactor;
+
+      if (pool_size > MaxPoolSize)
+      {
+        pool_size = MaxPoolSize;
+      }
+
+      if (pool_size < required_size)
+      {
+        pool_size = required_size;
+      }
+
+      return (pool_size + common::page_size - 1) & ~static_cast<size_t>(common::page_size - 1);
+    }
+  };
+
+  // Single pool that is allocated up front and never grows.
+  template<size_t PoolSize = common::page_size * 15000>
+  struct fixed_size
+  {
+    static constexpr size_t initial_size = PoolSize;
+    static constexpr size_t pool_alignment = common::page_size;
+    static constexpr bool can_grow = false;
+    static constexpr bool release_empty_pools = false;
+    static constexpr bool map_with_large_pages = false;
+
+    static constexpr size_t next_pool_size(size_t, size_t) noexcept
+    {
+      return 0;
+    }
+  };
+
+  // Geometric growth where every pool is a 2 MB aligned multiple of 2 MB. Firmware splits large pages
+  // only at the boundaries of differently typed regions, so such pools usually stay under 2 MB TLB
+  // entries. With PromoteMappings the allocator also merges 4 KB mappings of a new pool into 2 MB
+  // pages while it still shares the page tables with firmware, i.e. before ExitBootServices.
+  template<size_t InitialSize = common::large_page_size * 2, size_t GrowthFactor = 2,
+    size_t MaxPoolSize = common::large_page_size * 32, bool ReleaseEmptyPools = true, bool PromoteMappings = true>
+  struct large_page_arena
+  {
+    static constexpr size_t initial_size = InitialSize;
+    static constexpr size_t pool_alignment = common::large_page_size;
+    static constexpr bool can_grow = true;
+    static constexpr bool release_empty_pools = ReleaseEmptyPools;
+    static constexpr bool map_with_large_pages = PromoteMappings;
+
+    static constexpr size_t next_pool_size(size_t last_pool_size, size_t required_size) noexcept
+    {
+      const size_t pool_size = geometric_growth<InitialSize, GrowthFactor, MaxPoolSize>::next_pool_size(last_pool_size, required_size);
+      return (pool_size + common::large_page_size - 1) & ~static_cast<size_t>(common::large_page_size - 1);
+    }
+  };
+
+  // Heap that serves new/delete on the calling processor.
+  inline memory_manager* current_heap() noexcept
+  {
+    if (auto* heap = globals::scoped_heaps[common::current_processor()]; heap != nullptr)
+    {
+      return heap;
+    }
+
+    return globals::mem_manager;
+  }
+
   // Allocator with constant time allocation and deallocation. It fits perfectly for root mode allocations.
-  template<unsigned int DefaultSize = common::page_size * 15000>
+  // Memory is committed lazily according to GrowthPolicy, new pools are taken with gBS->AllocatePages
+  // and can only be added on the BSP while boot services are available.
+  // Requests up to slab_cache::max_object_size are served by the slab front-end when it's enabled.
+  // A non-zero FreeBatchSize defers frees: they are collected in a per-processor batch that goes back
+  // to TLSF under one lock acquisition when it fills, when an allocation misses or on flush().
+  // With UsePageBuddy page aligned requests up to 2 MB are served by the buddy front-end, so the TLSF
+  // pools hold only objects that don't need more than the default alignment.
+  // Locking selects the heap lock, see common.hpp. The queued locks hand it over in arrival order, which
+  // keeps tail latency down when many processors allocate at once.
+  template<class GrowthPolicy = geometric_growth<>, bool UseSlabCache = true, uint32_t FreeBatchSize = 0, bool UsePageBuddy = true,
+    class Locking = common::spin_locking>
   class tlsf_allocator : public memory_manager
   {
   private:
+    static constexpr uint32_t max_pools = 32;
+
+    struct pool_info
+    {
+      void* memory;
+      size_t size;
+      pool_t pool;
+    };
+
+    // Filled by the processor that owns the batch and drained by whoever holds the heap lock.
+    struct alignas(64) free_batch
+    {
+      void* blocks[FreeBatchSize != 0 ? FreeBatchSize : 1];
+      uint32_t sizes[FreeBatchSize != 0 ? FreeBatchSize : 1];
+      uint32_t count;
+      // Taken inside the heap lock, never around it. Guards against processors sharing the fallback slot
+      // and against drains from other processors.
+      volatile long lock;
+    };
+
     tlsf_t service_data_;
-    size_t pool_size_;
-    void* pool_ptr_;
+    pool_info pools_[max_pools];
+    uint32_t pool_count_;
+    slab_cache slab_;
+    buddy_allocator buddy_;
+    free_batch batches_[FreeBatchSize != 0 ? common::max_processors : 1];
+    typename Locking::lock_type lock_;
+
+  private:
+    static void* allocate_pool_memory(size_t pool_size) noexcept
+    {
+      auto* memory = common::allocate_pages(pool_size, GrowthPolicy::pool_alignment);
+
+      if constexpr (GrowthPolicy::map_with_large_pages)
+      {
+        if (memory != nullptr && globals::boot_state)
+        {
+          common::map_with_large_pages(memory, pool_size);
+        }
+      }
+
+      return memory;
+    }
+
+    void create_heap(size_t pool_size)
+    {
+      pool_size = (pool_size + GrowthPolicy::pool_alignment - 1) & ~static_cast<size_t>(GrowthPolicy::pool_alignment - 1);
+      auto* memory = allocate_pool_memory(pool_size);
+
+      if (memory == nullptr)
+      {
+        throw std::bad_alloc{};
+      }
+
+      service_data_ = tlsf_create_with_pool(memory, pool_size);
+      pools_[pool_count_++] = { memory, pool_size, tlsf_get_pool(service_data_) };
+    }
+
+    // Must be called under the lock.
+    bool grow(size_t required_size) noexcept
+    {
+      if constexpr (!GrowthPolicy::can_grow)
+      {
+        return false;
+      }
+
+      if (!globals::boot_state || pool_count_ == max_pools || !common::is_bootstrap_processor())
+      {
+        return false;
+      }
+
+      // TLSF rounds a request up to the next of the 32 second level classes before it searches, a pool of
+      // exactly the requested size wouldn't serve it.
+      required_size += (required_size >> 5) + tlsf_pool_overhead() + tlsf_alloc_overhead();
+
+      const size_t pool_size = GrowthPolicy::next_pool_size(pools_[pool_count_ - 1].size, required_size);
+      auto* memory = allocate_pool_memory(pool_size);
+
+      if (memory == nullptr)
+      {
+        return false;
+      }
+
+      auto pool = tlsf_add_pool(service_data_, memory, pool_size);
+
+      if (pool == nullptr)
+      {
+        common::free_pages(memory, pool_size);
+        return false;
+      }
+
+      pools_[pool_count_++] = { memory, pool_size, pool };
+      return true;
+    }
+
+    void walk_pools(EFI_SAMPLE_HEAP_STATISTICS& statistics) noexcept override
+    {
+      typename Locking::guard _{ &lock_ };
+
+      for (uint32_t j = 0; j < pool_count_; j++)
+      {
+        tlsf_walk_pool(pools_[j].pool, accumulate_block, &statistics);
+      }
+
+      buddy_.accumulate(statistics);
+    }
+
+    // Alignments up to the TLSF granularity go through tlsf_malloc.
+    void* allocate_from_pools(size_t allocation_size, size_t align) noexcept
+    {
+      return align > tlsf_align_size() ? tlsf_memalign(service_data_, align, allocation_size) : tlsf_malloc(service_data_, allocation_size);
+    }
+
+    void* allocate_locked(size_t allocation_size, size_t align) noexcept
+    {
+      if constexpr (UseSlabCache)
+      {
+        if (slab_cache::is_small(allocation_size) && align <= slab_cache::object_alignment)
+        {
+          if (auto* ptr = slab_.allocate(allocation_size, service_data_); ptr != nullptr)
+          {
+            record_allocation(ptr, allocation_size, slab_cache::slot_size_for(allocation_size), align);
+            return ptr;
+          }
+        }
+      }
+
+      if constexpr (UsePageBuddy)
+      {
+        const size_t block_size = allocation_size > align ? allocation_size : align;
+
+        if (align >= common::page_size && buddy_allocator::fits(block_size))
+        {
+          if (auto* ptr = buddy_.allocate(block_size); ptr != nullptr)
+          {
+            record_allocation(ptr, allocation_size, buddy_.block_size(ptr), align);
+            return ptr;
+          }
+        }
+      }
+
+      const bool is_aligned = align > tlsf_align_size();
+      auto* ptr = allocate_from_pools(allocation_size, align);
+
+      if constexpr (FreeBatchSize != 0)
+      {
+        // The deferred frees of this processor may be enough to serve the request.
+        if (ptr == nullptr && drain_batch_locked(common::current_processor()))
+        {
+          ptr = allocate_from_pools(allocation_size, align);
+        }
+      }
+
+      if (ptr == nullptr && grow(is_aligned ? allocation_size + align * 2 : allocation_size))
+      {
+        ptr = allocate_from_pools(allocation_size, align);
+      }
+
+      if (ptr == nullptr)
+      {
+        return nullptr;
+      }
+
+      record_allocation(ptr, allocation_size, tlsf_block_size(ptr), align);
+      return ptr;
+    }
+
+    // The reclaimers free blocks, so they run after the lock is released.
+    void* allocate_or_reclaim(size_t allocation_size, size_t align) noexcept
+    {
+      auto attempt = [&]
+        {
+          typename Locking::guard _{ &lock_ };
+          return allocate_locked(allocation_size, align);
+        };
+
+      if (auto* ptr = attempt(); ptr != nullptr) [[likely]]
+      {
+        return ptr;
+      }
+
+      return reclaim_and_retry(allocation_size, attempt);
+    }
+
+    // Blocks bigger than slab_cache::max_object_size never come from the slab, a known size lets them
+    // skip the region lookup. 0 means the size is unknown.
+    void deallocate_locked(void* ptr_to_allocation, size_t allocation_size = 0, uint32_t processor = common::current_processor()) noexcept
+    {
+      if constexpr (UseSlabCache)
+      {
+        if (slab_cache::is_small(allocation_size) && slab_.owns(ptr_to_allocation))
+        {
+          record_deallocation(ptr_to_allocation, slab_.deallocate(ptr_to_allocation), processor);
+          return;
+        }
+      }
+
+      if constexpr (UsePageBuddy)
+      {
+        if (buddy_.owns(ptr_to_allocation))
+        {
+          record_deallocation(ptr_to_allocation, buddy_.deallocate(ptr_to_allocation), processor);
+          return;
+        }
+      }
+
+      record_deallocation(ptr_to_allocation, tlsf_block_size(ptr_to_allocation), processor);
+      tlsf_free(service_data_, ptr_to_allocation);
+    }
+
+    // Must be called under the heap lock. Returns false if the batch was empty.
+    bool drain_batch_locked(uint32_t processor) noexcept
+    {
+      auto& batch = batches_[processor];
+      common::spinlock_guard _{ &batch.lock };
+
+      for (uint32_t j = 0; j < batch.count; j++)
+      {
+        deallocate_locked(batch.blocks[j], batch.sizes[j], processor);
+      }
+
+      const bool drained = batch.count != 0;
+      batch.count = 0;
+
+      return drained;
+    }
+
+    // Must be called under the heap lock.
+    void drain_batches_locked() noexcept
+    {
+      for (uint32_t j = 0; j < common::processor_count(); j++)
+      {
+        drain_batch_locked(j);
+      }
+    }
+
+    void free_block(void* ptr_to_allocation, uint32_t allocation_size) noexcept
+    {
+      if constexpr (FreeBatchSize != 0)
+      {
+        const uint32_t processor = common::current_processor();
+        auto& batch = batches_[processor];
+        void* blocks[FreeBatchSize];
+        uint32_t sizes[FreeBatchSize];
+
+        {
+          common::spinlock_guard _{ &batch.lock };
+
+          batch.blocks[batch.count] = ptr_to_allocation;
+          batch.sizes[batch.count] = allocation_size;
+
+          if (++batch.count != FreeBatchSize)
+          {
+            return;
+          }
+
+          // The full batch is moved out so that the heap lock is never taken inside the batch lock.
+          memcpy(blocks, batch.blocks, sizeof(blocks));
+          memcpy(sizes, batch.sizes, sizeof(sizes));
+          batch.count = 0;
+        }
+
+        typename Locking::guard _{ &lock_ };
+
+        for (uint32_t j = 0; j < FreeBatchSize; j++)
+        {
+          deallocate_locked(blocks[j], sizes[j], processor);
+        }
+      }
+      else
+      {
+        typename Locking::guard _{ &lock_ };
+        deallocate_locked(ptr_to_allocation, allocation_size);
+      }
+    }
+
+    bool resize_locked(void* ptr_to_allocation, size_t new_size) noexcept
+    {
+      if constexpr (UseSlabCache)
+      {
+        if (slab_.owns(ptr_to_allocation))
+        {
+          return new_size <= slab_.slot_size(ptr_to_allocation);
+        }
+      }
+
+      if constexpr (UsePageBuddy)
+      {
+        if (buddy_.owns(ptr_to_allocation))
+        {
+          return new_size <= buddy_.block_size(ptr_to_allocation);
+        }
+      }
+
+      const size_t old_block_size = tlsf_block_size(ptr_to_allocation);
+
+      if (!tlsf_realloc_in_place(service_data_, ptr_to_allocation, new_size))
+      {
+        return false;
+      }
+
+      record_resize(ptr_to_allocation, new_size, old_block_size, tlsf_block_size(ptr_to_allocation));
+      return true;
+    }
+
+    static bool is_pool_empty(pool_t pool) noexcept
+    {
+      bool has_used_blocks = false;
+
+      tlsf_walk_pool(pool, [](void*, size_t, int used, void* user)
+        {
+          *static_cast<bool*>(user) |= used != 0;
+        }, &has_used_blocks);
+
+      return !has_used_blocks;
+    }
 
   public:
-    tlsf_allocator() : service_data_{}, pool_size_{ DefaultSize }, pool_ptr_{}
+    tlsf_allocator() : service_data_{}, pools_{}, pool_count_{}, slab_{}, buddy_{}, batches_{}, lock_{}
     {
-      auto result = gBS->AllocatePool(EfiRuntimeServicesData, pool_size_, &pool_ptr_);
+      create_heap(GrowthPolicy::initial_size);
+    }
 
-      if (EFI_ERROR(result))
+    tlsf_allocator(size_t pool_size) : service_data_{}, pools_{}, pool_count_{}, slab_{}, buddy_{}, batches_{}, lock_{}
+    {
+      create_heap(pool_size);
+    }
+
+    void* allocate(uint32_t allocation_size) noexcept override
+    {
+      return allocate_or_reclaim(allocation_size, 0);
+    }
+
+    void* allocate_align(uint32_t allocation_size, std::align_val_t align) noexcept override
+    {
+      return allocate_or_reclaim(allocation_size, static_cast<size_t>(align));
+    }
+
+    void deallocate(void* ptr_to_allocation) noexcept override
+    {
+      free_block(ptr_to_allocation, 0);
+    }
+
+    void deallocate_sized(void* ptr_to_allocation, uint32_t allocation_size) noexcept override
+    {
+      free_block(ptr_to_allocation, allocation_size);
+    }
+
+    bool try_expand_in_place(void* ptr_to_allocation, uint32_t new_size) noexcept override
+    {
+      typename Locking::guard _{ &lock_ };
+      return resize_locked(ptr_to_allocation, new_size);
+    }
+
+    // Whole operation runs under one lock acquisition, TLSF absorbs the next free block when it can.
+    // Only a move that needs the reclaimers takes the lock again.
+    void* reallocate(void* ptr_to_allocation, uint32_t old_size, uint32_t new_size) noexcept override
+    {
+      if (ptr_to_allocation == nullptr)
       {
-        throw std::exception{ "Failed to allocate pool for memory manager." };
+        return allocate_or_reclaim(new_size, 0);
       }
 
-      service_data_ = tlsf_create_with_pool(pool_ptr_, pool_size_);
+      const uint32_t copy_size = old_size < new_size ? old_size : new_size;
+
+      {
+        typename Locking::guard _{ &lock_ };
+
+        if (resize_locked(ptr_to_allocation, new_size))
+        {
+          return ptr_to_allocation;
+        }
+
+        if (auto* new_ptr = allocate_locked(new_size, 0); new_ptr != nullptr)
+        {
+          memcpy(new_ptr, ptr_to_allocation, copy_size);
+          deallocate_locked(ptr_to_allocation, old_size);
+          return new_ptr;
+        }
+      }
+
+      auto* new_ptr = reclaim_and_retry(new_size, [&]
+        {
+          typename Locking::guard _{ &lock_ };
+          return allocate_locked(new_size, 0);
+        });
+
+      if (new_ptr != nullptr)
+      {
+        memcpy(new_ptr, ptr_to_allocation, copy_size);
+        free_block(ptr_to_allocation, old_size);
+      }
+
+      return new_ptr;
+    }
+
+    // Drains the batches of every processor.
+    void flush() noexcept override
+    {
+      if constexpr (FreeBatchSize != 0)
+      {
+        typename Locking::guard _{ &lock_ };
+        drain_batches_locked();
+      }
+    }
+
+    // Gives pools and buddy chunks without live blocks back to firmware. The first pool holds the TLSF
+    // control structure and is never released.
+    void trim() noexcept override
+    {
+      if constexpr (GrowthPolicy::release_empty_pools)
+      {
+        flush();
+
+        typename Locking::guard _{ &lock_ };
+
+        if (!globals::boot_state || !common::is_bootstrap_processor())
+        {
+          return;
+        }
+
+        uint32_t kept_count = 1;
+
+        for (uint32_t j = 1; j < pool_count_; j++)
+        {
+          if (is_pool_empty(pools_[j].pool))
+          {
+            tlsf_remove_pool(service_data_, pools_[j].pool);
+            common::free_pages(pools_[j].memory, pools_[j].size);
+            continue;
+          }
+
+          pools_[kept_count++] = pools_[j];
+        }
+
+        pool_count_ = kept_count;
+        buddy_.trim();
+      }
+    }
+
+    ~tlsf_allocator() noexcept override
+    {
+      // The deferred frees still have to reach the tags, traces and profiles.
+      flush();
+
+      if (globals::boot_state)
+      {
+        for (uint32_t j = 0; j < pool_count_; j++)
+        {
+          common::free_pages(pools_[j].memory, pools_[j].size);
+        }
+      }
+    }
+  };
+
+  // TLSF allocator with a private heap per processor. Only the owner works with its heap, so allocations
+  // don't contend with other CPUs. A block freed by a foreign processor is pushed onto the lock-free
+  // queue of its owner and goes back to TLSF when the owner allocates next time or on flush().
+  // The capacity is fixed: every processor gets a ProcessorHeapSize slice of one AllocatePool made by the
+  // constructor and, unlike tlsf_allocator, the heaps never grow. Once a processor's slice is full its
+  // allocations fail after the reclaimers ran, even if the slices of other processors are empty.
+  template<size_t ProcessorHeapSize = common::page_size * 2048>
+  class per_cpu_tlsf_allocator : public memory_manager
+  {
+  private:
+    struct alignas(64) processor_heap
+    {
+      tlsf_t service_data;
+      // Taken by the owning processor and by flush() and walk_pools(), guards against processors sharing
+      // the fallback slot.
+      volatile long lock;
+      // Intrusive MPSC list, the first pointer-sized word of a freed block links to the next one.
+      void* volatile remote_frees;
+    };
+
+    processor_heap heaps_[common::max_processors];
+    uint32_t heap_count_;
+    size_t pool_size_;
+    uint8_t* pool_ptr_;
+
+  private:
+    // Heap whose pool holds ptr. Freeing a block of another allocator is a bug, it stops the machine.
+    processor_heap& heap_of(const void* ptr) noexcept
+    {
+      // Pointers below the pool wrap around to big offsets.
+      const size_t offset = reinterpret_cast<uintptr_t>(ptr) - reinterpret_cast<uintptr_t>(pool_ptr_);
+
+      if (offset >= ProcessorHeapSize * heap_count_) [[unlikely]]
+      {
+        bug_check(bug_check_codes::invalid_cruntime_parameter, reinterpret_cast<uint64_t>(ptr));
+      }
+
+      return heaps_[offset / ProcessorHeapSize];
+    }
+
+    static void push_remote_free(processor_heap& heap, void* ptr) noexcept
+    {
+      auto* link = static_cast<void**>(ptr);
+      void* head;
+
+      do
+      {
+        head = heap.remote_frees;
+        *link = head;
+      } while (_InterlockedCompareExchangePointer(&heap.remote_frees, ptr, head) != head);
+    }
+
+    // Must be called under the heap lock.
+    static void drain_remote_frees(processor_heap& heap) noexcept
+    {
+      if (heap.remote_frees == nullptr)
+      {
+        return;
+      }
+
+      void* block = _InterlockedExchangePointer(&heap.remote_frees, nullptr);
+
+      while (block != nullptr)
+      {
+        void* next = *static_cast<void**>(block);
+        tlsf_free(heap.service_data, block);
+        block = next;
+      }
+    }
+
+    // Runs on the calling processor's heap, the reclaimers run after its lock is released.
+    template<class Allocate>
+    void* allocate_or_reclaim(size_t allocation_size, size_t align, Allocate&& allocate_block) noexcept
+    {
+      auto attempt = [&]() -> void*
+        {
+          auto& heap = heaps_[common::current_processor()];
+          common::spinlock_guard _{ &heap.lock };
+
+          drain_remote_frees(heap);
+          auto* ptr = allocate_block(heap.service_data);
+
+          if (ptr != nullptr)
+          {
+            record_allocation(ptr, allocation_size, tlsf_block_size(ptr), align);
+          }
+
+          return ptr;
+        };
+
+      if (auto* ptr = attempt(); ptr != nullptr) [[likely]]
+      {
+        return ptr;
+      }
+
+      return reclaim_and_retry(allocation_size, attempt);
+    }
+
+    void walk_pools(EFI_SAMPLE_HEAP_STATISTICS& statistics) noexcept override
+    {
+      for (uint32_t j = 0; j < heap_count_; j++)
+      {
+        common::spinlock_guard _{ &heaps_[j].lock };
+        tlsf_walk_pool(tlsf_get_pool(heaps_[j].service_data), accumulate_block, &statistics);
+      }
     }
 
-    tlsf_allocator(size_t pool_size) : service_data_{}, pool_size_{ pool_size }, pool_ptr_{}
+  public:
+    per_cpu_tlsf_allocator() : heaps_{}, heap_count_{ common::processor_count() }, pool_size_{}, pool_ptr_{}
     {
-      auto result = gBS->AllocatePool(EfiRuntimeServicesData, pool_size_, &pool_ptr_);
+      pool_size_ = ProcessorHeapSize * heap_count_;
+      auto result = gBS->AllocatePool(EfiRuntimeServicesData, pool_size_, reinterpret_cast<void**>(&pool_ptr_));
 
       if (EFI_ERROR(result))
       {
-        throw std::exception{ __FUNCTION__": ""Failed to allocate pool for memory manager." };
+        throw std::bad_alloc{};
       }
 
-      service_data_ = tlsf_create_with_pool(pool_ptr_, pool_size_);
+      for (uint32_t j = 0; j < heap_count_; j++)
+      {
+        heaps_[j].service_data = tlsf_create_with_pool(pool_ptr_ + ProcessorHeapSize * j, ProcessorHeapSize);
+      }
     }
 
     void* allocate(uint32_t allocation_size) noexcept override
     {
-      common::spinlock_guard _{ &spinlock_ };
-      return tlsf_malloc(service_data_, allocation_size);
+      return allocate_or_reclaim(allocation_size, 0, [&](tlsf_t service_data)
+        {
+          return tlsf_malloc(service_data, allocation_size);
+        });
     }
 
     void* allocate_align(uint32_t allocation_size, std::align_val_t align) noexcept override
     {
-      common::spinlock_guard _{ &spinlock_ };
-      return tlsf_memalign(service_data_, static_cast<size_t>(align), allocation_size);
+      return allocate_or_reclaim(allocation_size, static_cast<size_t>(align), [&](tlsf_t service_data)
+        {
+          return tlsf_memalign(service_data, static_cast<size_t>(align), allocation_size);
+        });
     }
 
     void deallocate(void* ptr_to_allocation) noexcept override
     {
-      common::spinlock_guard _{ &spinlock_ };
-      tlsf_free(service_data_, ptr_to_allocation);
+      if (ptr_to_allocation == nullptr)
+      {
+        return;
+      }
+
+      auto& owner = heap_of(ptr_to_allocation);
+
+      record_deallocation(ptr_to_allocation, tlsf_block_size(ptr_to_allocation));
+
+      if (&owner != &heaps_[common::current_processor()])
+      {
+        push_remote_free(owner, ptr_to_allocation);
+        return;
+      }
+
+      common::spinlock_guard _{ &owner.lock };
+      tlsf_free(owner.service_data, ptr_to_allocation);
     }
 
-    ~tlsf_allocator() noexcept override
+    // Only the owner may touch its heap, blocks of other processors are never resized in place.
+    bool try_expand_in_place(void* ptr_to_allocation, uint32_t new_size) noexcept override
+    {
+      auto& owner = heap_of(ptr_to_allocation);
+
+      if (&owner != &heaps_[common::current_processor()])
+      {
+        return false;
+      }
+
+      common::spinlock_guard _{ &owner.lock };
+      const size_t old_block_size = tlsf_block_size(ptr_to_allocation);
+
+      if (!tlsf_realloc_in_place(owner.service_data, ptr_to_allocation, new_size))
+      {
+        return false;
+      }
+
+      record_resize(ptr_to_allocation, new_size, old_block_size, tlsf_block_size(ptr_to_allocation));
+      return true;
+    }
+
+    // Gives the blocks freed by foreign processors back to every heap, not only the caller's.
+    void flush() noexcept override
+    {
+      for (uint32_t j = 0; j < heap_count_; j++)
+      {
+        common::spinlock_guard _{ &heaps_[j].lock };
+        drain_remote_frees(heaps_[j]);
+      }
+    }
+
+    // The heaps share one pool that can't shrink, the remote frees are drained at least.
+    void trim() noexcept override
+    {
+      flush();
+    }
+
+    ~per_cpu_tlsf_allocator() noexcept override
     {
       if (globals::boot_state)
       {
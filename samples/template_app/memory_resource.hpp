@@ -0,0 +1,82 @@
+#pragma once
+#include "memory_manager.hpp"
+#include <memory_resource>
+#include <type_traits>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+
+namespace hh
+{
+  // std::pmr::memory_resource over a heap, so a container can get its own heap without replacing
+  // the global operator new:
+  //
+  //   arena_allocator arena{ *globals::mem_manager };
+  //   heap_resource resource{ arena };
+  //   std::pmr::map<uint32_t, uint32_t> map{ &resource };
+  //
+  // With a concrete allocator type the calls don't go through the vtable. std::pmr::monotonic_buffer_resource
+  // and std::pmr::unsynchronized_pool_resource can use it as their upstream, synchronized_pool_resource
+  // needs a mutex the CRT doesn't have. Without RTTI two resources are equal only if they are the same object.
+  template<class Heap = memory_manager>
+  class heap_resource final : public std::pmr::memory_resource
+  {
+    static_assert(std::is_base_of_v<memory_manager, Heap>);
+
+  private:
+    Heap& heap_;
+
+  private:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+      if (bytes > UINT32_MAX)
+      {
+        throw std::bad_alloc{};
+      }
+
+      void* ptr = nullptr;
+      const auto size = static_cast<uint32_t>(bytes);
+
+      if constexpr (std::is_same_v<Heap, memory_manager>)
+      {
+        ptr = alignment > alignof(std::max_align_t) ? heap_.allocate_align(size, std::align_val_t{ alignment }) : heap_.allocate(size);
+      }
+      else
+      {
+        ptr = alignment > alignof(std::max_align_t) ? heap_.Heap::allocate_align(size, std::align_val_t{ alignment }) : heap_.Heap::allocate(size);
+      }
+
+      if (ptr == nullptr)
+      {
+        throw std::bad_alloc{};
+      }
+
+      return ptr;
+    }
+
+    void do_deallocate(void* ptr, size_t bytes, [[maybe_unused]] size_t alignment) override
+    {
+      if constexpr (std::is_same_v<Heap, memory_manager>)
+      {
+        heap_.deallocate_sized(ptr, static_cast<uint32_t>(bytes));
+      }
+      else
+      {
+        heap_.Heap::deallocate_sized(ptr, static_cast<uint32_t>(bytes));
+      }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+      return this == &other;
+    }
+
+  public:
+    explicit heap_resource(Heap& heap) noexcept : heap_{ heap } {}
+
+    Heap& heap() const noexcept
+    {
+      return heap_;
+    }
+  };
+}
@@ -0,0 +1,238 @@
+#pragma once
+#include "globals.hpp"
+#include "task_scheduler.hpp"
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <cstddef>
+
+// Parallel algorithms over random access ranges, run as tasks of globals::scheduler. The range is split in halves
+// until a piece has at most grain elements, the halves run on whichever processors steal them. Without the
+// scheduler a call on the BSP borrows the idle APs through MP services for its duration. Calls run serially on
+// the caller when MP services weren't found, when the APs are busy and on APs.
+//
+// The functions run on APs: they must not use boot services and must not throw.
+namespace hh::parallel
+{
+  // Elements a piece has at most when the caller doesn't choose. A piece should take a few microseconds,
+  // much more than spawning and stealing it.
+  constexpr size_t default_grain = 16384;
+
+  namespace detail
+  {
+    // Scheduler a call runs on, nullptr when it runs serially. A scheduler started for the call parks the APs
+    // until the call returns.
+    class call_scheduler : non_relocatable
+    {
+    private:
+      task_scheduler* scheduler_ = nullptr;
+      std::optional<task_scheduler> borrowed_;
+
+    public:
+      call_scheduler(size_t count, size_t grain) noexcept
+      {
+        if (count <= grain)
+        {
+          return;
+        }
+
+        if (auto* scheduler = globals::scheduler; scheduler != nullptr)
+        {
+          scheduler_ = scheduler->concurrency() > 1 ? scheduler : nullptr;
+          return;
+        }
+
+        if (!globals::boot_state || common::processor_count() < 2 || !common::is_bootstrap_processor()
+          || !common::application_processors_idle())
+        {
+          return;
+        }
+
+        borrowed_.emplace();
+        scheduler_ = borrowed_->start() ? &*borrowed_ : nullptr;
+      }
+
+      task_scheduler* get() const noexcept
+      {
+        return scheduler_;
+      }
+    };
+
+    // Calls body(begin, end) for pieces of [begin, end) of at most grain elements.
+    template<class Body>
+    void split(task_scheduler& scheduler, size_t begin, size_t end, size_t grain, const Body& body) noexcept
+    {
+      if (end - begin <= grain)
+      {
+        body(begin, end);
+        return;
+      }
+
+      const size_t middle = begin + (end - begin) / 2;
+      task_group group;
+      auto upper = [&] { split(scheduler, middle, end, grain, body); };
+
+      scheduler.spawn(group, &upper);
+      split(scheduler, begin, middle, grain, body);
+      scheduler.wait(group);
+    }
+
+    template<class Iterator, class T, class Op>
+    T reduce_piece(Iterator first, size_t begin, size_t end, Op& op) noexcept
+    {
+      T result = first[begin];
+
+      for (size_t j = begin + 1; j < end; j++)
+      {
+        result = op(result, first[j]);
+      }
+
+      return result;
+    }
+
+    // Like split, but every level combines the results of its halves in order. begin < end.
+    template<class Iterator, class T, class Op>
+    T reduce(task_scheduler& scheduler, Iterator first, size_t begin, size_t end, size_t grain, Op& op) noexcept
+    {
+      if (end - begin <= grain)
+      {
+        return reduce_piece<Iterator, T>(first, begin, end, op);
+      }
+
+      const size_t middle = begin + (end - begin) / 2;
+      task_group group;
+      T upper_result{};
+      auto upper = [&] { upper_result = reduce<Iterator, T>(scheduler, first, middle, end, grain, op); };
+
+      scheduler.spawn(group, &upper);
+      T lower_result = reduce<Iterator, T>(scheduler, first, begin, middle, grain, op);
+      scheduler.wait(group);
+
+      return op(lower_result, upper_result);
+    }
+
+    // Quicksort whose halves run as tasks. A bad run of pivots ends in std::sort of the piece once depth runs out.
+    template<class Iterator, class Compare>
+    void sort(task_scheduler& scheduler, Iterator first, Iterator last, size_t grain, Compare& compare, uint32_t depth) noexcept
+    {
+      using value_type = typename std::iterator_traits<Iterator>::value_type;
+
+      if (static_cast<size_t>(last - first) <= grain || depth == 0)
+      {
+        std::sort(first, last, compare);
+        return;
+      }
+
+      const auto middle = first + (last - first) / 2;
+      const auto& a = *first;
+      const auto& b = *middle;
+      const auto& c = *(last - 1);
+      // Median of three.
+      const value_type pivot = compare(a, b) ? (compare(b, c) ? b : (compare(a, c) ? c : a)) : (compare(a, c) ? a : (compare(b, c) ? c : b));
+
+      // [first, lower) is less than the pivot, [lower, upper) equal to it, so neither half can be the whole range.
+      const auto lower = std::partition(first, last, [&](const auto& elem) { return compare(elem, pivot); });
+      const auto upper = std::partition(lower, last, [&](const auto& elem) { return !compare(pivot, elem); });
+      task_group group;
+      auto upper_half = [&] { sort(scheduler, upper, last, grain, compare, depth - 1); };
+
+      scheduler.spawn(group, &upper_half);
+      sort(scheduler, first, lower, grain, compare, depth - 1);
+      scheduler.wait(group);
+    }
+  }
+
+  template<class Iterator, class Function>
+  void for_each(Iterator first, Iterator last, Function function, size_t grain = default_grain) noexcept
+  {
+    const auto count = static_cast<size_t>(last - first);
+    const detail::call_scheduler call{ count, grain };
+    auto* scheduler = call.get();
+
+    if (scheduler == nullptr)
+    {
+      std::for_each(first, last, function);
+      return;
+    }
+
+    detail::split(*scheduler, 0, count, grain, [first, &function](size_t begin, size_t end)
+      {
+        for (size_t j = begin; j < end; j++)
+        {
+          function(first[j]);
+        }
+      });
+  }
+
+  // out may be first, the elements are transformed in place then. Returns the end of the output.
+  template<class InputIterator, class OutputIterator, class Op>
+  OutputIterator transform(InputIterator first, InputIterator last, OutputIterator out, Op op, size_t grain = default_grain) noexcept
+  {
+    const auto count = static_cast<size_t>(last - first);
+    const detail::call_scheduler call{ count, grain };
+    auto* scheduler = call.get();
+
+    if (scheduler == nullptr)
+    {
+      return std::transform(first, last, out, op);
+    }
+
+    detail::split(*scheduler, 0, count, grain, [first, out, &op](size_t begin, size_t end)
+      {
+        for (size_t j = begin; j < end; j++)
+        {
+          out[j] = op(first[j]);
+        }
+      });
+
+    return out + count;
+  }
+
+  // op must be associative, the elements are combined in order but grouped differently than in a serial loop.
+  template<class Iterator, class T, class Op = std::plus<>>
+  T reduce(Iterator first, Iterator last, T init, Op op = {}, size_t grain = default_grain) noexcept
+  {
+    const auto count = static_cast<size_t>(last - first);
+
+    if (count == 0)
+    {
+      return init;
+    }
+
+    const detail::call_scheduler call{ count, grain };
+    auto* scheduler = call.get();
+
+    if (scheduler == nullptr)
+    {
+      return op(init, detail::reduce_piece<Iterator, T>(first, 0, count, op));
+    }
+
+    return op(init, detail::reduce<Iterator, T>(*scheduler, first, 0, count, grain, op));
+  }
+
+  // Not stable.
+  template<class Iterator, class Compare = std::less<>>
+  void sort(Iterator first, Iterator last, Compare compare = {}, size_t grain = default_grain) noexcept
+  {
+    const auto count = static_cast<size_t>(last - first);
+    const detail::call_scheduler call{ count, grain };
+    auto* scheduler = call.get();
+
+    if (scheduler == nullptr)
+    {
+      std::sort(first, last, compare);
+      return;
+    }
+
+    // Twice the depth of a balanced split, like introsort.
+    uint32_t depth = 0;
+
+    for (size_t pieces = count / grain; pieces != 0; pieces /= 2)
+    {
+      depth += 2;
+    }
+
+    detail::sort(*scheduler, first, last, grain, compare, depth);
+  }
+}
@@ -0,0 +1,249 @@
+#pragma once
+#include "delete_constructors.hpp"
+#include "common.hpp"
+#include "tlsf.h"
+#include <cstdint>
+#include <new>
+
+namespace hh
+{
+  // Size-segregated front-end for small objects. Whole pages are carved from the owner's TLSF heap
+  // and split into equal slots, so a small allocation is a free list pop without a per-object header.
+  // The cache has no lock of its own, the owning allocator serializes the calls.
+  class slab_cache : non_relocatable
+  {
+  public:
+    static constexpr uint32_t max_object_size = 256;
+    static constexpr uint32_t object_alignment = 16;
+
+  private:
+    static constexpr uint32_t class_count = 12;
+    static constexpr uint32_t class_sizes_[class_count] = { 16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256 };
+    static constexpr uint8_t class_of_[max_object_size / object_alignment + 1] =
+    {
+      0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+    };
+
+    // Region is taken from TLSF in one piece. Its first page holds the page descriptors.
+    static constexpr uint32_t region_pages = 64;
+    static constexpr uint32_t region_size = region_pages * common::page_size;
+    static constexpr uint32_t max_regions = 16;
+
+    struct page_descriptor
+    {
+      void* free_slots;
+      // Links in the partial list of a size class or in the list of unused pages.
+      page_descriptor* next;
+      page_descriptor* prev;
+      uint16_t used_slots;
+      uint8_t size_class;
+    };
+
+    struct region_header
+    {
+      page_descriptor pages[region_pages];
+    };
+
+    static_assert(sizeof(region_header) <= common::page_size);
+
+    uint8_t* regions_[max_regions];
+    uint32_t region_count_;
+    page_descriptor* partial_pages_[class_count];
+    page_descriptor* unused_pages_;
+
+  private:
+    static void unlink(page_descriptor*& list_head, page_descriptor* page) noexcept
+    {
+      if (page->prev != nullptr)
+      {
+        page->prev->next = page->next;
+      }
+      else
+      {
+        list_head = page->next;
+      }
+
+      if (page->next != nullptr)
+      {
+        page->next->prev = page->prev;
+      }
+
+      page->next = nullptr;
+      page->prev = nullptr;
+    }
+
+    static void push_front(page_descriptor*& list_head, page_descriptor* page) noexcept
+    {
+      page->prev = nullptr;
+      page->next = list_head;
+
+      if (list_head != nullptr)
+      {
+        list_head->prev = page;
+      }
+
+      list_head = page;
+    }
+
+    uint8_t* region_of(const void* ptr) const noexcept
+    {
+      const auto* address = static_cast<const uint8_t*>(ptr);
+
+      for (uint32_t j = 0; j < region_count_; j++)
+      {
+        if (address >= regions_[j] && address < regions_[j] + region_size)
+        {
+          return regions_[j];
+        }
+      }
+
+      return nullptr;
+    }
+
+    static page_descriptor& descriptor_of(uint8_t* region, const void* ptr) noexcept
+    {
+      const auto page_index = static_cast<size_t>(static_cast<const uint8_t*>(ptr) - region) / common::page_size;
+      return reinterpret_cast<region_header*>(region)->pages[page_index];
+    }
+
+    static uint8_t* page_address(uint8_t* region, const page_descriptor& page) noexcept
+    {
+      const auto page_index = &page - reinterpret_cast<region_header*>(region)->pages;
+      return region + page_index * common::page_size;
+    }
+
+    bool add_region(tlsf_t heap) noexcept
+    {
+      if (region_count_ == max_regions)
+      {
+        return false;
+      }
+
+      auto* region = static_cast<uint8_t*>(tlsf_memalign(heap, common::page_size, region_size));
+
+      if (region == nullptr)
+      {
+        return false;
+      }
+
+      auto* header = new (region) region_header{};
+
+      // Page 0 is the header itself.
+      for (uint32_t j = region_pages - 1; j > 0; j--)
+      {
+        push_front(unused_pages_, &header->pages[j]);
+      }
+
+      regions_[region_count_++] = region;
+      return true;
+    }
+
+    page_descriptor* assign_page(uint8_t size_class, tlsf_t heap) noexcept
+    {
+      if (unused_pages_ == nullptr && !add_region(heap))
+      {
+        return nullptr;
+      }
+
+      auto* page = unused_pages_;
+      unlink(unused_pages_, page);
+
+      // The page address is recovered from the region that contains the descriptor.
+      auto* region = region_of(page);
+      auto* slot = page_address(region, *page);
+      const uint32_t slot_size = class_sizes_[size_class];
+      const uint32_t slot_count = common::page_size / slot_size;
+
+      page->free_slots = slot;
+      page->used_slots = 0;
+      page->size_class = size_class;
+
+      for (uint32_t j = 0; j < slot_count - 1; j++, slot += slot_size)
+      {
+        *reinterpret_cast<void**>(slot) = slot + slot_size;
+      }
+
+      *reinterpret_cast<void**>(slot) = nullptr;
+
+      push_front(partial_pages_[size_class], page);
+      return page;
+    }
+
+  public:
+    slab_cache() noexcept : regions_{}, region_count_{}, partial_pages_{}, unused_pages_{} {}
+
+    static constexpr bool is_small(size_t allocation_size) noexcept
+    {
+      return allocation_size <= max_object_size;
+    }
+
+    static constexpr size_t slot_size_for(size_t allocation_size) noexcept
+    {
+      return class_sizes_[class_of_[(allocation_size + object_alignment - 1) / object_alignment]];
+    }
+
+    // Returns nullptr when TLSF has no room for a new region, the caller should fall back to TLSF then.
+    void* allocate(size_t allocation_size, tlsf_t heap) noexcept
+    {
+      const uint8_t size_class = class_of_[(allocation_size + object_alignment - 1) / object_alignment];
+      auto* page = partial_pages_[size_class];
+
+      if (page == nullptr)
+      {
+        page = assign_page(size_class, heap);
+
+        if (page == nullptr)
+        {
+          return nullptr;
+        }
+      }
+
+      void* slot = page->free_slots;
+      page->free_slots = *static_cast<void**>(slot);
+      page->used_slots++;
+
+      if (page->free_slots == nullptr)
+      {
+        unlink(partial_pages_[size_class], page);
+      }
+
+      return slot;
+    }
+
+    bool owns(const void* ptr) const noexcept
+    {
+      return region_of(ptr) != nullptr;
+    }
+
+    // Pointer must belong to the cache. Returns the size of the released slot.
+    size_t deallocate(void* ptr) noexcept
+    {
+      auto& page = descriptor_of(region_of(ptr), ptr);
+      const bool was_full = page.free_slots == nullptr;
+
+      *static_cast<void**>(ptr) = page.free_slots;
+      page.free_slots = ptr;
+      page.used_slots--;
+
+      if (was_full)
+      {
+        push_front(partial_pages_[page.size_class], &page);
+      }
+      // Keep the last partial page of a class to avoid thrashing on alloc/free pairs.
+      else if (page.used_slots == 0 && (page.prev != nullptr || page.next != nullptr))
+      {
+        unlink(partial_pages_[page.size_class], &page);
+        push_front(unused_pages_, &page);
+      }
+
+      return class_sizes_[page.size_class];
+    }
+
+    // Size of the slot that backs the pointer. Pointer must belong to the cache.
+    size_t slot_size(const void* ptr) const noexcept
+    {
+      const auto& page = descriptor_of(region_of(ptr), ptr);
+      return class_sizes_[page.size_class];
+    }
+  };
+}
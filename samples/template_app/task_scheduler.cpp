@@ -0,0 +1,215 @@
+#include "task_scheduler.hpp"
+#include <intrin.h>
+#include <cstring>
+
+namespace hh
+{
+  // Pauses an idle worker waits at most between two looks for work.
+  static constexpr uint32_t max_idle_wait = 1024;
+
+  task_scheduler::task_scheduler() noexcept
+    : deques_{}, deque_count_{ common::processor_count() }, stopping_{}, started_{}
+  {
+    deques_ = static_cast<worker_deque*>(common::allocate_pages(sizeof(worker_deque) * deque_count_));
+
+    if (deques_ == nullptr)
+    {
+      deque_count_ = 0;
+      return;
+    }
+
+    memset(deques_, 0, sizeof(worker_deque) * deque_count_);
+  }
+
+  task_scheduler::~task_scheduler() noexcept
+  {
+    stop();
+
+    if (deques_ != nullptr)
+    {
+      common::free_pages(deques_, sizeof(worker_deque) * deque_count_);
+    }
+  }
+
+  bool task_scheduler::start() noexcept
+  {
+    if (started_ || deque_count_ < 2)
+    {
+      return started_;
+    }
+
+    stopping_ = 0;
+    started_ = common::park_application_processors(worker_procedure, this);
+
+    return started_;
+  }
+
+  void task_scheduler::stop() noexcept
+  {
+    if (!started_)
+    {
+      return;
+    }
+
+    // Tasks nobody waits for, like zero page pool refills, still run: the workers only return once they find
+    // no task left.
+    while (run_one(common::current_processor()))
+    {
+    }
+
+    _InterlockedExchange(&stopping_, 1);
+    common::unpark_application_processors();
+    started_ = false;
+  }
+
+  bool task_scheduler::push(worker_deque& deque, const task& new_task) noexcept
+  {
+    const long long bottom = deque.bottom;
+
+    if (bottom - deque.top >= deque_capacity)
+    {
+      return false;
+    }
+
+    deque.tasks[bottom & (deque_capacity - 1)] = new_task;
+    // x86 doesn't reorder stores with other stores, a thief that sees the new bottom sees the task.
+    _ReadWriteBarrier();
+    deque.bottom = bottom + 1;
+
+    return true;
+  }
+
+  bool task_scheduler::pop(worker_deque& deque, task& result) noexcept
+  {
+    const long long bottom = deque.bottom - 1;
+
+    deque.bottom = bottom;
+    // The store to bottom must be visible before top is read, or a thief and the owner could both take the last task.
+    _mm_mfence();
+
+    long long top = deque.top;
+
+    if (top > bottom)
+    {
+      deque.bottom = top;
+      return false;
+    }
+
+    result = deque.tasks[bottom & (deque_capacity - 1)];
+
+    if (top != bottom)
+    {
+      return true;
+    }
+
+    // The last task, the owner races the thieves for it.
+    const bool won = _InterlockedCompareExchange64(&deque.top, top + 1, top) == top;
+
+    deque.bottom = top + 1;
+    return won;
+  }
+
+  bool task_scheduler::steal(worker_deque& deque, task& result) noexcept
+  {
+    const long long top = deque.top;
+    // Loads aren't reordered with other loads either.
+    _ReadWriteBarrier();
+    const long long bottom = deque.bottom;
+
+    if (top >= bottom)
+    {
+      return false;
+    }
+
+    // The slot can't be reused before top moves past it, if the CAS succeeds the copy is whole.
+    result = deque.tasks[top & (deque_capacity - 1)];
+    _ReadWriteBarrier();
+
+    return _InterlockedCompareExchange64(&deque.top, top + 1, top) == top;
+  }
+
+  void task_scheduler::run(const task& current) noexcept
+  {
+    current.procedure(current.argument);
+    _InterlockedDecrement(&current.group->pending_);
+  }
+
+  bool task_scheduler::run_one(uint32_t processor) noexcept
+  {
+    task current{};
+
+    if (pop(deques_[processor], current))
+    {
+      run(current);
+      return true;
+    }
+
+    // Victims in turn from the next processor, so thieves don't all go for the same deque.
+    for (uint32_t j = 1; j < deque_count_; j++)
+    {
+      const uint32_t victim = (processor + j) % deque_count_;
+
+      if (steal(deques_[victim], current))
+      {
+        run(current);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // Runs on every AP until stop(). Must not use boot services.
+  void task_scheduler::worker_procedure(void* scheduler)
+  {
+    auto& self = *static_cast<task_scheduler*>(scheduler);
+    const uint32_t processor = common::current_processor();
+    uint32_t wait = 1;
+
+    while (true)
+    {
+      if (self.run_one(processor))
+      {
+        wait = 1;
+        continue;
+      }
+
+      if (self.stopping_)
+      {
+        return;
+      }
+
+      for (uint32_t j = 0; j < wait; j++)
+      {
+        _mm_pause();
+      }
+
+      wait = wait < max_idle_wait ? wait * 2 : wait;
+    }
+  }
+
+  void task_scheduler::spawn(task_group& group, task_procedure procedure, void* argument) noexcept
+  {
+    const task new_task{ procedure, argument, &group };
+
+    _InterlockedIncrement(&group.pending_);
+
+    if (deques_ == nullptr || !push(deques_[common::current_processor()], new_task))
+    {
+      run(new_task);
+    }
+  }
+
+  void task_scheduler::wait(task_group& group) noexcept
+  {
+    const uint32_t processor = common::current_processor();
+
+    while (group.pending_ != 0)
+    {
+      if (deques_ == nullptr || !run_one(processor))
+      {
+        _mm_pause();
+      }
+    }
+  }
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include "delete_constructors.hpp"
+#include "common.hpp"
+#include <cstdint>
+
+namespace hh
+{
+  using task_procedure = void(*)(void* argument);
+
+  // Tasks spawned into a group that haven't finished yet. Wait for the group before it goes out of scope.
+  class task_group : non_relocatable
+  {
+  private:
+    friend class task_scheduler;
+
+    volatile long pending_ = 0;
+
+  public:
+    bool done() const noexcept
+    {
+      return pending_ == 0;
+    }
+  };
+
+  // Work-stealing scheduler over the APs. start() parks every AP in a worker loop with a single non-blocking
+  // StartupAllAPs, every processor then pushes and pops the tasks it spawns at the bottom of a Chase-Lev deque
+  // of its own, and idle processors steal from the top of the others. A processor waiting for a group runs
+  // tasks meanwhile, so tasks may spawn and wait for tasks of their own. Without APs, or before start(), the
+  // tasks run on the processor that waits for them.
+  //
+  // Tasks may run on an AP: they must not use boot services and must not throw. The workers park the APs,
+  // common::start_on_application_processors() fails while they run and stop() gives the APs back.
+  class task_scheduler : non_relocatable
+  {
+  public:
+    // Tasks spawned by a processor beyond this many pending ones run at once on the spawning processor.
+    static constexpr uint32_t deque_capacity = 4096;
+
+  private:
+    struct task
+    {
+      task_procedure procedure;
+      void* argument;
+      task_group* group;
+    };
+
+    // Only the owner touches bottom and pushes or pops there, thieves take from top with a CAS.
+    struct alignas(64) worker_deque
+    {
+      volatile long long bottom;
+      alignas(64) volatile long long top;
+      alignas(64) task tasks[deque_capacity];
+    };
+
+    worker_deque* deques_;
+    uint32_t deque_count_;
+    volatile long stopping_;
+    bool started_;
+
+  private:
+    static bool push(worker_deque& deque, const task& new_task) noexcept;
+    static bool pop(worker_deque& deque, task& result) noexcept;
+    static bool steal(worker_deque& deque, task& result) noexcept;
+    static void run(const task& current) noexcept;
+    // Runs a task of processor's own deque or one stolen from another processor. Returns false if there was none.
+    bool run_one(uint32_t processor) noexcept;
+    static void worker_procedure(void* scheduler);
+
+  public:
+    // The deques are taken with AllocatePages. Call initialize_processors() first.
+    task_scheduler() noexcept;
+    // Stops the workers.
+    ~task_scheduler() noexcept;
+
+    // Waits for the procedure the APs run now and parks them in the workers. Returns false if there are no APs.
+    // BSP only, boot services must be available.
+    bool start() noexcept;
+    // Runs the tasks still queued, then lets the workers return. BSP only, boot services must be available.
+    void stop() noexcept;
+
+    // Processors that run tasks, the calling one included.
+    uint32_t concurrency() const noexcept
+    {
+      return started_ ? deque_count_ : 1;
+    }
+
+    void spawn(task_group& group, task_procedure procedure, void* argument) noexcept;
+
+    // Calls (*function)() as a task. The function object must outlive the wait for the group.
+    template<class Function>
+    void spawn(task_group& group, Function* function) noexcept
+    {
+      spawn(group, [](void* argument) { (*static_cast<Function*>(argument))(); }, function);
+    }
+
+    // Runs tasks until every task of the group has finished.
+    void wait(task_group& group) noexcept;
+  };
+}
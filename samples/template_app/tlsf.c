@@ -1261,3 +1261,74 @@ void* tlsf_realloc(tlsf_t tlsf, void* ptr, size_t size)
 
 	return p;
 }
+
+/*
+** Resizes a used block without moving it. Shrinking always succeeds,
+** growing succeeds only when the next physical block is free and large
+** enough. Returns nonzero on success, the block is untouched otherwise.
+*/
+int tlsf_realloc_in_place(tlsf_t tlsf, void* ptr, size_t size)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	block_header_t* block = block_from_ptr(ptr);
+	block_header_t* next = block_next(block);
+
+	const size_t cursize = block_size(block);
+	const size_t combined = cursize + block_size(next) + block_header_overhead;
+	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+
+	tlsf_assert(!block_is_free(block) && "block already marked as free");
+
+	if (!adjust || (adjust > cursize && (!block_is_free(next) || adjust > combined)))
+	{
+		return 0;
+	}
+
+	if (adjust > cursize)
+	{
+		block_merge_next(control, block);
+		block_mark_as_used(block);
+	}
+
+	block_trim_used(control, block, adjust);
+	return 1;
+}
+
+/*
+** Moves a used block down into the free block that physically precedes
+** it, the payload is copied with memmove. The space left above the block
+** is merged with the next block if that one is free. Returns the new
+** address, or ptr when the previous block is used.
+*/
+void* tlsf_slide(tlsf_t tlsf, void* ptr)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	block_header_t* block = block_from_ptr(ptr);
+	block_header_t* prev;
+	size_t size;
+
+	tlsf_assert(!block_is_free(block) && "block already marked as free");
+
+	if (!block_is_prev_free(block))
+	{
+		return ptr;
+	}
+
+	prev = block_prev(block);
+	size = block_size(block);
+	tlsf_assert(block_is_free(prev) && "prev block is not free though marked as such");
+
+	/*
+	** The copy overwrites the header of the block, and linking the next
+	** block writes into the end of the payload, so the sizes are fixed up
+	** only after the copy.
+	*/
+	block_remove(control, prev);
+	memmove(block_to_ptr(prev), ptr, size);
+	block_set_size(prev, block_size(prev) + size + block_header_overhead);
+
+	block_mark_as_used(prev);
+	block_trim_used(control, prev, size);
+
+	return block_to_ptr(prev);
+}
@@ -63,6 +63,10 @@ void tlsf_remove_pool(tlsf_t tlsf, pool_t pool);
 void* tlsf_malloc(tlsf_t tlsf, size_t bytes);
 void* tlsf_memalign(tlsf_t tlsf, size_t align, size_t bytes);
 void* tlsf_realloc(tlsf_t tlsf, void* ptr, size_t size);
+/* Resizes a block without moving it, returns nonzero on success. */
+int tlsf_realloc_in_place(tlsf_t tlsf, void* ptr, size_t size);
+/* Moves a block into the free block before it, returns the new address. */
+void* tlsf_slide(tlsf_t tlsf, void* ptr);
 void tlsf_free(tlsf_t tlsf, void* ptr);
 
 /* Returns internal block size, not original request size */
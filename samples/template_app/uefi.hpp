@@ -1,5 +1,9 @@
 #pragma once
 
+#if defined(HH_HOST)
+// Host builds of the allocators (samples/host_bench) replace EDK2 with a boot services shim.
+#include "host_uefi.hpp"
+#else
 extern "C"
 {
 #include <Uefi.h>
@@ -43,3 +47,4 @@ UINTN Print(const std_wstr& str)
 
   return 0;
 }
+#endif
@@ -0,0 +1,255 @@
+#pragma once
+#include "delete_constructors.hpp"
+#include "memory_manager.hpp"
+#include "globals.hpp"
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace hh
+{
+  // Types whose objects may be moved with memcpy and abandoned at the old address. Specialize for
+  // types that are not trivially copyable but don't hold pointers into themselves.
+  template<class T>
+  struct is_trivially_relocatable : std::bool_constant<std::is_trivially_copyable_v<T>> {};
+
+  template<class T>
+  inline constexpr bool is_trivially_relocatable_v = is_trivially_relocatable<T>::value;
+
+  // Growth-aware vector on top of memory_manager. Unlike std::vector it asks the heap to extend the
+  // block first, so appending to the last block of a pool doesn't copy at all, and relocatable
+  // elements are moved by reallocate without running constructors.
+  template<class T>
+  class vector : non_copyable
+  {
+  private:
+    memory_manager* heap_;
+    T* data_;
+    uint32_t size_;
+    uint32_t capacity_;
+    uint32_t relocation_count_;
+
+  private:
+    static constexpr uint32_t max_capacity = UINT32_MAX / sizeof(T);
+
+    uint32_t next_capacity(uint32_t required) const
+    {
+      if (required > max_capacity)
+      {
+        throw std::bad_alloc{};
+      }
+
+      const uint32_t grown = capacity_ > max_capacity / 2 ? max_capacity : capacity_ * 2;
+      const uint32_t minimal = (16 + sizeof(T) - 1) / sizeof(T);
+
+      return required > grown ? required : (grown < minimal ? minimal : grown);
+    }
+
+    void relocate(uint32_t new_capacity)
+    {
+      const auto new_size = static_cast<uint32_t>(new_capacity * sizeof(T));
+
+      if constexpr (is_trivially_relocatable_v<T>)
+      {
+        auto* ptr = static_cast<T*>(heap_->reallocate(data_, capacity_ * sizeof(T), new_size));
+
+        if (ptr == nullptr)
+        {
+          throw std::bad_alloc{};
+        }
+
+        relocation_count_ += ptr != data_ && data_ != nullptr;
+        data_ = ptr;
+      }
+      else
+      {
+        if (data_ != nullptr && heap_->try_expand_in_place(data_, new_size))
+        {
+          capacity_ = new_capacity;
+          return;
+        }
+
+        auto* ptr = static_cast<T*>(heap_->allocate(new_size));
+
+        if (ptr == nullptr)
+        {
+          throw std::bad_alloc{};
+        }
+
+        // The old elements stay intact until every new one is built, a throwing copy leaves the vector as it was.
+        uint32_t constructed = 0;
+
+        try
+        {
+          for (; constructed < size_; constructed++)
+          {
+            new (ptr + constructed) T(std::move_if_noexcept(data_[constructed]));
+          }
+        }
+        catch (...)
+        {
+          for (uint32_t j = 0; j < constructed; j++)
+          {
+            ptr[j].~T();
+          }
+
+          heap_->deallocate_sized(ptr, new_size);
+          throw;
+        }
+
+        destroy_range(0, size_);
+
+        if (data_ != nullptr)
+        {
+          heap_->deallocate_sized(data_, capacity_ * sizeof(T));
+          relocation_count_++;
+        }
+
+        data_ = ptr;
+      }
+
+      capacity_ = new_capacity;
+    }
+
+    void destroy_range(uint32_t first, uint32_t last) noexcept
+    {
+      if constexpr (!std::is_trivially_destructible_v<T>)
+      {
+        for (uint32_t j = first; j < last; j++)
+        {
+          data_[j].~T();
+        }
+      }
+    }
+
+  public:
+    explicit vector(memory_manager* heap = globals::mem_manager) noexcept
+      : heap_{ heap }, data_{}, size_{}, capacity_{}, relocation_count_{}
+    {
+    }
+
+    vector(vector&& other) noexcept
+      : heap_{ other.heap_ }, data_{ other.data_ }, size_{ other.size_ }, capacity_{ other.capacity_ },
+      relocation_count_{ other.relocation_count_ }
+    {
+      other.data_ = nullptr;
+      other.size_ = 0;
+      other.capacity_ = 0;
+    }
+
+    vector& operator=(vector&& other) noexcept
+    {
+      if (this != &other)
+      {
+        destroy_range(0, size_);
+
+        if (data_ != nullptr)
+        {
+          heap_->deallocate_sized(data_, capacity_ * sizeof(T));
+        }
+
+        heap_ = other.heap_;
+        data_ = other.data_;
+        size_ = other.size_;
+        capacity_ = other.capacity_;
+        relocation_count_ = other.relocation_count_;
+        other.data_ = nullptr;
+        other.size_ = 0;
+        other.capacity_ = 0;
+      }
+
+      return *this;
+    }
+
+    ~vector() noexcept
+    {
+      destroy_range(0, size_);
+
+      if (data_ != nullptr)
+      {
+        heap_->deallocate_sized(data_, capacity_ * sizeof(T));
+      }
+    }
+
+    void reserve(uint32_t new_capacity)
+    {
+      if (new_capacity > capacity_)
+      {
+        relocate(new_capacity);
+      }
+    }
+
+    template<class... Args>
+    T& emplace_back(Args&&... args)
+    {
+      if (size_ == capacity_)
+      {
+        // args may refer to an element of this vector, the new element is built before the old block goes away.
+        T value(std::forward<Args>(args)...);
+
+        relocate(next_capacity(size_ + 1));
+        return *new (data_ + size_++) T(std::move(value));
+      }
+
+      return *new (data_ + size_++) T(std::forward<Args>(args)...);
+    }
+
+    void push_back(const T& value)
+    {
+      emplace_back(value);
+    }
+
+    void push_back(T&& value)
+    {
+      emplace_back(std::move(value));
+    }
+
+    void pop_back() noexcept
+    {
+      data_[--size_].~T();
+    }
+
+    void resize(uint32_t new_size)
+    {
+      if (new_size > capacity_)
+      {
+        relocate(next_capacity(new_size));
+      }
+
+      for (; size_ < new_size; size_++)
+      {
+        new (data_ + size_) T{};
+      }
+
+      destroy_range(new_size, size_);
+      size_ = new_size;
+    }
+
+    void clear() noexcept
+    {
+      destroy_range(0, size_);
+      size_ = 0;
+    }
+
+    uint32_t size() const noexcept { return size_; }
+    uint32_t capacity() const noexcept { return capacity_; }
+    bool empty() const noexcept { return size_ == 0; }
+    // Number of times growth had to move the elements to a new block.
+    uint32_t relocation_count() const noexcept { return relocation_count_; }
+
+    T* data() noexcept { return data_; }
+    const T* data() const noexcept { return data_; }
+    T* begin() noexcept { return data_; }
+    T* end() noexcept { return data_ + size_; }
+    const T* begin() const noexcept { return data_; }
+    const T* end() const noexcept { return data_ + size_; }
+
+    T& operator[](uint32_t index) noexcept { return data_[index]; }
+    const T& operator[](uint32_t index) const noexcept { return data_[index]; }
+    T& front() noexcept { return data_[0]; }
+    T& back() noexcept { return data_[size_ - 1]; }
+    const T& front() const noexcept { return data_[0]; }
+    const T& back() const noexcept { return data_[size_ - 1]; }
+  };
+}
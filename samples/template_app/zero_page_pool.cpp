@@ -0,0 +1,261 @@
+#include "zero_page_pool.hpp"
+#include "memory_manager.hpp"
+#include "config.hpp"
+#include "globals.hpp"
+#include <intrin.h>
+#include <cstring>
+#include <new>
+
+namespace hh
+{
+  // Bigger ranges would evict most of the working set, the caller won't touch all of them soon.
+  static constexpr size_t non_temporal_threshold = 0x40000;
+
+  void zero_memory(void* memory, size_t size) noexcept
+  {
+    auto* bytes = static_cast<uint8_t*>(memory);
+
+    if (size >= non_temporal_threshold)
+    {
+      // Align the head with regular stores, stream the middle and leave the tail to memset.
+      const size_t head = (0 - reinterpret_cast<uintptr_t>(bytes)) & 15;
+      const size_t streamed = (size - head) & ~static_cast<size_t>(63);
+
+      memset(bytes, 0, head);
+      zero_memory_non_temporal(bytes + head, streamed);
+
+      bytes += head + streamed;
+      size -= head + streamed;
+    }
+
+    memset(bytes, 0, size);
+  }
+
+  void zero_memory_non_temporal(void* memory, size_t size) noexcept
+  {
+    auto* cursor = static_cast<__m128i*>(memory);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (size_t j = 0; j < size / 64; j++, cursor += 4)
+    {
+      _mm_stream_si128(cursor, zero);
+      _mm_stream_si128(cursor + 1, zero);
+      _mm_stream_si128(cursor + 2, zero);
+      _mm_stream_si128(cursor + 3, zero);
+    }
+
+    // Streaming stores are weakly ordered, the block must be zero before it's published.
+    _mm_sfence();
+  }
+
+  zero_page_pool::zero_page_pool(memory_manager& heap) noexcept : heap_{ heap }, classes_{}, lock_{}, refill_group_{}, refill_tasks_{}
+  {
+    heap_.add_reclaimer(reclaim_procedure, this, reclaim_priority);
+    config::lock_profile::name(&lock_, "zero page pool");
+  }
+
+  zero_page_pool::~zero_page_pool() noexcept
+  {
+    heap_.remove_reclaimer(reclaim_procedure, this);
+
+    // A stopped scheduler has run every task, the group is only pending while one runs.
+    if (auto* scheduler = globals::scheduler; scheduler != nullptr)
+    {
+      scheduler->wait(refill_group_);
+    }
+
+    common::wait_for_application_processors();
+    release();
+  }
+
+  size_t zero_page_pool::release() noexcept
+  {
+    size_t released_bytes = 0;
+
+    for (uint32_t j = 0; j < class_count; j++)
+    {
+      auto& size_class = classes_[j];
+      void* blocks[max_blocks_per_class];
+      uint32_t count = 0;
+
+      {
+        common::spinlock_guard _{ &lock_ };
+
+        count = size_class.count;
+        memcpy(blocks, size_class.blocks, count * sizeof(void*));
+        size_class.count = 0;
+      }
+
+      for (uint32_t k = 0; k < count; k++)
+      {
+        heap_.deallocate_sized(blocks[k], static_cast<uint32_t>(common::page_size << j));
+      }
+
+      released_bytes += (static_cast<size_t>(common::page_size) << j) * count;
+    }
+
+    return released_bytes;
+  }
+
+  size_t zero_page_pool::reclaim_procedure(void* pool, [[maybe_unused]] size_t required_size) noexcept
+  {
+    auto* self = static_cast<zero_page_pool*>(pool);
+
+    {
+      common::spinlock_guard _{ &self->lock_ };
+
+      // A refill in flight means the pool itself ran the heap dry, giving its blocks back would only make
+      // it allocate them again.
+      for (const auto& size_class : self->classes_)
+      {
+        if (size_class.pending != 0)
+        {
+          return 0;
+        }
+      }
+    }
+
+    return self->release();
+  }
+
+  uint32_t zero_page_pool::class_of(size_t size) noexcept
+  {
+    const size_t page_count = (size + common::page_size - 1) / common::page_size;
+    unsigned long highest_bit = 0;
+
+    if (page_count <= 1)
+    {
+      return 0;
+    }
+
+    // Rounds the page count up to a power of two.
+    _BitScanReverse64(&highest_bit, page_count - 1);
+
+    return highest_bit + 1;
+  }
+
+  void zero_page_pool::fill_procedure(void* pool) noexcept
+  {
+    static_cast<zero_page_pool*>(pool)->fill();
+  }
+
+  void zero_page_pool::fill_task(void* pool) noexcept
+  {
+    auto* self = static_cast<zero_page_pool*>(pool);
+
+    self->fill();
+    _InterlockedDecrement(&self->refill_tasks_);
+  }
+
+  // Runs on several processors at once, the pending counters keep them from overfilling a class.
+  void zero_page_pool::fill() noexcept
+  {
+    for (uint32_t j = 0; j < class_count; j++)
+    {
+      auto& size_class = classes_[j];
+      const size_t block_size = static_cast<size_t>(common::page_size) << j;
+
+      while (true)
+      {
+        {
+          common::spinlock_guard _{ &lock_ };
+
+          if (size_class.count + size_class.pending >= block_targets_[j])
+          {
+            break;
+          }
+
+          size_class.pending++;
+        }
+
+        // APs can't grow the heap, a failure here means the heap is full for now.
+        auto* block = heap_.allocate_align(static_cast<uint32_t>(block_size), std::align_val_t{ common::page_size });
+
+        if (block != nullptr)
+        {
+          zero_memory_non_temporal(block, block_size);
+        }
+
+        common::spinlock_guard _{ &lock_ };
+
+        size_class.pending--;
+
+        if (block == nullptr)
+        {
+          return;
+        }
+
+        size_class.blocks[size_class.count++] = block;
+      }
+    }
+  }
+
+  void* zero_page_pool::take(size_t size) noexcept
+  {
+    if (size > max_block_size)
+    {
+      return nullptr;
+    }
+
+    const uint32_t class_index = class_of(size);
+    auto& size_class = classes_[class_index];
+    void* block = nullptr;
+    bool running_low = false;
+
+    {
+      common::spinlock_guard _{ &lock_ };
+
+      if (size_class.count != 0)
+      {
+        block = size_class.blocks[--size_class.count];
+      }
+
+      running_low = size_class.count + size_class.pending < block_targets_[class_index] / 2;
+    }
+
+    // Without a scheduler only the BSP can hand the refill to the APs.
+    if (running_low && !spawn_refill() && globals::boot_state && common::is_bootstrap_processor())
+    {
+      start_refill();
+    }
+
+    return block;
+  }
+
+  bool zero_page_pool::spawn_refill() noexcept
+  {
+    auto* scheduler = globals::scheduler;
+
+    if (scheduler == nullptr || scheduler->concurrency() < 2)
+    {
+      return false;
+    }
+
+    // One task per AP, the processor that spawns them has work of its own.
+    const long task_count = static_cast<long>(scheduler->concurrency() - 1);
+
+    if (_InterlockedCompareExchange(&refill_tasks_, task_count, 0) == 0)
+    {
+      for (long j = 0; j < task_count; j++)
+      {
+        scheduler->spawn(refill_group_, fill_task, this);
+      }
+    }
+
+    return true;
+  }
+
+  bool zero_page_pool::start_refill() noexcept
+  {
+    return common::processor_count() > 1 && common::application_processors_idle()
+      && common::start_on_application_processors(fill_procedure, this);
+  }
+
+  void zero_page_pool::refill() noexcept
+  {
+    if (!spawn_refill() && !start_refill())
+    {
+      fill();
+    }
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include "delete_constructors.hpp"
+#include "common.hpp"
+#include "task_scheduler.hpp"
+#include <cstdint>
+#include <cstddef>
+
+namespace hh
+{
+  class memory_manager;
+
+  // Zeroes size bytes. Ranges of non_temporal_threshold bytes and more are streamed past the cache,
+  // smaller ones are left hot for the caller.
+  void zero_memory(void* memory, size_t size) noexcept;
+  // Streams zeroes past the cache. Memory must be 16 byte aligned and size a multiple of 64.
+  void zero_memory_non_temporal(void* memory, size_t size) noexcept;
+
+  // Page aligned blocks of a heap zeroed ahead of time, in power of two sizes from 4 KB to max_block_size.
+  // refill() is called on the BSP at idle points and hands the work to the APs, which allocate the missing
+  // blocks and zero them while the BSP goes on. Taking a block is then a pop. Whenever a class drops below
+  // half its target take() refills it the same way: as tasks while globals::scheduler runs, otherwise with
+  // StartupAllAPs if it runs on the BSP and the APs are idle. When the APs are busy, or there are none,
+  // refill() does the work on the BSP. Pooled blocks are allocated in the heap and are freed to it like any
+  // other block. The pool registers itself as a reclaimer of the heap and gives its blocks back when the heap
+  // runs out.
+  class zero_page_pool : non_relocatable
+  {
+  public:
+    static constexpr uint32_t class_count = 5;
+    static constexpr size_t max_block_size = static_cast<size_t>(common::page_size) << (class_count - 1);
+    // Zeroed pages are the cheapest cache to rebuild.
+    static constexpr uint32_t reclaim_priority = 0;
+
+  private:
+    static constexpr uint32_t max_blocks_per_class = 64;
+    // 448 KB in total, page tables and descriptor rings take the small blocks.
+    static constexpr uint32_t block_targets_[class_count] = { 32, 8, 4, 2, 2 };
+
+    struct size_class
+    {
+      void* blocks[max_blocks_per_class];
+      uint32_t count;
+      // Blocks being allocated and zeroed by the processors that run fill().
+      uint32_t pending;
+    };
+
+    memory_manager& heap_;
+    size_class classes_[class_count];
+    volatile long lock_;
+    // Refill tasks spawned into the scheduler that haven't finished yet.
+    task_group refill_group_;
+    volatile long refill_tasks_;
+
+  private:
+    static uint32_t class_of(size_t size) noexcept;
+    static void fill_procedure(void* pool) noexcept;
+    static void fill_task(void* pool) noexcept;
+    static size_t reclaim_procedure(void* pool, size_t required_size) noexcept;
+    void fill() noexcept;
+    // Spawns refill tasks unless some are still running. Returns false if no scheduler runs on the APs.
+    bool spawn_refill() noexcept;
+    // Runs fill() on the APs unless they are busy. Returns false if they didn't take it.
+    // BSP only, boot services must be available.
+    bool start_refill() noexcept;
+
+  public:
+    explicit zero_page_pool(memory_manager& heap) noexcept;
+    // Gives every pooled block back to the heap. Returns the number of bytes released.
+    size_t release() noexcept;
+    // Waits for the refills in flight and gives every pooled block back to the heap.
+    ~zero_page_pool() noexcept;
+
+    // Zeroed block of at least size bytes or nullptr when the pool has none ready. Any processor.
+    void* take(size_t size) noexcept;
+    // Tops the pool up on the APs, or on the caller if they are busy with something else.
+    // BSP only, boot services must be available.
+    void refill() noexcept;
+  };
+}